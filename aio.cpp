@@ -0,0 +1,487 @@
+#include <cstring>
+#include <algorithm>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "aio.h"
+
+// picks the backend requested through the environment
+static AioBackend
+backend_from_env()
+{
+    const char *name = getenv("FS_AIO");
+    if (name != nullptr && strcmp(name, "off") == 0)
+        return AIO_SYNC;
+    if (name != nullptr && strcmp(name, "threads") == 0)
+        return AIO_THREADS;
+    return AIO_URING;
+}
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+AioEngine::AioEngine() : backend(backend_from_env())
+{
+
+}
+
+AioEngine::~AioEngine()
+{
+    shutdown();
+}
+
+// sets the file requests go to
+void
+AioEngine::attach(int fd)
+{
+    shutdown();
+    std::lock_guard<std::mutex> guard(lock);
+    this->fd = fd;
+}
+
+// Starts the backend, falling back to the thread pool if the kernel
+// refuses io_uring. Called with lock held.
+void
+AioEngine::start()
+{
+    started = true;
+    if (backend == AIO_URING && !setup_uring())
+    {
+        backend = AIO_THREADS;
+    }
+    if (backend == AIO_THREADS)
+    {
+        for (unsigned i = 0; i < AIO_POOL_THREADS; i++)
+        {
+            workers.emplace_back(&AioEngine::run_worker, this);
+        }
+    }
+}
+
+// Creates the rings and maps them, false if io_uring isn't available
+bool
+AioEngine::setup_uring()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = uring_setup(AIO_QUEUE_DEPTH, &params);
+    if (ring_fd < 0)
+    {
+        return false;
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+    {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+    {
+        sq_ring = nullptr;
+        close_uring();
+        return false;
+    }
+    cq_ring = sq_ring;
+    if (!single)
+    {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+        {
+            cq_ring = nullptr;
+            close_uring();
+            return false;
+        }
+    }
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *entries = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring_fd, IORING_OFF_SQES);
+    if (entries == MAP_FAILED)
+    {
+        close_uring();
+        return false;
+    }
+    sqes = static_cast<struct io_uring_sqe*>(entries);
+
+    uint8_t *sq = static_cast<uint8_t*>(sq_ring);
+    uint8_t *cq = static_cast<uint8_t*>(cq_ring);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    sq_entries = params.sq_entries;
+    in_flight = 0;
+    unsubmitted = 0;
+    reaping = false;
+    return true;
+}
+
+// Unmaps the rings and closes the ring
+void
+AioEngine::close_uring()
+{
+    if (sqes != nullptr)
+    {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_ring != nullptr && cq_ring != sq_ring)
+    {
+        munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != nullptr)
+    {
+        munmap(sq_ring, sq_ring_size);
+    }
+    if (ring_fd >= 0)
+    {
+        close(ring_fd);
+    }
+    sqes = nullptr;
+    cq_ring = sq_ring = nullptr;
+    ring_fd = -1;
+}
+
+// waits for everything in flight and stops the backend
+void
+AioEngine::shutdown()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    if (!started)
+    {
+        return;
+    }
+    if (backend == AIO_URING)
+    {
+        while (in_flight > 0)
+        {
+            if (reap(guard, true) != 0)
+            {
+                break;
+            }
+        }
+        close_uring();
+    }
+    else if (backend == AIO_THREADS)
+    {
+        // Workers only stop once the queue is empty
+        stopping = true;
+        guard.unlock();
+        queued.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            workers[i].join();
+        }
+        guard.lock();
+        workers.clear();
+        stopping = false;
+    }
+    started = false;
+}
+
+// picks the backend, shutting down the running one first
+void
+AioEngine::set_backend(AioBackend backend)
+{
+    shutdown();
+    std::lock_guard<std::mutex> guard(lock);
+    this->backend = backend;
+}
+
+AioBackend
+AioEngine::get_backend()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return backend;
+}
+
+// Moves the bytes of iov from done on synchronously, a short read at the
+// end of the file leaves zeroes. Returns 0 or -1 on an I/O error.
+int
+AioEngine::finish(int fd, bool write, struct iovec iov, off_t offset, size_t done)
+{
+    uint8_t *buf = static_cast<uint8_t*>(iov.iov_base);
+    while (done < iov.iov_len)
+    {
+        ssize_t bytes = write ? pwrite(fd, buf + done, iov.iov_len - done, offset + done)
+                              : pread(fd, buf + done, iov.iov_len - done, offset + done);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes < 0)
+        {
+            return -1;
+        }
+        if (bytes == 0)
+        {
+            if (write)
+            {
+                return -1;
+            }
+            memset(buf + done, 0, iov.iov_len - done);
+            break;
+        }
+        done += bytes;
+    }
+    return 0;
+}
+
+// Collects finished io_uring requests, waiting for at least one if block
+// is set. Short transfers are completed synchronously. Called with lock
+// held through guard. One thread at a time waits in the kernel, with lock
+// released as run_worker does around its I/O, and walks the completion
+// ring when it is back; the others wait on finished meanwhile. Returns -1
+// if the ring fails.
+int
+AioEngine::reap(std::unique_lock<std::mutex>& guard, bool block)
+{
+    if (block && reaping)
+    {
+        finished.wait(guard);
+        return 0;
+    }
+    int entered = 0;
+    int error = 0;
+    bool ready = *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    if (block && !ready)
+    {
+        // Nothing else walks the completion ring until reaping is cleared,
+        // so what the kernel wakes us for is still there
+        unsigned pending = unsubmitted;
+        reaping = true;
+        guard.unlock();
+        entered = uring_enter(ring_fd, pending, 1, IORING_ENTER_GETEVENTS);
+        error = errno;
+        guard.lock();
+        reaping = false;
+    }
+    else if (unsubmitted > 0)
+    {
+        entered = uring_enter(ring_fd, unsubmitted, 0, 0);
+        error = errno;
+    }
+    if (entered < 0 && error != EINTR && error != EAGAIN && error != EBUSY)
+    {
+        finished.notify_all();
+        return -1;
+    }
+    if (entered > 0)
+    {
+        unsubmitted -= entered;
+    }
+    if (reaping)
+    {
+        return 0; // the thread in the kernel walks the ring when it is back
+    }
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    bool reaped = head != tail;
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        auto it = requests.find(cqe->user_data);
+        if (it != requests.end())
+        {
+            request& r = it->second;
+            r.result = (cqe->res < 0) ? -1 : finish(fd, r.write, r.iov, r.offset, cqe->res);
+            r.done = true;
+        }
+        in_flight--;
+        head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    if (reaped || block)
+    {
+        finished.notify_all();
+    }
+    return 0;
+}
+
+// A worker of the thread pool: carries out queued requests until the
+// engine stops and the queue is empty
+void
+AioEngine::run_worker()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while (true)
+    {
+        while (!stopping && queue.empty())
+        {
+            queued.wait(guard);
+        }
+        if (queue.empty())
+        {
+            return;
+        }
+        uint64_t ticket = queue.front();
+        queue.pop_front();
+        auto it = requests.find(ticket);
+        if (it == requests.end())
+        {
+            continue;
+        }
+        request r = it->second;
+
+        guard.unlock();
+        int result = finish(fd, r.write, r.iov, r.offset, 0);
+        guard.lock();
+
+        it = requests.find(ticket);
+        it->second.result = result;
+        it->second.done = true;
+        finished.notify_all();
+    }
+}
+
+// starts moving len bytes between buf and offset in the file
+uint64_t
+AioEngine::submit(bool write, uint8_t *buf, size_t len, off_t offset)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    // The ring holds at most sq_entries requests, so the completion ring
+    // (twice as large) never overflows. Waiting for room lets go of lock,
+    // so the backend is looked at again after it.
+    while (true)
+    {
+        if (!started)
+        {
+            start();
+        }
+        if (backend != AIO_URING || in_flight < sq_entries)
+        {
+            break;
+        }
+        if (reap(guard, true) != 0)
+        {
+            return 0;
+        }
+    }
+    uint64_t ticket = next_ticket++;
+    request& r = requests[ticket];
+    r.write = write;
+    r.iov.iov_base = buf;
+    r.iov.iov_len = len;
+    r.offset = offset;
+    r.done = false;
+    r.result = 0;
+
+    if (backend == AIO_SYNC)
+    {
+        r.result = finish(fd, write, r.iov, offset, 0);
+        r.done = true;
+        return ticket;
+    }
+    if (backend == AIO_THREADS)
+    {
+        queue.push_back(ticket);
+        queued.notify_one();
+        return ticket;
+    }
+
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&r.iov);
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = ticket;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    in_flight++;
+
+    unsubmitted++;
+
+    // An entry the kernel doesn't take now goes with the next enter, which
+    // reap makes while waiting
+    int entered;
+    do
+    {
+        entered = uring_enter(ring_fd, unsubmitted, 0, 0);
+    } while (entered < 0 && errno == EINTR);
+    if (entered > 0)
+    {
+        unsubmitted -= entered;
+    }
+    return ticket;
+}
+
+// a ticket for a request that was carried out without the engine
+uint64_t
+AioEngine::completed(bool write, int result)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t ticket = next_ticket++;
+    request& r = requests[ticket];
+    r.write = write;
+    r.done = true;
+    r.result = result;
+    return ticket;
+}
+
+// true if the request is done
+bool
+AioEngine::poll(uint64_t ticket)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    if (started && backend == AIO_URING)
+    {
+        reap(guard, false);
+    }
+    auto it = requests.find(ticket);
+    return it == requests.end() || it->second.done;
+}
+
+// waits for the request to finish and forgets the ticket
+int
+AioEngine::wait(uint64_t ticket, bool& write)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    write = false;
+    auto it = requests.find(ticket);
+    if (it == requests.end())
+    {
+        return -1;
+    }
+    while (!it->second.done)
+    {
+        if (backend == AIO_URING)
+        {
+            if (reap(guard, true) != 0)
+            {
+                requests.erase(it);
+                return -1;
+            }
+        }
+        else
+        {
+            finished.wait(guard);
+        }
+        it = requests.find(ticket);
+    }
+    write = it->second.write;
+    int result = it->second.result;
+    requests.erase(it);
+    return result;
+}
@@ -0,0 +1,108 @@
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifndef __AIO_H__
+#define __AIO_H__
+
+// requests io_uring keeps in flight before submit waits for one to finish
+#define AIO_QUEUE_DEPTH 64
+// worker threads of the fallback engine
+#define AIO_POOL_THREADS 4
+
+// how asynchronous requests are carried out
+enum AioBackend {
+    AIO_SYNC,    // done at once by submit, nothing is ever in flight
+    AIO_URING,   // io_uring, driven through the raw system calls
+    AIO_THREADS  // a small pool of threads doing preadv / pwritev
+};
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Asynchronous reads and writes of byte ranges of one file. Requests are
+// named by tickets, which must each be waited for once.
+class AioEngine {
+private:
+    struct request {
+        bool write;
+        struct iovec iov;
+        off_t offset;
+        bool done;
+        int result;
+    };
+    int fd = -1;
+    AioBackend backend = AIO_SYNC;
+    bool started = false;
+    uint64_t next_ticket = 1;
+    std::unordered_map<uint64_t, request> requests;
+    std::mutex lock;
+    std::condition_variable finished;
+
+    // io_uring rings, mapped from the kernel
+    int ring_fd = -1;
+    void *sq_ring = nullptr;
+    void *cq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_mask = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned *cq_mask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    unsigned sq_entries = 0;
+    unsigned in_flight = 0;
+    // entries in the submission ring the kernel hasn't taken yet
+    unsigned unsubmitted = 0;
+    // a thread is waiting in io_uring_enter without lock
+    bool reaping = false;
+
+    // thread pool, queue holds tickets not picked up yet
+    std::vector<std::thread> workers;
+    std::deque<uint64_t> queue;
+    std::condition_variable queued;
+    bool stopping = false;
+
+    void start();
+    bool setup_uring();
+    void close_uring();
+    int reap(std::unique_lock<std::mutex>& guard, bool block);
+    void run_worker();
+    static int finish(int fd, bool write, struct iovec iov, off_t offset, size_t done);
+public:
+    AioEngine();
+    ~AioEngine();
+    // sets the file requests go to, the backend is started by the first
+    // request. The backend is taken from the FS_AIO environment variable
+    // ("uring", "threads" or "off"), default is io_uring when the kernel
+    // allows it and the thread pool otherwise.
+    void attach(int fd);
+    // waits for everything in flight and stops the backend
+    void shutdown();
+    // picks the backend, shutting down the running one first
+    void set_backend(AioBackend backend);
+    AioBackend get_backend();
+    // starts moving len bytes between buf and offset in the file, returns
+    // a ticket for wait. buf must stay valid until the request is done.
+    uint64_t submit(bool write, uint8_t *buf, size_t len, off_t offset);
+    // a ticket for a request that was carried out without the engine
+    uint64_t completed(bool write, int result);
+    // true if the request is done, wait then returns at once
+    bool poll(uint64_t ticket);
+    // waits for the request to finish and forgets the ticket, returns 0 or
+    // -1 on an I/O error. write tells whether it was a write.
+    int wait(uint64_t ticket, bool& write);
+};
+
+#endif // __AIO_H__
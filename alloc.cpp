@@ -0,0 +1,368 @@
+#include <iostream>
+#include "alloc.h"
+
+#define WORD_BITS 64
+#define FULL_WORD (~0ULL)
+
+// rebuilds the bitmap from a FAT with no_blocks entries
+void
+BlockAllocator::build(const int32_t *fat, unsigned no_blocks)
+{
+    this->no_blocks = no_blocks;
+    unsigned words = (no_blocks + WORD_BITS - 1) / WORD_BITS;
+    bitmap.assign(words, 0);
+    summary.assign((words + WORD_BITS - 1) / WORD_BITS, 0);
+    no_free = 0;
+    next_hint = 0;
+
+    // Bits past the last block are permanently used
+    for (unsigned i = no_blocks; i < words * WORD_BITS; i++)
+    {
+        bitmap[i / WORD_BITS] |= 1ULL << (i % WORD_BITS);
+    }
+    for (unsigned i = 0; i < no_blocks; i++)
+    {
+        if (fat[i] == 0) // FAT_FREE
+        {
+            no_free++;
+        }
+        else
+        {
+            bitmap[i / WORD_BITS] |= 1ULL << (i % WORD_BITS);
+        }
+    }
+    for (unsigned w = 0; w < words; w++)
+    {
+        if (bitmap[w] == FULL_WORD)
+        {
+            summary[w / WORD_BITS] |= 1ULL << (w % WORD_BITS);
+        }
+    }
+}
+
+void
+BlockAllocator::markUsed(unsigned block_no)
+{
+    unsigned w = block_no / WORD_BITS;
+    bitmap[w] |= 1ULL << (block_no % WORD_BITS);
+    if (bitmap[w] == FULL_WORD)
+    {
+        summary[w / WORD_BITS] |= 1ULL << (w % WORD_BITS);
+    }
+    no_free--;
+}
+
+void
+BlockAllocator::markFree(unsigned block_no)
+{
+    unsigned w = block_no / WORD_BITS;
+    bitmap[w] &= ~(1ULL << (block_no % WORD_BITS));
+    summary[w / WORD_BITS] &= ~(1ULL << (w % WORD_BITS));
+    no_free++;
+}
+
+// Returns the first bitmap word at or after fromWord with a free bit, -1 if none
+int
+BlockAllocator::findFreeWord(unsigned fromWord)
+{
+    unsigned s = fromWord / WORD_BITS;
+    if (s >= summary.size())
+    {
+        return -1;
+    }
+    // Ignore words before fromWord in the first summary word
+    uint64_t notFull = ~summary[s] & (FULL_WORD << (fromWord % WORD_BITS));
+    while (true)
+    {
+        if (notFull != 0)
+        {
+            unsigned w = s * WORD_BITS + __builtin_ctzll(notFull);
+            return (w < bitmap.size()) ? (int)w : -1;
+        }
+        if (++s >= summary.size())
+        {
+            return -1;
+        }
+        notFull = ~summary[s];
+    }
+}
+
+// Returns the first free block at or after from, no_blocks if there is none
+unsigned
+BlockAllocator::findFree(unsigned from)
+{
+    if (from >= no_blocks)
+    {
+        return no_blocks;
+    }
+    unsigned w = from / WORD_BITS;
+    uint64_t freeBits = ~bitmap[w] & (FULL_WORD << (from % WORD_BITS));
+    if (freeBits == 0)
+    {
+        int next = findFreeWord(w + 1);
+        if (next < 0)
+        {
+            return no_blocks;
+        }
+        w = next;
+        freeBits = ~bitmap[w];
+    }
+    unsigned block_no = w * WORD_BITS + __builtin_ctzll(freeBits);
+    return (block_no < no_blocks) ? block_no : no_blocks;
+}
+
+// Returns the first used block at or after from, no_blocks if there is none
+unsigned
+BlockAllocator::findUsed(unsigned from)
+{
+    unsigned w = from / WORD_BITS;
+    if (w >= bitmap.size())
+    {
+        return no_blocks;
+    }
+    uint64_t usedBits = bitmap[w] & (FULL_WORD << (from % WORD_BITS));
+    while (usedBits == 0)
+    {
+        if (++w >= bitmap.size())
+        {
+            return no_blocks;
+        }
+        usedBits = bitmap[w];
+    }
+    unsigned block_no = w * WORD_BITS + __builtin_ctzll(usedBits);
+    return (block_no < no_blocks) ? block_no : no_blocks;
+}
+
+// Finds the first free run starting in [from, end), runs are not cut at end
+bool
+BlockAllocator::nextFreeRun(unsigned from, unsigned end, unsigned& start, unsigned& length)
+{
+    start = findFree(from);
+    if (start >= end || start >= no_blocks)
+    {
+        return false;
+    }
+    length = findUsed(start) - start;
+    return true;
+}
+
+// First free run of at least count blocks, searching from goal and wrapping
+// around to the start of the disk, -1 if there is none
+int
+BlockAllocator::findFit(unsigned count, unsigned goal)
+{
+    unsigned start, length;
+    if (goal >= no_blocks)
+    {
+        goal = 0;
+    }
+    // A free run containing goal counts from goal
+    unsigned from = goal;
+    while (nextFreeRun(from, no_blocks, start, length))
+    {
+        if (length >= count)
+        {
+            return start;
+        }
+        from = start + length;
+    }
+    from = 0;
+    while (nextFreeRun(from, goal, start, length))
+    {
+        if (length >= count)
+        {
+            return start;
+        }
+        from = start + length;
+    }
+    return -1;
+}
+
+// Smallest free run of at least count blocks, the one closest to goal on
+// ties, -1 if there is none
+int
+BlockAllocator::findBestFit(unsigned count, unsigned goal)
+{
+    int best = -1;
+    unsigned bestLength = 0;
+    unsigned bestDistance = 0;
+    unsigned start, length;
+    unsigned from = 0;
+    while (nextFreeRun(from, no_blocks, start, length))
+    {
+        unsigned distance = (start > goal) ? start - goal : goal - start;
+        if (length >= count && (best < 0 || length < bestLength ||
+            (length == bestLength && distance < bestDistance)))
+        {
+            best = start;
+            bestLength = length;
+            bestDistance = distance;
+            if (length == count && distance == 0)
+            {
+                break;
+            }
+        }
+        from = start + length;
+    }
+    return best;
+}
+
+// Marks count blocks from start as used and appends them to out
+void
+BlockAllocator::takeRun(unsigned start, unsigned count, std::vector<uint16_t>& out)
+{
+    for (unsigned i = 0; i < count; i++)
+    {
+        markUsed(start + i);
+        out.push_back(start + i);
+    }
+    next_hint = start + count;
+}
+
+// returns a free block following the policy from the start of the disk,
+// -1 if the disk is full
+int
+BlockAllocator::allocate()
+{
+    return allocate(0);
+}
+
+// returns a free block as close after goal as possible (or after the
+// previous allocation for next-fit), -1 if the disk is full
+int
+BlockAllocator::allocate(unsigned goal)
+{
+    return allocate_run(1, goal);
+}
+
+// allocates count contiguous blocks following the policy, returns the
+// first one or -1 if there is no free run that long
+int
+BlockAllocator::allocate_run(unsigned count, unsigned goal)
+{
+    if (count == 0 || count > no_free)
+    {
+        return -1;
+    }
+    int start;
+    switch (policy)
+    {
+    case ALLOC_NEXT_FIT:
+        start = findFit(count, next_hint);
+        break;
+    case ALLOC_BEST_FIT:
+        start = findBestFit(count, goal);
+        break;
+    default:
+        start = findFit(count, goal);
+        break;
+    }
+    if (start < 0)
+    {
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++)
+    {
+        markUsed(start + i);
+    }
+    next_hint = start + count;
+    return start;
+}
+
+// allocates count blocks into out following the policy, as one
+// contiguous run near goal if possible, otherwise in as few runs as the
+// policy finds. Nothing is allocated on failure.
+int
+BlockAllocator::allocate_blocks(unsigned count, std::vector<uint16_t>& out, unsigned goal)
+{
+    if (count > no_free)
+    {
+        return -1;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    int first = allocate_run(count, goal);
+    if (first >= 0)
+    {
+        for (unsigned i = 0; i < count; i++)
+        {
+            out.push_back(first + i);
+        }
+        return 0;
+    }
+
+    // No single run is long enough, so the file will be split
+    unsigned left = count;
+    while (left > 0)
+    {
+        unsigned start, length;
+        if (policy == ALLOC_BEST_FIT)
+        {
+            // Largest runs first gives the fewest pieces
+            unsigned from = 0, bestStart = 0, bestLength = 0;
+            while (nextFreeRun(from, no_blocks, start, length))
+            {
+                if (length > bestLength)
+                {
+                    bestStart = start;
+                    bestLength = length;
+                }
+                from = start + length;
+            }
+            start = bestStart;
+            length = bestLength;
+        }
+        else
+        {
+            unsigned from = (policy == ALLOC_NEXT_FIT) ? next_hint : goal;
+            start = findFree(from);
+            if (start >= no_blocks)
+            {
+                start = findFree(0);
+            }
+            length = findUsed(start) - start;
+        }
+        unsigned take = (length < left) ? length : left;
+        takeRun(start, take, out);
+        left -= take;
+    }
+    return 0;
+}
+
+// returns a block to the free pool
+void
+BlockAllocator::release(unsigned block_no)
+{
+    if (block_no < no_blocks && !is_free(block_no))
+    {
+        markFree(block_no);
+    }
+}
+
+bool
+BlockAllocator::is_free(unsigned block_no)
+{
+    return !(bitmap[block_no / WORD_BITS] & (1ULL << (block_no % WORD_BITS)));
+}
+
+// number of free runs and the length of the longest one
+void
+BlockAllocator::free_runs(unsigned& runs, unsigned& longest)
+{
+    runs = 0;
+    longest = 0;
+    unsigned start, length;
+    unsigned from = 0;
+    while (nextFreeRun(from, no_blocks, start, length))
+    {
+        runs++;
+        if (length > longest)
+        {
+            longest = length;
+        }
+        from = start + length;
+    }
+}
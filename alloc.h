@@ -0,0 +1,65 @@
+#include <iostream>
+#include <cstdint>
+#include <vector>
+
+#ifndef __ALLOC_H__
+#define __ALLOC_H__
+
+// where new blocks are placed, chosen when the disk is formatted
+enum AllocPolicy {
+    ALLOC_FIRST_FIT, // first free run long enough, searching from the goal block
+    ALLOC_NEXT_FIT,  // first free run long enough after the previous allocation
+    ALLOC_BEST_FIT   // smallest free run long enough, closest to the goal block
+};
+
+// In-memory free-space bitmap, built from the FAT at mount time. One bit
+// per block (1 = used), plus a summary bit per bitmap word that is set when
+// all 64 blocks of the word are used, so a free block is found without
+// walking the FAT.
+class BlockAllocator {
+private:
+    std::vector<uint64_t> bitmap;
+    std::vector<uint64_t> summary;
+    unsigned no_blocks = 0;
+    unsigned no_free = 0;
+    AllocPolicy policy = ALLOC_FIRST_FIT;
+    // block after the end of the previous allocation, for next-fit
+    unsigned next_hint = 0;
+
+    void markUsed(unsigned block_no);
+    void markFree(unsigned block_no);
+    int findFreeWord(unsigned fromWord);
+    unsigned findFree(unsigned from);
+    unsigned findUsed(unsigned from);
+    bool nextFreeRun(unsigned from, unsigned end, unsigned& start, unsigned& length);
+    int findFit(unsigned count, unsigned goal);
+    int findBestFit(unsigned count, unsigned goal);
+    void takeRun(unsigned start, unsigned count, std::vector<uint16_t>& out);
+public:
+    // rebuilds the bitmap from a FAT with no_blocks entries
+    void build(const int32_t *fat, unsigned no_blocks);
+    void set_policy(AllocPolicy policy) { this->policy = policy; }
+    AllocPolicy get_policy() { return policy; }
+    // returns a free block following the policy from the start of the disk,
+    // -1 if the disk is full
+    int allocate();
+    // returns a free block as close after goal as possible (or after the
+    // previous allocation for next-fit), -1 if the disk is full
+    int allocate(unsigned goal);
+    // allocates count contiguous blocks following the policy, returns the
+    // first one or -1 if there is no free run that long
+    int allocate_run(unsigned count, unsigned goal = 0);
+    // allocates count blocks into out following the policy, as one
+    // contiguous run near goal if possible, otherwise in as few runs as the
+    // policy finds. Nothing is allocated on failure.
+    int allocate_blocks(unsigned count, std::vector<uint16_t>& out, unsigned goal = 0);
+    // returns a block to the free pool
+    void release(unsigned block_no);
+    bool is_free(unsigned block_no);
+    unsigned get_free_count() { return no_free; }
+    unsigned get_no_blocks() { return no_blocks; }
+    // number of free runs and the length of the longest one
+    void free_runs(unsigned& runs, unsigned& longest);
+};
+
+#endif // __ALLOC_H__
@@ -0,0 +1,93 @@
+// Times cat of a large file with each way of carrying out the reads cat
+// keeps in flight, with the disk file in the page cache and dropped from
+// it first.
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fs.h"
+
+#define INPUT_FILE "/tmp/bench_aio.txt"
+// scratch disk image, the shell's diskfile.bin is left alone
+#define BENCH_DISK "/tmp/bench_aio.bin"
+#define FILE_SIZE (24 << 20)
+#define NO_BLOCKS 16384
+#define ROUNDS 5
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Drops the pages of the disk file from the page cache, so reads have to
+// go to the device
+static void
+drop_page_cache()
+{
+    int fd = open(BENCH_DISK, O_RDONLY);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// Average time of a cat of the file in ms, output thrown away
+static double
+time_cat(FS& filesystem, bool cold)
+{
+    std::ofstream devnull("/dev/null");
+    double total = 0;
+    for (unsigned i = 0; i < ROUNDS; i++) {
+        if (cold)
+            drop_page_cache();
+        std::streambuf *out = std::cout.rdbuf(devnull.rdbuf());
+        bench_clock::time_point start = bench_clock::now();
+        filesystem.cat("/big");
+        total += std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+        std::cout.rdbuf(out);
+    }
+    return total / ROUNDS;
+}
+
+static void
+run(FS& filesystem, const char *name, AioBackend backend)
+{
+    filesystem.set_aio_backend(backend);
+    std::cout << std::left << std::setw(10) << name
+              << std::setw(14) << std::fixed << std::setprecision(2) << time_cat(filesystem, true)
+              << time_cat(filesystem, false) << std::endl;
+}
+
+int
+main()
+{
+    {
+        std::ofstream f(INPUT_FILE);
+        f << std::string(FILE_SIZE, 'x');
+    }
+    FS filesystem(BENCH_DISK);
+    format_options options;
+    options.block_size = BLOCK_SIZE;
+    options.no_blocks = NO_BLOCKS;
+    filesystem.format(options);
+
+    int fw = open(INPUT_FILE, O_RDONLY);
+    dup2(fw, 0);
+    close(fw);
+    std::cin.clear();
+    if (filesystem.create("/big", FILE_SIZE) != 0) {
+        std::cout << "create failed" << std::endl;
+        return 1;
+    }
+    filesystem.sync();
+
+    std::cout << std::left << std::setw(10) << "engine" << std::setw(14) << "cold (ms)"
+              << "warm (ms)" << std::endl;
+    run(filesystem, "off", AIO_SYNC);
+    run(filesystem, "threads", AIO_THREADS);
+    run(filesystem, "uring", AIO_URING);
+
+    unlink(BENCH_DISK);
+    unlink(INPUT_FILE);
+    return 0;
+}
@@ -0,0 +1,100 @@
+// Microbenchmark of block allocation on a nearly full disk: the linear
+// FAT scan the file system used to do for every block, against the
+// BlockAllocator free-space bitmap.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include "alloc.h"
+
+#define FAT_FREE 0
+#define FAT_EOF -1
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double
+elapsed_ns(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+}
+
+// Marks all but `free_blocks` random blocks as used
+static void
+fill_fat(std::vector<int32_t>& fat, unsigned free_blocks)
+{
+    srand(1);
+    for (size_t i = 0; i < fat.size(); i++)
+        fat[i] = FAT_EOF;
+    unsigned freed = 0;
+    while (freed < free_blocks) {
+        unsigned b = 2 + rand() % (fat.size() - 2);
+        if (fat[b] != FAT_FREE) {
+            fat[b] = FAT_FREE;
+            freed++;
+        }
+    }
+}
+
+// The old way: restart the scan from block 0 for every block
+static int
+linear_alloc(std::vector<int32_t>& fat)
+{
+    for (size_t i = 0; i < fat.size(); i++) {
+        if (fat[i] == FAT_FREE) {
+            fat[i] = FAT_EOF;
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void
+run(unsigned no_blocks, unsigned free_blocks, unsigned rounds)
+{
+    std::vector<int32_t> fat(no_blocks);
+    fill_fat(fat, free_blocks);
+    std::vector<int> got(free_blocks);
+
+    // Allocate every free block, then free them again, `rounds` times
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned r = 0; r < rounds; r++) {
+        for (unsigned i = 0; i < free_blocks; i++)
+            got[i] = linear_alloc(fat);
+        for (unsigned i = 0; i < free_blocks; i++)
+            fat[got[i]] = FAT_FREE;
+    }
+    double linear = elapsed_ns(start) / (double(rounds) * free_blocks);
+
+    BlockAllocator allocator;
+    allocator.build(fat.data(), no_blocks);
+    start = bench_clock::now();
+    for (unsigned r = 0; r < rounds; r++) {
+        for (unsigned i = 0; i < free_blocks; i++)
+            got[i] = allocator.allocate();
+        for (unsigned i = 0; i < free_blocks; i++)
+            allocator.release(got[i]);
+    }
+    double bitmap = elapsed_ns(start) / (double(rounds) * free_blocks);
+
+    std::cout << std::left << std::setw(10) << no_blocks
+              << std::setw(10) << free_blocks
+              << std::setw(18) << std::fixed << std::setprecision(1) << linear
+              << std::setw(18) << bitmap
+              << std::setprecision(1) << linear / bitmap << "x" << std::endl;
+}
+
+int
+main()
+{
+    std::cout << "Allocation cost per block on a nearly full disk (ns)" << std::endl;
+    std::cout << std::left << std::setw(10) << "blocks" << std::setw(10) << "free"
+              << std::setw(18) << "linear FAT scan" << std::setw(18) << "bitmap"
+              << "speedup" << std::endl;
+    run(2048, 20, 2000);
+    run(2048, 200, 200);
+    run(65535, 600, 25);
+    run(65535, 6000, 3);
+    return 0;
+}
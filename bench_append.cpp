@@ -0,0 +1,78 @@
+// Measures repeated small appends to a large log file. Each append should
+// only touch the tail of the log, whatever its size.
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fs.h"
+
+#define INPUT_FILE "/tmp/bench_append.txt"
+// scratch disk image, the shell's diskfile.bin is left alone
+#define BENCH_DISK "/tmp/bench_append.bin"
+#define APPENDS 2000
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Creates path from the lines in INPUT_FILE, size bytes of 64-byte lines
+static int
+create_file(FS& filesystem, const std::string& path, uint64_t size)
+{
+    {
+        std::ofstream f(INPUT_FILE);
+        std::string line(63, 'x');
+        for (uint64_t i = 0; i < size / 64; i++)
+            f << line << "\n";
+        f << "\n";
+    }
+    int fw = open(INPUT_FILE, O_RDONLY);
+    dup2(fw, 0);
+    close(fw);
+    std::cin.clear();
+    return filesystem.create(path);
+}
+
+static void
+run(FS& filesystem, uint64_t log_size)
+{
+    format_options options;
+    options.block_size = 4096;
+    options.no_blocks = 65535;
+    filesystem.format(options);
+    if (create_file(filesystem, "/log", log_size) != 0 || create_file(filesystem, "/entry", 128) != 0) {
+        std::cout << "create failed for " << (log_size >> 20) << " MiB" << std::endl;
+        return;
+    }
+
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned i = 0; i < APPENDS; i++) {
+        if (filesystem.append("/entry", "/log") != 0) {
+            std::cout << "append failed" << std::endl;
+            return;
+        }
+    }
+    filesystem.sync();
+    double ms = std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+
+    std::cout << std::left << std::setw(12) << (log_size >> 20)
+              << std::setw(10) << APPENDS
+              << std::fixed << std::setprecision(2) << ms * 1000 / APPENDS << std::endl;
+}
+
+int
+main()
+{
+    FS filesystem(BENCH_DISK);
+    std::cout << std::left << std::setw(12) << "log (MiB)" << std::setw(10) << "appends"
+              << "per append (us)" << std::endl;
+    run(filesystem, 1 << 20);
+    run(filesystem, 10 << 20);
+    run(filesystem, 100 << 20);
+
+    unlink(BENCH_DISK);
+    unlink(INPUT_FILE);
+    return 0;
+}
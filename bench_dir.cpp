@@ -0,0 +1,87 @@
+// Measures creating files in and looking names up in one large directory.
+// With the name index both should cost the same per file whatever the
+// size of the directory.
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fs.h"
+
+#define INPUT_FILE "/tmp/bench_dir.txt"
+// scratch disk image, the shell's diskfile.bin is left alone
+#define BENCH_DISK "/tmp/bench_dir.bin"
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double
+elapsed_ms(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+static void
+run(FS& filesystem, unsigned entries)
+{
+    filesystem.format();
+
+    // Every create reads up to the next empty line, so the files are empty
+    {
+        std::ofstream f(INPUT_FILE);
+        for (unsigned i = 0; i < entries; i++)
+            f << "\n";
+    }
+    int fw = open(INPUT_FILE, O_RDONLY);
+    dup2(fw, 0);
+    close(fw);
+    std::cin.clear();
+
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned i = 0; i < entries; i++) {
+        if (filesystem.create("/f" + std::to_string(i)) != 0) {
+            std::cout << "create failed after " << i << " files" << std::endl;
+            return;
+        }
+    }
+    double create_ms = elapsed_ms(start);
+
+    // Look every name up again in random order, output thrown away
+    std::vector<std::string> names;
+    for (unsigned i = 0; i < entries; i++)
+        names.push_back("/f" + std::to_string(i));
+    srand(42);
+    for (unsigned i = entries - 1; i > 0; i--)
+        std::swap(names[i], names[rand() % (i + 1)]);
+
+    std::ofstream devnull("/dev/null");
+    std::streambuf *out = std::cout.rdbuf(devnull.rdbuf());
+    start = bench_clock::now();
+    for (unsigned i = 0; i < entries; i++)
+        filesystem.cat(names[i]);
+    double lookup_ms = elapsed_ms(start);
+    std::cout.rdbuf(out);
+
+    std::cout << std::left << std::setw(10) << entries
+              << std::setw(16) << std::fixed << std::setprecision(2)
+              << create_ms * 1000 / entries
+              << lookup_ms * 1000 / entries << std::endl;
+}
+
+int
+main()
+{
+    FS filesystem(BENCH_DISK);
+    std::cout << std::left << std::setw(10) << "entries" << std::setw(16) << "create (us)"
+              << "lookup (us)" << std::endl;
+    run(filesystem, 1000);
+    run(filesystem, 10000);
+    run(filesystem, 50000);
+    unlink(INPUT_FILE);
+    unlink(BENCH_DISK);
+    return 0;
+}
@@ -0,0 +1,69 @@
+// Compares the disk durability modes: creates a 1 MiB file, copies it and
+// removes both, and reports the time per round and the syncs it took.
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fs.h"
+
+#define INPUT_FILE "/tmp/bench_durability.txt"
+// scratch disk image, the shell's diskfile.bin is left alone
+#define BENCH_DISK "/tmp/bench_durability.bin"
+#define ROUNDS 50
+#define FILE_SIZE (1 << 20)
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Periodic mode uses a 100 ms interval, shorter than the whole run
+static void
+run(FS& filesystem, const char *name, DiskDurability mode)
+{
+    filesystem.set_durability(DURABLE_NONE);
+    filesystem.format();
+    filesystem.set_durability(mode, 100);
+
+    int fw = open(INPUT_FILE, O_RDONLY);
+    dup2(fw, 0);
+    close(fw);
+    std::cin.clear();
+
+    uint64_t syncs = filesystem.get_disk_syncs();
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned i = 0; i < ROUNDS; i++) {
+        if (filesystem.create("/a", FILE_SIZE) != 0 || filesystem.cp("/a", "/b") != 0 ||
+            filesystem.rm("/a") != 0 || filesystem.rm("/b") != 0) {
+            std::cout << "command failed in round " << i << std::endl;
+            return;
+        }
+    }
+    double ms = std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+    syncs = filesystem.get_disk_syncs() - syncs;
+
+    std::cout << std::left << std::setw(12) << name
+              << std::setw(16) << std::fixed << std::setprecision(2) << ms / ROUNDS
+              << std::setprecision(1) << double(syncs) / ROUNDS << std::endl;
+}
+
+int
+main()
+{
+    {
+        std::ofstream f(INPUT_FILE);
+        f << std::string((size_t)ROUNDS * FILE_SIZE, 'x');
+    }
+    FS filesystem(BENCH_DISK);
+    std::cout << std::left << std::setw(12) << "mode" << std::setw(16) << "per round (ms)"
+              << "syncs/round" << std::endl;
+    run(filesystem, "none", DURABLE_NONE);
+    run(filesystem, "write", DURABLE_WRITE);
+    run(filesystem, "command", DURABLE_COMMAND);
+    run(filesystem, "periodic", DURABLE_PERIODIC);
+
+    unlink(BENCH_DISK);
+    unlink(INPUT_FILE);
+    return 0;
+}
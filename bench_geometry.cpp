@@ -0,0 +1,103 @@
+// Measures cat and cp throughput as the volume grows: formats the disk with
+// larger and larger geometries, creates one big file and times reading and
+// copying it.
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fs.h"
+
+#define INPUT_FILE "/tmp/bench_geometry.txt"
+// scratch disk image, the shell's diskfile.bin is left alone
+#define BENCH_DISK "/tmp/bench_geometry.bin"
+#define MAX_FILE_SIZE (64u << 20)
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct geometry {
+    unsigned block_size;
+    unsigned no_blocks;
+};
+
+// Lines of 64 bytes ending with the empty line create stops at
+static void
+make_input(uint64_t size)
+{
+    std::ofstream f(INPUT_FILE);
+    std::string line(63, 'x');
+    for (uint64_t i = 0; i < size / 64; i++)
+        f << line << "\n";
+    f << "\n";
+}
+
+static double
+elapsed_ms(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+static void
+run(FS& filesystem, const geometry& g)
+{
+    format_options options;
+    options.block_size = g.block_size;
+    options.no_blocks = g.no_blocks;
+    if (filesystem.format(options) != 0) {
+        std::cout << "format failed for " << g.block_size << " x " << g.no_blocks << std::endl;
+        return;
+    }
+
+    // A quarter of the volume, so the copy fits next to the original
+    uint64_t volume = (uint64_t)g.block_size * g.no_blocks;
+    uint64_t size = std::min(volume / 4, (uint64_t)MAX_FILE_SIZE);
+    make_input(size);
+    int fw = open(INPUT_FILE, O_RDONLY);
+    dup2(fw, 0);
+    close(fw);
+    std::cin.clear();
+    filesystem.create("/big");
+
+    std::ofstream devnull("/dev/null");
+    std::streambuf *out = std::cout.rdbuf(devnull.rdbuf());
+    bench_clock::time_point start = bench_clock::now();
+    filesystem.cat("/big");
+    double cat_ms = elapsed_ms(start);
+    std::cout.rdbuf(out);
+
+    start = bench_clock::now();
+    filesystem.cp("/big", "/copy");
+    filesystem.sync();
+    double cp_ms = elapsed_ms(start);
+
+    double mib = size / double(1 << 20);
+    std::cout << std::left << std::setw(12) << g.block_size
+              << std::setw(10) << g.no_blocks
+              << std::setw(14) << (volume >> 20)
+              << std::setw(12) << std::fixed << std::setprecision(1) << mib
+              << std::setw(14) << mib * 1000 / cat_ms
+              << mib * 1000 / cp_ms << std::endl;
+}
+
+int
+main()
+{
+    const geometry geometries[] = {
+        {4096, 2048}, {4096, 16384}, {4096, 65535},
+        {16384, 65535}, {65536, 65535},
+    };
+    FS filesystem(BENCH_DISK);
+    std::cout << std::left << std::setw(12) << "block size" << std::setw(10) << "blocks"
+              << std::setw(14) << "volume (MiB)" << std::setw(12) << "file (MiB)"
+              << std::setw(14) << "cat (MiB/s)" << "cp (MiB/s)" << std::endl;
+    for (unsigned i = 0; i < sizeof(geometries) / sizeof(geometries[0]); i++)
+        run(filesystem, geometries[i]);
+
+    unlink(BENCH_DISK);
+    unlink(INPUT_FILE);
+    return 0;
+}
@@ -0,0 +1,96 @@
+// Measures metadata-heavy commands (create, cp, mv, rm) with the
+// metadata journal and with every block written and synced in place.
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fs.h"
+
+#define INPUT_FILE "/tmp/bench_journal.txt"
+// scratch disk image, the shell's diskfile.bin is left alone
+#define BENCH_DISK "/tmp/bench_journal.bin"
+#define ROUNDS 500
+#define FILE_SIZE 5000
+#define NO_BLOCKS 8192
+
+typedef std::chrono::steady_clock bench_clock;
+
+// group = 0 runs without a journal, in_place then writes every block
+// through and syncs after every command
+static void
+run(FS& filesystem, const char *name, unsigned group, bool in_place)
+{
+    format_options options;
+    options.no_blocks = NO_BLOCKS;
+    options.journal_blocks = group ? JOURNAL_DEFAULT_BLOCKS : 0;
+    filesystem.format(options);
+    filesystem.set_journal_group(group, 1000);
+    filesystem.set_cache_capacity(in_place ? 0 : CACHE_DEFAULT_CAPACITY);
+    filesystem.set_fat_sync_interval(in_place ? 1 : 0);
+    journal_stats before = filesystem.get_journal_stats();
+
+    int fw = open(INPUT_FILE, O_RDONLY);
+    dup2(fw, 0);
+    close(fw);
+    std::cin.clear();
+
+    unsigned commands = 0;
+    unsigned syncs = 1;
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned i = 0; i < ROUNDS; i++) {
+        std::string n = std::to_string(i);
+        for (unsigned c = 0; c < 4; c++) {
+            int failed;
+            if (c == 0)
+                failed = filesystem.create("/f" + n, FILE_SIZE);
+            else if (c == 1)
+                failed = filesystem.cp("/f" + n, "/c" + n);
+            else if (c == 2)
+                failed = filesystem.mv("/c" + n, "/m" + n);
+            else
+                failed = filesystem.rm("/f" + n);
+            if (failed) {
+                std::cout << "command failed in round " << i << std::endl;
+                return;
+            }
+            commands++;
+            if (in_place) {
+                filesystem.sync();
+                syncs++;
+            }
+        }
+    }
+    filesystem.sync();
+    double s = std::chrono::duration<double>(bench_clock::now() - start).count();
+    journal_stats after = filesystem.get_journal_stats();
+
+    std::cout << std::left << std::setw(14) << name
+              << std::setw(10) << commands
+              << std::setw(14) << std::fixed << std::setprecision(0) << commands / s
+              << (group ? after.commits - before.commits : syncs) << std::endl;
+}
+
+int
+main()
+{
+    {
+        std::ofstream f(INPUT_FILE);
+        f << std::string((size_t)ROUNDS * FILE_SIZE, 'x');
+    }
+    FS filesystem(BENCH_DISK);
+    std::cout << std::left << std::setw(14) << "mode" << std::setw(10) << "commands"
+              << std::setw(14) << "commands/s" << "syncs" << std::endl;
+    run(filesystem, "write-back", 0, false);
+    run(filesystem, "in place", 0, true);
+    run(filesystem, "journal 1", 1, false);
+    run(filesystem, "journal 16", 16, false);
+    run(filesystem, "journal 64", 64, false);
+
+    unlink(BENCH_DISK);
+    unlink(INPUT_FILE);
+    return 0;
+}
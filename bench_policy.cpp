@@ -0,0 +1,122 @@
+// Compares the block allocation policies: creates and removes files of
+// random sizes in a few directories until the disk has seen some churn,
+// then reports fragmentation and the time it takes to cat every file.
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fs.h"
+
+// scratch disk image, the shell's diskfile.bin is left alone
+#define BENCH_DISK "/tmp/bench_policy.bin"
+
+#define MAX_FILE_BLOCKS 24
+#define DIRS 4
+#define FILES_PER_DIR 60
+#define ROUNDS 6
+
+typedef std::chrono::steady_clock bench_clock;
+
+static std::string
+input_name(unsigned blocks)
+{
+    return "/tmp/bench_policy_" + std::to_string(blocks) + ".txt";
+}
+
+// One input file per size, 64 lines of 64 bytes fill a block exactly
+static void
+make_inputs()
+{
+    std::string line(63, 'x');
+    for (unsigned blocks = 1; blocks <= MAX_FILE_BLOCKS; blocks++) {
+        std::ofstream f(input_name(blocks));
+        for (unsigned i = 0; i < blocks * 64; i++)
+            f << line << "\n";
+        f << "\n";
+    }
+}
+
+static int
+create_file(FS& filesystem, const std::string& path, unsigned blocks)
+{
+    int fw = open(input_name(blocks).c_str(), O_RDONLY);
+    dup2(fw, 0);
+    close(fw);
+    std::cin.clear();
+    return filesystem.create(path);
+}
+
+static void
+run(FS& filesystem, AllocPolicy policy, const char *name)
+{
+    format_options options;
+    options.policy = policy;
+    filesystem.format(options);
+    srand(42);
+
+    std::vector<std::string> files;
+    for (unsigned d = 0; d < DIRS; d++)
+        filesystem.mkdir("/d" + std::to_string(d));
+
+    // Fill up, then repeatedly remove half of the files and refill
+    unsigned next = 0;
+    for (unsigned round = 0; round < ROUNDS; round++) {
+        while (files.size() < DIRS * FILES_PER_DIR) {
+            std::string path = "/d" + std::to_string(next % DIRS) + "/f" + std::to_string(next);
+            next++;
+            if (create_file(filesystem, path, 1 + rand() % MAX_FILE_BLOCKS) != 0)
+                break; // disk full
+            files.push_back(path);
+        }
+        for (size_t i = 0; i < files.size(); i++) {
+            if (rand() % 2) {
+                filesystem.rm(files[i]);
+                files[i] = files.back();
+                files.pop_back();
+            }
+        }
+    }
+
+    frag_stats stats;
+    filesystem.fragmentation(stats);
+
+    // Time reading everything back, output thrown away
+    std::ofstream devnull("/dev/null");
+    std::streambuf *out = std::cout.rdbuf(devnull.rdbuf());
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t i = 0; i < files.size(); i++)
+        filesystem.cat(files[i]);
+    double ms = std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+    std::cout.rdbuf(out);
+
+    std::cout << std::left << std::setw(10) << name
+              << std::setw(8) << stats.files
+              << std::setw(12) << stats.fragmented_files
+              << std::setw(14) << std::fixed << std::setprecision(2)
+              << (stats.files ? double(stats.fragments) / stats.files : 0.0)
+              << std::setw(12) << stats.free_runs
+              << std::setw(14) << stats.largest_free_run
+              << std::setprecision(2) << ms << std::endl;
+}
+
+int
+main()
+{
+    make_inputs();
+    FS filesystem(BENCH_DISK);
+    std::cout << std::left << std::setw(10) << "policy" << std::setw(8) << "files"
+              << std::setw(12) << "fragmented" << std::setw(14) << "frags/file"
+              << std::setw(12) << "free runs" << std::setw(14) << "largest free"
+              << "cat all (ms)" << std::endl;
+    run(filesystem, ALLOC_FIRST_FIT, "first");
+    run(filesystem, ALLOC_NEXT_FIT, "next");
+    run(filesystem, ALLOC_BEST_FIT, "best");
+    unlink(BENCH_DISK);
+    return 0;
+}
@@ -0,0 +1,82 @@
+// Measures 4 KiB reads at random offsets through a file handle. With the
+// block map of the open file a read should cost the same wherever it
+// lands, whatever the size of the file.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+#include "fs.h"
+
+// scratch disk image, the shell's diskfile.bin is left alone
+#define BENCH_DISK "/tmp/bench_random.bin"
+
+#define READS 20000
+#define READ_SIZE 4096
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Byte stored at offset of the test file
+static char
+pattern(uint64_t offset)
+{
+    return (char)(offset % 251);
+}
+
+static void
+run(FS& filesystem, uint32_t file_size)
+{
+    format_options options;
+    options.block_size = 4096;
+    options.no_blocks = 65535;
+    filesystem.format(options);
+
+    int fd = filesystem.open("/data", READ | WRITE | OPEN_CREATE);
+    std::vector<char> buf(1 << 20);
+    for (uint32_t offset = 0; offset < file_size; offset += buf.size()) {
+        for (size_t i = 0; i < buf.size(); i++)
+            buf[i] = pattern(offset + i);
+        if (filesystem.pwrite(fd, buf.data(), buf.size(), offset) != (int64_t)buf.size()) {
+            std::cout << "pwrite failed for " << (file_size >> 20) << " MiB" << std::endl;
+            return;
+        }
+    }
+    filesystem.close(fd);
+    filesystem.sync();
+
+    // Reopen so the block map is built from the FAT again
+    fd = filesystem.open("/data", READ);
+    srand(1);
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned i = 0; i < READS; i++) {
+        uint32_t offset = ((uint64_t)rand() * RAND_MAX + rand()) % (file_size - READ_SIZE);
+        if (filesystem.pread(fd, buf.data(), READ_SIZE, offset) != READ_SIZE ||
+            buf[0] != pattern(offset) || buf[READ_SIZE - 1] != pattern(offset + READ_SIZE - 1)) {
+            std::cout << "pread failed at " << offset << std::endl;
+            return;
+        }
+    }
+    double ms = std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+    filesystem.close(fd);
+
+    std::cout << std::left << std::setw(12) << (file_size >> 20)
+              << std::setw(10) << READS
+              << std::fixed << std::setprecision(2) << ms * 1000 / READS << std::endl;
+}
+
+int
+main()
+{
+    FS filesystem(BENCH_DISK);
+    std::cout << std::left << std::setw(12) << "file (MiB)" << std::setw(10) << "reads"
+              << "per read (us)" << std::endl;
+    run(filesystem, 1 << 20);
+    run(filesystem, 16 << 20);
+    run(filesystem, 128 << 20);
+
+    unlink(BENCH_DISK);
+    return 0;
+}
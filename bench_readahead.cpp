@@ -0,0 +1,98 @@
+// Times cat of a file that fills the whole volume with readahead off and
+// with growing readahead windows, with the disk file in the page cache and
+// dropped from it first.
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fs.h"
+
+#define INPUT_FILE "/tmp/bench_readahead.txt"
+// scratch disk image, the shell's diskfile.bin is left alone
+#define BENCH_DISK "/tmp/bench_readahead.bin"
+#define NO_BLOCKS 16384
+#define ROUNDS 5
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Drops the pages of the disk file from the page cache, so reads have to
+// go to the device
+static void
+drop_page_cache()
+{
+    int fd = open(BENCH_DISK, O_RDONLY);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// Average time of a cat of the file in ms, output thrown away
+static double
+time_cat(FS& filesystem, bool cold)
+{
+    std::ofstream devnull("/dev/null");
+    double total = 0;
+    for (unsigned i = 0; i < ROUNDS; i++) {
+        if (cold)
+            drop_page_cache();
+        std::streambuf *out = std::cout.rdbuf(devnull.rdbuf());
+        bench_clock::time_point start = bench_clock::now();
+        filesystem.cat("/big");
+        total += std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+        std::cout.rdbuf(out);
+    }
+    return total / ROUNDS;
+}
+
+static void
+run(FS& filesystem, unsigned window)
+{
+    filesystem.set_readahead(window);
+    std::cout << std::left << std::setw(18) << (window ? std::to_string(window) : "off")
+              << std::setw(14) << std::fixed << std::setprecision(2) << time_cat(filesystem, true)
+              << time_cat(filesystem, false) << std::endl;
+}
+
+int
+main()
+{
+    FS filesystem(BENCH_DISK);
+    format_options options;
+    options.block_size = BLOCK_SIZE;
+    options.no_blocks = NO_BLOCKS;
+    filesystem.format(options);
+
+    // One file takes every free block
+    frag_stats stats;
+    filesystem.fragmentation(stats);
+    size_t size = (size_t)stats.free_blocks * BLOCK_SIZE;
+    {
+        std::ofstream f(INPUT_FILE);
+        f << std::string(size, 'x');
+    }
+    int fw = open(INPUT_FILE, O_RDONLY);
+    dup2(fw, 0);
+    close(fw);
+    std::cin.clear();
+    if (filesystem.create("/big", size) != 0) {
+        std::cout << "create failed" << std::endl;
+        return 1;
+    }
+    filesystem.sync();
+
+    std::cout << "file of " << size / (1 << 20) << " MiB" << std::endl;
+    std::cout << std::left << std::setw(18) << "readahead blocks" << std::setw(14) << "cold (ms)"
+              << "warm (ms)" << std::endl;
+    run(filesystem, 0);
+    run(filesystem, 64);
+    run(filesystem, READAHEAD_DEFAULT_BLOCKS);
+    run(filesystem, 2048);
+
+    unlink(BENCH_DISK);
+    unlink(INPUT_FILE);
+    return 0;
+}
@@ -0,0 +1,102 @@
+// Measures many tiny files with their data kept in the directory entry
+// and in blocks of their own: disk blocks used and the time it takes to
+// create and cat each file.
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fs.h"
+
+#define INPUT_FILE "/tmp/bench_small.txt"
+// scratch disk image, the shell's diskfile.bin is left alone
+#define BENCH_DISK "/tmp/bench_small.bin"
+#define DIRS 8
+#define FILES 2000
+#define MAX_FILE_SIZE 40
+#define NO_BLOCKS 8192
+
+typedef std::chrono::steady_clock bench_clock;
+
+// All file contents back to back, read by create in byte-count mode
+static void
+make_input(std::vector<unsigned>& sizes)
+{
+    std::ofstream f(INPUT_FILE);
+    srand(42);
+    for (unsigned i = 0; i < FILES; i++) {
+        sizes.push_back(1 + rand() % MAX_FILE_SIZE);
+        f << std::string(sizes.back(), 'a' + i % 26);
+    }
+}
+
+static void
+run(FS& filesystem, const std::vector<unsigned>& sizes, bool inline_data)
+{
+    format_options options;
+    options.no_blocks = NO_BLOCKS;
+    options.inline_data = inline_data;
+    filesystem.format(options);
+    for (unsigned d = 0; d < DIRS; d++)
+        filesystem.mkdir("/d" + std::to_string(d));
+    frag_stats before;
+    filesystem.fragmentation(before);
+
+    int fw = open(INPUT_FILE, O_RDONLY);
+    dup2(fw, 0);
+    close(fw);
+    std::cin.clear();
+
+    std::vector<std::string> files;
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned i = 0; i < FILES; i++) {
+        std::string path = "/d" + std::to_string(i % DIRS) + "/f" + std::to_string(i);
+        if (filesystem.create(path, sizes[i]) != 0) {
+            std::cout << "create failed for " << path << std::endl;
+            return;
+        }
+        files.push_back(path);
+    }
+    filesystem.sync();
+    double create_us = std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+
+    frag_stats after;
+    filesystem.fragmentation(after);
+
+    // Time reading everything back, output thrown away
+    std::ofstream devnull("/dev/null");
+    std::streambuf *out = std::cout.rdbuf(devnull.rdbuf());
+    start = bench_clock::now();
+    for (size_t i = 0; i < files.size(); i++)
+        filesystem.cat(files[i]);
+    double cat_us = std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+    std::cout.rdbuf(out);
+
+    std::cout << std::left << std::setw(10) << (inline_data ? "inline" : "blocks")
+              << std::setw(8) << FILES
+              << std::setw(14) << before.free_blocks - after.free_blocks
+              << std::setw(16) << std::fixed << std::setprecision(2) << create_us / FILES
+              << cat_us / FILES << std::endl;
+}
+
+int
+main()
+{
+    std::vector<unsigned> sizes;
+    make_input(sizes);
+    FS filesystem(BENCH_DISK);
+    std::cout << std::left << std::setw(10) << "data" << std::setw(8) << "files"
+              << std::setw(14) << "blocks used" << std::setw(16) << "create (us)"
+              << "cat (us)" << std::endl;
+    run(filesystem, sizes, true);
+    run(filesystem, sizes, false);
+
+    unlink(BENCH_DISK);
+    unlink(INPUT_FILE);
+    return 0;
+}
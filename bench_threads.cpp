@@ -0,0 +1,161 @@
+// Runs a mix of commands on one file system from 1 to 32 threads at once:
+// cat of shared files, ls and small file creates, each thread in its own
+// directory. Reports the commands per second for the mix, for cat and ls
+// alone, and for writes and reads through handles inside files that don't
+// grow. All but the creates only take the metadata lock shared.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include "fs.h"
+
+// scratch disk image, the shell's diskfile.bin is left alone
+#define BENCH_DISK "/tmp/bench_threads.bin"
+
+#define OPS 16000
+#define SHARED_FILES 8
+#define SHARED_SIZE (64 * 1024)
+#define CREATE_SIZE 4096
+#define NO_BLOCKS 16384
+#define HANDLE_FILE_SIZE (256 * 1024)
+#define HANDLE_IO_SIZE 4096
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Writes size bytes to a new file, the way a client without stdin would
+static int
+make_file(FS& filesystem, const std::string& path, uint32_t size)
+{
+    int fd = filesystem.open(path, WRITE | OPEN_CREATE);
+    if (fd < 0)
+        return 1;
+    std::vector<char> data(size, 'x');
+    int failed = filesystem.pwrite(fd, data.data(), size, 0) != (int64_t)size;
+    return filesystem.close(fd) != 0 || failed;
+}
+
+// Overwrites and reads back parts of the file h in the thread's directory
+static void
+handle_io(FS& filesystem, unsigned ops, int& failures)
+{
+    int fd = filesystem.open("h", READ | WRITE);
+    if (fd < 0) {
+        failures++;
+        return;
+    }
+    std::vector<char> data(HANDLE_IO_SIZE, 'y');
+    for (unsigned i = 0; i < ops; i++) {
+        uint32_t offset = (i * 7919u * HANDLE_IO_SIZE / 3) % (HANDLE_FILE_SIZE - HANDLE_IO_SIZE);
+        int64_t done = (i % 2) ? filesystem.pread(fd, data.data(), HANDLE_IO_SIZE, offset)
+                               : filesystem.pwrite(fd, data.data(), HANDLE_IO_SIZE, offset);
+        if (done != HANDLE_IO_SIZE)
+            failures++;
+    }
+    filesystem.close(fd);
+}
+
+// Every fourth command of a thread is a create in the mix, the file is
+// removed again so every directory stays the same size
+static void
+worker(FS& filesystem, unsigned id, unsigned ops, int kind, int& failures)
+{
+    if (filesystem.cd("/t" + std::to_string(id)) != 0) {
+        failures++;
+        return;
+    }
+    if (kind == 2) {
+        handle_io(filesystem, ops, failures);
+        filesystem.end_session();
+        return;
+    }
+    bool creates = kind == 0;
+    for (unsigned i = 0; i < ops; i++) {
+        int failed;
+        if (creates && i % 4 == 3)
+            failed = make_file(filesystem, "c", CREATE_SIZE) || filesystem.rm("c") != 0;
+        else if (i % 4 == 2)
+            failed = filesystem.ls();
+        else
+            failed = filesystem.cat("/shared/f" + std::to_string((id + i) % SHARED_FILES));
+        if (failed)
+            failures++;
+    }
+    filesystem.end_session();
+}
+
+// Returns the commands per second of OPS commands spread over threads,
+// kind is 0 for the mix, 1 for cat and ls and 2 for handle reads and writes
+static double
+run(FS& filesystem, unsigned threads, int kind, int& failures)
+{
+    format_options options;
+    options.block_size = BLOCK_SIZE;
+    options.no_blocks = NO_BLOCKS;
+    filesystem.format(options);
+    filesystem.mkdir("/shared");
+    for (unsigned i = 0; i < SHARED_FILES; i++)
+        failures += make_file(filesystem, "/shared/f" + std::to_string(i), SHARED_SIZE);
+    for (unsigned i = 0; i < threads; i++) {
+        failures += filesystem.mkdir("/t" + std::to_string(i)) != 0;
+        if (kind == 2)
+            failures += make_file(filesystem, "/t" + std::to_string(i) + "/h", HANDLE_FILE_SIZE);
+    }
+
+    std::vector<std::thread> workers;
+    std::vector<int> worker_failures(threads, 0);
+    bench_clock::time_point start = bench_clock::now();
+    for (unsigned i = 0; i < threads; i++)
+        workers.emplace_back(worker, std::ref(filesystem), i, OPS / threads, kind,
+                             std::ref(worker_failures[i]));
+    for (unsigned i = 0; i < threads; i++) {
+        workers[i].join();
+        failures += worker_failures[i];
+    }
+    double s = std::chrono::duration<double>(bench_clock::now() - start).count();
+    return OPS / threads * threads / s;
+}
+
+int
+main()
+{
+    FS filesystem(BENCH_DISK);
+    unsigned counts[] = { 1, 2, 4, 8, 16, 32 };
+    std::vector<double> mixed, reads, handles;
+    int failures = 0;
+
+    // What cat and ls print goes to /dev/null, std::cout stays synced with
+    // stdio so threads may write to it at once
+    std::cout.flush();
+    int saved = dup(STDOUT_FILENO);
+    int null = ::open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    ::close(null);
+    for (unsigned threads : counts) {
+        mixed.push_back(run(filesystem, threads, 0, failures));
+        reads.push_back(run(filesystem, threads, 1, failures));
+        handles.push_back(run(filesystem, threads, 2, failures));
+    }
+    std::cout.flush();
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    ::close(saved);
+
+    std::cout << std::left << std::setw(10) << "threads" << std::setw(16) << "mixed ops/s"
+              << std::setw(16) << "cat+ls ops/s" << "pread+pwrite ops/s" << std::endl;
+    for (size_t i = 0; i < mixed.size(); i++) {
+        std::cout << std::left << std::setw(10) << counts[i]
+                  << std::setw(16) << std::fixed << std::setprecision(0) << mixed[i]
+                  << std::setw(16) << reads[i] << handles[i] << std::endl;
+    }
+    if (failures != 0)
+        std::cout << failures << " commands failed" << std::endl;
+
+    unlink(BENCH_DISK);
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include <iostream>
+#include "bmap.h"
+
+// adds block to the end of a list of extents, growing the last extent if
+// block follows it
+void
+extent_append(std::vector<extent>& extents, uint16_t block)
+{
+    if (!extents.empty() && extents.back().count < UINT16_MAX &&
+        extents.back().start + extents.back().count == block)
+    {
+        extents.back().count++;
+    }
+    else
+    {
+        extents.push_back(extent{block, 1});
+    }
+}
+
+BlockMapCache::BlockMapCache(unsigned capacity) : capacity(capacity)
+{
+
+}
+
+// copies the map of the chain starting at first to extents, true on a hit
+bool
+BlockMapCache::lookup(uint16_t first, std::vector<extent>& extents)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = index.find(first);
+    if (it == index.end())
+    {
+        stats.misses++;
+        return false;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    extents = it->second->extents;
+    stats.hits++;
+    return true;
+}
+
+// remembers the map of the chain starting at first
+void
+BlockMapCache::insert(uint16_t first, const std::vector<extent>& extents)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (capacity == 0)
+    {
+        return;
+    }
+    auto it = index.find(first);
+    if (it != index.end())
+    {
+        lru.splice(lru.begin(), lru, it->second);
+        it->second->extents = extents;
+        return;
+    }
+
+    while (lru.size() >= capacity)
+    {
+        index.erase(lru.back().first);
+        lru.pop_back();
+    }
+    lru.push_front(cached_map{first, extents});
+    index[first] = lru.begin();
+}
+
+// adds blocks linked to the end of the chain starting at first to its map,
+// if the map is cached
+void
+BlockMapCache::extend(uint16_t first, const std::vector<uint16_t>& blocks)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = index.find(first);
+    if (it == index.end())
+    {
+        return;
+    }
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        extent_append(it->second->extents, blocks[i]);
+    }
+}
+
+// forgets the map of the chain starting at first after it changed
+void
+BlockMapCache::invalidate(uint16_t first)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = index.find(first);
+    if (it == index.end())
+    {
+        return;
+    }
+    lru.erase(it->second);
+    index.erase(it);
+    stats.invalidations++;
+}
+
+// forgets everything
+void
+BlockMapCache::clear()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    lru.clear();
+    index.clear();
+}
+
+// changes the number of maps kept, 0 disables the cache
+void
+BlockMapCache::set_capacity(unsigned maps)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    capacity = maps;
+    while (lru.size() > capacity)
+    {
+        index.erase(lru.back().first);
+        lru.pop_back();
+    }
+}
+
+bmap_stats
+BlockMapCache::get_stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+void
+BlockMapCache::reset_stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    stats = bmap_stats{};
+}
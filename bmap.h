@@ -0,0 +1,65 @@
+#include <iostream>
+#include <cstdint>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+#ifndef __BMAP_H__
+#define __BMAP_H__
+
+// number of block maps kept in the cache unless configured otherwise
+#define BMAP_DEFAULT_CAPACITY 256
+
+// a run of consecutive blocks of a file
+struct extent {
+    uint16_t start; // first block of the run
+    uint16_t count; // number of blocks in the run
+};
+
+struct bmap_stats {
+    uint64_t hits;          // lookups answered with a cached map
+    uint64_t misses;        // lookups that had to walk the FAT
+    uint64_t invalidations; // maps dropped because their chain changed
+};
+
+// adds block to the end of a list of extents, growing the last extent if
+// block follows it
+void extent_append(std::vector<extent>& extents, uint16_t block);
+
+// LRU cache of block maps, the blocks of a FAT chain as a list of extents
+// keyed by the first block of the chain
+class BlockMapCache {
+private:
+    struct cached_map {
+        uint16_t first;
+        std::vector<extent> extents;
+    };
+    unsigned capacity;
+    // most recently used map first
+    std::list<cached_map> lru;
+    std::unordered_map<uint16_t, std::list<cached_map>::iterator> index;
+    bmap_stats stats{};
+    // every public call holds it, so any number of threads can share the cache
+    std::mutex lock;
+public:
+    BlockMapCache(unsigned capacity = BMAP_DEFAULT_CAPACITY);
+    // copies the map of the chain starting at first to extents, true on a hit
+    bool lookup(uint16_t first, std::vector<extent>& extents);
+    // remembers the map of the chain starting at first
+    void insert(uint16_t first, const std::vector<extent>& extents);
+    // adds blocks linked to the end of the chain starting at first to its
+    // map, if the map is cached
+    void extend(uint16_t first, const std::vector<uint16_t>& blocks);
+    // forgets the map of the chain starting at first after it changed
+    void invalidate(uint16_t first);
+    // forgets everything
+    void clear();
+    // changes the number of maps kept, 0 disables the cache
+    void set_capacity(unsigned maps);
+    unsigned get_capacity() { return capacity; }
+    bmap_stats get_stats();
+    void reset_stats();
+};
+
+#endif // __BMAP_H__
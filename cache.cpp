@@ -0,0 +1,373 @@
+#include <iostream>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include "cache.h"
+
+BlockCache::BlockCache(Disk& disk, unsigned capacity) : disk(disk), capacity(capacity)
+{
+
+}
+
+BlockCache::~BlockCache()
+{
+    sync();
+}
+
+// Writes a dirty cached block to the disk
+int
+BlockCache::writeBack(cache_block& cb)
+{
+    if (!cb.dirty)
+    {
+        return 0;
+    }
+    if (disk.write(cb.block_no, cb.data.data()) != 0)
+    {
+        return -1;
+    }
+    cb.dirty = false;
+    stats.writebacks++;
+    return 0;
+}
+
+// Removes the least recently used block, writing it back first if dirty.
+// While dirty blocks are held the least recently used clean block goes
+// instead, returns 1 if there is none.
+int
+BlockCache::evict()
+{
+    if (lru.empty())
+    {
+        return 1;
+    }
+    auto victim = std::prev(lru.end());
+    while (hold_dirty && victim->dirty)
+    {
+        if (victim == lru.begin())
+        {
+            return 1;
+        }
+        --victim;
+    }
+    if (writeBack(*victim) != 0)
+    {
+        return -1;
+    }
+    index.erase(victim->block_no);
+    lru.erase(victim);
+    stats.evictions++;
+    return 0;
+}
+
+// Evicts blocks until there is room for one more
+int
+BlockCache::makeRoom()
+{
+    while (!lru.empty() && lru.size() >= capacity)
+    {
+        int retVal = evict();
+        if (retVal < 0)
+        {
+            return -1;
+        }
+        if (retVal > 0)
+        {
+            break; // only held dirty blocks left
+        }
+    }
+    return 0;
+}
+
+// reads one block, from the cache if present, otherwise from the disk
+int
+BlockCache::read(unsigned block_no, uint8_t *blk)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = index.find(block_no);
+    if (it != index.end())
+    {
+        stats.hits++;
+        lru.splice(lru.begin(), lru, it->second);
+        memcpy(blk, it->second->data.data(), disk.get_block_size());
+        return 0;
+    }
+
+    stats.misses++;
+    if (capacity == 0)
+    {
+        return disk.read(block_no, blk);
+    }
+    if (makeRoom() != 0)
+    {
+        return -1;
+    }
+    lru.emplace_front();
+    cache_block& cb = lru.front();
+    cb.data.resize(disk.get_block_size());
+    if (disk.read(block_no, cb.data.data()) != 0)
+    {
+        lru.pop_front();
+        return -1;
+    }
+    cb.block_no = block_no;
+    cb.dirty = false;
+    index[block_no] = lru.begin();
+    memcpy(blk, cb.data.data(), cb.data.size());
+    return 0;
+}
+
+// writes one block into the cache, the disk is updated on eviction or sync
+int
+BlockCache::write(unsigned block_no, uint8_t *blk)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (block_no >= disk.get_no_blocks())
+    {
+        return disk.write(block_no, blk); // let the disk report the error
+    }
+
+    auto it = index.find(block_no);
+    if (it != index.end())
+    {
+        lru.splice(lru.begin(), lru, it->second);
+        memcpy(it->second->data.data(), blk, it->second->data.size());
+        it->second->dirty = true;
+        return 0;
+    }
+
+    if (capacity == 0 && !hold_dirty)
+    {
+        return disk.write(block_no, blk);
+    }
+    if (makeRoom() != 0)
+    {
+        return -1;
+    }
+    lru.emplace_front();
+    cache_block& cb = lru.front();
+    cb.block_no = block_no;
+    cb.dirty = true;
+    cb.data.assign(blk, blk + disk.get_block_size());
+    index[block_no] = lru.begin();
+    return 0;
+}
+
+// reads count consecutive blocks into buf with one disk request, cached
+// copies (which may be newer than the disk) take precedence
+int
+BlockCache::read_blocks(unsigned block_no, unsigned count, uint8_t *buf)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    unsigned cached = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        cached += index.count(block_no + i);
+    }
+    if (cached < count)
+    {
+        stats.misses += count - cached;
+        if (disk.read_blocks(block_no, count, buf) != 0)
+        {
+            return -1;
+        }
+    }
+    if (cached > 0)
+    {
+        size_t blockSize = disk.get_block_size();
+        stats.hits += cached;
+        for (unsigned i = 0; i < count; i++)
+        {
+            auto it = index.find(block_no + i);
+            if (it != index.end())
+            {
+                memcpy(buf + (size_t)i * blockSize, it->second->data.data(), blockSize);
+            }
+        }
+    }
+    return 0;
+}
+
+// writes count consecutive blocks straight to the disk with one request,
+// cached copies of them are updated to stay coherent
+int
+BlockCache::write_blocks(unsigned block_no, unsigned count, uint8_t *buf)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (disk.write_blocks(block_no, count, buf) != 0)
+    {
+        return -1;
+    }
+    size_t blockSize = disk.get_block_size();
+    for (unsigned i = 0; i < count; i++)
+    {
+        auto it = index.find(block_no + i);
+        if (it != index.end())
+        {
+            memcpy(it->second->data.data(), buf + (size_t)i * blockSize, blockSize);
+            it->second->dirty = false;
+        }
+    }
+    return 0;
+}
+
+// returns a read-only pointer to the current contents of count consecutive
+// blocks without copying them, straight into the disk mapping. A cached
+// copy is never handed out, another thread may evict it any time.
+const uint8_t *
+BlockCache::peek(unsigned block_no, unsigned count)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (index.count(block_no + i) != 0)
+        {
+            return nullptr; // the mapping may be stale for this run
+        }
+    }
+    if (block_no + count > disk.get_no_blocks())
+    {
+        return nullptr;
+    }
+    return disk.block_ptr(block_no);
+}
+
+// writes all dirty blocks back to the disk, then drops blocks held past
+// the capacity
+int
+BlockCache::sync()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int retVal = 0;
+    for (cache_block& cb : lru)
+    {
+        if (writeBack(cb) != 0)
+        {
+            retVal = -1;
+        }
+    }
+    while (retVal == 0 && lru.size() > capacity)
+    {
+        retVal = evict();
+    }
+    return retVal < 0 ? -1 : 0;
+}
+
+// writes dirty cached copies of count consecutive blocks back, so the
+// disk file holds their current contents
+int
+BlockCache::flush_blocks(unsigned block_no, unsigned count)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (index.empty())
+    {
+        return 0;
+    }
+    for (unsigned i = 0; i < count; i++)
+    {
+        auto it = index.find(block_no + i);
+        if (it != index.end() && writeBack(*it->second) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// drops cached copies of count consecutive blocks whose contents were
+// replaced on the disk without going through the cache
+void
+BlockCache::drop_blocks(unsigned block_no, unsigned count)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (index.empty())
+    {
+        return;
+    }
+    for (unsigned i = 0; i < count; i++)
+    {
+        auto it = index.find(block_no + i);
+        if (it != index.end())
+        {
+            lru.erase(it->second);
+            index.erase(it);
+        }
+    }
+}
+
+// drops all cached blocks without writing them back
+void
+BlockCache::invalidate()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    lru.clear();
+    index.clear();
+}
+
+// changes the number of blocks kept, 0 makes the cache write-through
+int
+BlockCache::set_capacity(unsigned blocks)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    capacity = blocks;
+    while (lru.size() > capacity)
+    {
+        int retVal = evict();
+        if (retVal != 0)
+        {
+            return retVal < 0 ? -1 : 0;
+        }
+    }
+    return 0;
+}
+
+// appends the numbers and contents of all dirty blocks to blocks and data
+void
+BlockCache::get_dirty(std::vector<unsigned>& blocks, std::vector<uint8_t>& data)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (const cache_block& cb : lru)
+    {
+        if (cb.dirty)
+        {
+            blocks.push_back(cb.block_no);
+            data.insert(data.end(), cb.data.begin(), cb.data.end());
+        }
+    }
+}
+
+// number of dirty blocks
+unsigned
+BlockCache::dirty_count()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    unsigned count = 0;
+    for (const cache_block& cb : lru)
+    {
+        count += cb.dirty ? 1 : 0;
+    }
+    return count;
+}
+
+// with hold set, dirty blocks only reach the disk through sync and
+// flush_blocks
+void
+BlockCache::set_hold_dirty(bool hold)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    hold_dirty = hold;
+}
+
+cache_stats
+BlockCache::get_stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+void
+BlockCache::reset_stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    stats = cache_stats{};
+}
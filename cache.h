@@ -0,0 +1,89 @@
+#include <iostream>
+#include <cstdint>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include "disk.h"
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+// number of blocks kept in the cache unless configured otherwise
+#define CACHE_DEFAULT_CAPACITY 64
+
+struct cache_stats {
+    uint64_t hits;       // reads served from the cache
+    uint64_t misses;     // reads that had to go to the disk
+    uint64_t evictions;  // blocks dropped to make room for others
+    uint64_t writebacks; // dirty blocks written to the disk
+};
+
+// Write-back LRU cache of disk blocks, sitting between the file system
+// and the disk
+class BlockCache {
+private:
+    struct cache_block {
+        unsigned block_no;
+        bool dirty;
+        std::vector<uint8_t> data;
+    };
+    Disk& disk;
+    unsigned capacity;
+    // most recently used block first
+    std::list<cache_block> lru;
+    std::unordered_map<unsigned, std::list<cache_block>::iterator> index;
+    cache_stats stats{};
+    // dirty blocks are only written by sync, the cache grows instead
+    bool hold_dirty = false;
+    // every public call holds it, so any number of threads can share the cache
+    std::mutex lock;
+
+    int writeBack(cache_block& cb);
+    int evict();
+    int makeRoom();
+public:
+    BlockCache(Disk& disk, unsigned capacity = CACHE_DEFAULT_CAPACITY);
+    ~BlockCache();
+    // reads one block, from the cache if present, otherwise from the disk
+    int read(unsigned block_no, uint8_t *blk);
+    // writes one block into the cache, the disk is updated on eviction or sync
+    int write(unsigned block_no, uint8_t *blk);
+    // reads count consecutive blocks into buf with one disk request, cached
+    // copies (which may be newer than the disk) take precedence
+    int read_blocks(unsigned block_no, unsigned count, uint8_t *buf);
+    // writes count consecutive blocks straight to the disk with one request,
+    // cached copies of them are updated to stay coherent
+    int write_blocks(unsigned block_no, unsigned count, uint8_t *buf);
+    // returns a read-only pointer to the current contents of count
+    // consecutive blocks without copying them: the disk mapping, if none of
+    // the blocks are cached. nullptr otherwise. Valid until the blocks are
+    // written or the disk geometry changes.
+    const uint8_t *peek(unsigned block_no, unsigned count = 1);
+    // writes all dirty blocks back to the disk
+    int sync();
+    // writes dirty cached copies of count consecutive blocks back, so the
+    // disk file holds their current contents
+    int flush_blocks(unsigned block_no, unsigned count);
+    // drops cached copies of count consecutive blocks whose contents were
+    // replaced on the disk without going through the cache
+    void drop_blocks(unsigned block_no, unsigned count);
+    // drops all cached blocks without writing them back, needed before the
+    // disk geometry changes
+    void invalidate();
+    // changes the number of blocks kept, 0 makes the cache write-through
+    int set_capacity(unsigned blocks);
+    // with hold set, dirty blocks never reach the disk on eviction, only
+    // through sync and flush_blocks, so a journal can log them first. The
+    // cache holds more than its capacity while there are too many.
+    void set_hold_dirty(bool hold);
+    // appends the numbers and contents of all dirty blocks to blocks and data
+    void get_dirty(std::vector<unsigned>& blocks, std::vector<uint8_t>& data);
+    // number of dirty blocks
+    unsigned dirty_count();
+    unsigned get_capacity() { return capacity; }
+    cache_stats get_stats();
+    void reset_stats();
+};
+
+#endif // __CACHE_H__
@@ -0,0 +1,131 @@
+#include <iostream>
+#include "dcache.h"
+
+DentryCache::DentryCache(unsigned capacity) : capacity(capacity)
+{
+
+}
+
+// Key of a name in a directory, '/' can not be part of a name
+std::string
+DentryCache::makeKey(uint16_t parent, const std::string& name)
+{
+    return std::to_string(parent) + "/" + name;
+}
+
+// looks name up in the directory starting at parent, true on a hit
+bool
+DentryCache::lookup(uint16_t parent, const std::string& name, dentry& entry)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = index.find(makeKey(parent, name));
+    if (it == index.end())
+    {
+        stats.misses++;
+        return false;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    entry = it->second->entry;
+    stats.hits++;
+    if (entry.negative)
+    {
+        stats.negative_hits++;
+    }
+    return true;
+}
+
+// remembers what name in parent resolves to, or that it does not exist
+void
+DentryCache::insert(uint16_t parent, const std::string& name, const dentry& entry)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (capacity == 0)
+    {
+        return;
+    }
+    std::string key = makeKey(parent, name);
+    auto it = index.find(key);
+    if (it != index.end())
+    {
+        lru.splice(lru.begin(), lru, it->second);
+        it->second->entry = entry;
+        return;
+    }
+
+    while (lru.size() >= capacity)
+    {
+        index.erase(makeKey(lru.back().parent, lru.back().name));
+        lru.pop_back();
+    }
+    lru.push_front(cached_dentry{parent, name, entry});
+    index[key] = lru.begin();
+}
+
+// forgets name in parent after it was created, changed or removed
+void
+DentryCache::invalidate(uint16_t parent, const std::string& name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = index.find(makeKey(parent, name));
+    if (it == index.end())
+    {
+        return;
+    }
+    lru.erase(it->second);
+    index.erase(it);
+    stats.invalidations++;
+}
+
+// forgets every name in the directory starting at parent
+void
+DentryCache::invalidate_dir(uint16_t parent)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = lru.begin(); it != lru.end();)
+    {
+        if (it->parent != parent)
+        {
+            ++it;
+            continue;
+        }
+        index.erase(makeKey(it->parent, it->name));
+        it = lru.erase(it);
+        stats.invalidations++;
+    }
+}
+
+// forgets everything
+void
+DentryCache::clear()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    lru.clear();
+    index.clear();
+}
+
+// changes the number of names kept, 0 disables the cache
+void
+DentryCache::set_capacity(unsigned entries)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    capacity = entries;
+    while (lru.size() > capacity)
+    {
+        index.erase(makeKey(lru.back().parent, lru.back().name));
+        lru.pop_back();
+    }
+}
+
+dcache_stats
+DentryCache::get_stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+void
+DentryCache::reset_stats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    stats = dcache_stats{};
+}
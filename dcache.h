@@ -0,0 +1,66 @@
+#include <iostream>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+
+#ifndef __DCACHE_H__
+#define __DCACHE_H__
+
+// number of names kept in the dentry cache unless configured otherwise
+#define DCACHE_DEFAULT_CAPACITY 1024
+
+// what a name in a directory resolves to
+struct dentry {
+    bool negative;         // the name does not exist in the directory
+    uint16_t block;        // first block of the file or directory
+    uint8_t type;          // TYPE_FILE or TYPE_DIR
+    uint8_t access_rights; // rights of the entry
+};
+
+struct dcache_stats {
+    uint64_t hits;          // lookups answered with a cached entry
+    uint64_t negative_hits; // hits that said the name does not exist
+    uint64_t misses;        // lookups that had to search the directory
+    uint64_t invalidations; // cached names dropped because they changed
+};
+
+// LRU cache of path components, mapping (directory block, name) to what
+// the name resolves to. Names known not to exist are cached as well.
+class DentryCache {
+private:
+    struct cached_dentry {
+        uint16_t parent;
+        std::string name;
+        dentry entry;
+    };
+    unsigned capacity;
+    // most recently used name first
+    std::list<cached_dentry> lru;
+    std::unordered_map<std::string, std::list<cached_dentry>::iterator> index;
+    dcache_stats stats{};
+    // every public call holds it, so any number of threads can share the cache
+    std::mutex lock;
+
+    static std::string makeKey(uint16_t parent, const std::string& name);
+public:
+    DentryCache(unsigned capacity = DCACHE_DEFAULT_CAPACITY);
+    // looks name up in the directory starting at parent, true on a hit
+    bool lookup(uint16_t parent, const std::string& name, dentry& entry);
+    // remembers what name in parent resolves to, or that it does not exist
+    void insert(uint16_t parent, const std::string& name, const dentry& entry);
+    // forgets name in parent after it was created, changed or removed
+    void invalidate(uint16_t parent, const std::string& name);
+    // forgets every name in the directory starting at parent
+    void invalidate_dir(uint16_t parent);
+    // forgets everything
+    void clear();
+    // changes the number of names kept, 0 disables the cache
+    void set_capacity(unsigned entries);
+    unsigned get_capacity() { return capacity; }
+    dcache_stats get_stats();
+    void reset_stats();
+};
+
+#endif // __DCACHE_H__
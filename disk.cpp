@@ -1,28 +1,126 @@
 #include <iostream>
 #include "disk.h"
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 
-Disk::Disk()
+// picks the backend requested through the environment
+static DiskBackend
+backend_from_env()
+{
+    const char *name = getenv("FS_DISK_BACKEND");
+    if (name != nullptr && strcmp(name, "mmap") == 0)
+        return DISK_MMAP;
+    return DISK_FILE;
+}
+
+// picks the durability mode and periodic interval requested through the
+// environment
+static DiskDurability
+durability_from_env(unsigned& interval_ms)
+{
+    const char *interval = getenv("FS_SYNC_INTERVAL_MS");
+    if (interval != nullptr && strtoul(interval, nullptr, 10) > 0)
+        interval_ms = strtoul(interval, nullptr, 10);
+    const char *name = getenv("FS_DURABILITY");
+    if (name == nullptr)
+        return DURABLE_NONE;
+    if (strcmp(name, "write") == 0)
+        return DURABLE_WRITE;
+    if (strcmp(name, "command") == 0)
+        return DURABLE_COMMAND;
+    if (strcmp(name, "periodic") == 0)
+        return DURABLE_PERIODIC;
+    return DURABLE_NONE;
+}
+
+Disk::Disk(const std::string& name) : Disk(backend_from_env(), name)
+{
+    unsigned interval_ms = SYNC_DEFAULT_INTERVAL_MS;
+    DiskDurability mode = durability_from_env(interval_ms);
+    set_durability(mode, interval_ms);
+}
+
+Disk::Disk(DiskBackend backend, const std::string& name) : name(name), backend(backend)
 {
     // first check if the disk file exists, otherwise create it.
-    if (!disk_file_exists(DISKNAME)) {
+    if (!disk_file_exists(name)) {
         std::cout << "No disk file found...\n";
-        std::cout << "Creating disk file: " << DISKNAME << std::endl;
-        std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1<<23)-1);
+        std::cout << "Creating disk file: " << name << std::endl;
+        std::ofstream f(name.c_str(), std::ios::binary | std::ios::out);
+        f.seekp(disk_size - 1);
         f.write("", 1);
     }
     // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
-        std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
+    fd = open(name.c_str(), O_RDWR);
+    if (fd < 0) {
+        std::cerr << "ERROR: Can't open diskfile: " << name << ", exiting..."<< std::endl;
         exit(-1);
     }
+    if (backend == DISK_MMAP && !open_mmap()) {
+        std::cerr << "WARNING: Can't map diskfile: " << name << ", using file backend" << std::endl;
+        this->backend = DISK_FILE;
+    }
+    aio.attach(fd);
 }
 
 Disk::~Disk()
 {
-    diskfile.close();
+    stop_periodic();
+    aio.shutdown();
+    if (map != nullptr) {
+        msync(map, disk_size, MS_SYNC);
+        munmap(map, disk_size);
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+// changes the block size and number of blocks, resizing the disk file
+int
+Disk::set_geometry(unsigned block_size, unsigned no_blocks)
+{
+    uint64_t size = (uint64_t)block_size * no_blocks;
+    if (block_size == 0 || no_blocks == 0)
+        return -1;
+    std::lock_guard<std::mutex> lock(sync_lock);
+    if (map != nullptr) {
+        msync(map, disk_size, MS_SYNC);
+        munmap(map, disk_size);
+        map = nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size != size) {
+        if (ftruncate(fd, size) != 0)
+            return -1;
+    }
+    this->block_size = block_size;
+    this->no_blocks = no_blocks;
+    disk_size = size;
+    if (backend == DISK_MMAP && !open_mmap()) {
+        std::cerr << "WARNING: Can't map diskfile: " << name << ", using file backend" << std::endl;
+        backend = DISK_FILE;
+    }
+    return 0;
+}
+
+// maps the whole disk file, returns false if that isn't possible
+bool
+Disk::open_mmap()
+{
+    void *addr = mmap(nullptr, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return false;
+    map = static_cast<uint8_t*>(addr);
+    return true;
 }
 
 bool
@@ -31,6 +129,86 @@ Disk::disk_file_exists (const std::string& name) {
     return f.good();
 }
 
+// checks that blocks [block_no, block_no + count) are on the disk
+bool
+Disk::valid_range(const char *op, unsigned block_no, unsigned count)
+{
+    if (block_no >= no_blocks || count > no_blocks - block_no) {
+        std::cout << "Disk::" << op << " - ERROR: Invalid block number (" << block_no << ")\n";
+        return false;
+    }
+    return true;
+}
+
+// Moves count consecutive blocks starting at block_no to or from the
+// buffers in bufs, with as few system calls as possible
+int
+Disk::transfer(bool write, unsigned block_no, uint8_t *const *bufs, unsigned count)
+{
+    off_t offset = (off_t)block_no * block_size;
+    if (backend == DISK_MMAP) {
+        for (unsigned i = 0; i < count; i++) {
+            if (write)
+                memcpy(map + offset + (off_t)i * block_size, bufs[i], block_size);
+            else
+                memcpy(bufs[i], map + offset + (off_t)i * block_size, block_size);
+        }
+        return 0;
+    }
+
+    struct iovec iov[IOV_MAX];
+    unsigned done = 0;
+    while (done < count) {
+        unsigned n = count - done;
+        if (n > IOV_MAX)
+            n = IOV_MAX;
+        for (unsigned i = 0; i < n; i++) {
+            iov[i].iov_base = bufs[done + i];
+            iov[i].iov_len = block_size;
+        }
+        // preadv/pwritev may stop early, continue from where they stopped
+        struct iovec *next = iov;
+        int left = n;
+        while (left > 0) {
+            ssize_t bytes = write ? pwritev(fd, next, left, offset) : preadv(fd, next, left, offset);
+            if (bytes < 0)
+                return -1;
+            if (bytes == 0) {
+                // reading past the end of a short disk file gives zeroes
+                if (write)
+                    return -1;
+                for (int i = 0; i < left; i++)
+                    memset(next[i].iov_base, 0, next[i].iov_len);
+                break;
+            }
+            offset += bytes;
+            while (left > 0 && (size_t)bytes >= next->iov_len) {
+                bytes -= next->iov_len;
+                next++;
+                left--;
+            }
+            if (left > 0 && bytes > 0) {
+                next->iov_base = (uint8_t*)next->iov_base + bytes;
+                next->iov_len -= bytes;
+            }
+        }
+        done += n;
+        offset = (off_t)(block_no + done) * block_size;
+    }
+    return 0;
+}
+
+// Records that a write request finished with result, and syncs it right
+// away in DURABLE_WRITE mode
+int
+Disk::written(int result)
+{
+    dirty = true;
+    if (result == 0 && durability == DURABLE_WRITE)
+        return sync();
+    return result;
+}
+
 // writes one block to the disk
 int
 Disk::write(unsigned block_no, uint8_t *blk)
@@ -38,15 +216,9 @@ Disk::write(unsigned block_no, uint8_t *blk)
     if (DEBUG)
         std::cout << "Disk::write(" << block_no << ")\n";
     // check if valid block number
-    if (block_no >= no_blocks) {
-        std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
+    if (!valid_range("write", block_no, 1))
         return -1;
-    }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
-    diskfile.flush();
-    return 0;
+    return written(transfer(true, block_no, &blk, 1));
 }
 
 // reads one block from the disk
@@ -56,12 +228,286 @@ Disk::read(unsigned block_no, uint8_t *blk)
     if (DEBUG)
         std::cout << "Disk::read(" << block_no << ")\n";
     // check if valid block number
-    if (block_no >= no_blocks) {
-        std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
+    if (!valid_range("read", block_no, 1))
+        return -1;
+    return transfer(false, block_no, &blk, 1);
+}
+
+// writes count consecutive blocks starting at block_no from buf, one request
+int
+Disk::write_blocks(unsigned block_no, unsigned count, uint8_t *buf)
+{
+    if (DEBUG)
+        std::cout << "Disk::write_blocks(" << block_no << ", " << count << ")\n";
+    if (!valid_range("write_blocks", block_no, count))
+        return -1;
+    if (backend == DISK_MMAP) {
+        memcpy(map + (off_t)block_no * block_size, buf, (size_t)count * block_size);
+        return written(0);
+    }
+    size_t left = (size_t)count * block_size;
+    off_t offset = (off_t)block_no * block_size;
+    while (left > 0) {
+        ssize_t bytes = pwrite(fd, buf, left, offset);
+        if (bytes <= 0)
+            return written(-1);
+        buf += bytes;
+        offset += bytes;
+        left -= bytes;
+    }
+    return written(0);
+}
+
+// reads count consecutive blocks starting at block_no into buf, one request
+int
+Disk::read_blocks(unsigned block_no, unsigned count, uint8_t *buf)
+{
+    if (DEBUG)
+        std::cout << "Disk::read_blocks(" << block_no << ", " << count << ")\n";
+    if (!valid_range("read_blocks", block_no, count))
         return -1;
+    if (backend == DISK_MMAP) {
+        memcpy(buf, map + (off_t)block_no * block_size, (size_t)count * block_size);
+        return 0;
+    }
+    size_t left = (size_t)count * block_size;
+    off_t offset = (off_t)block_no * block_size;
+    while (left > 0) {
+        ssize_t bytes = pread(fd, buf, left, offset);
+        if (bytes < 0)
+            return -1;
+        if (bytes == 0) {
+            memset(buf, 0, left); // past the end of a short disk file
+            break;
+        }
+        buf += bytes;
+        offset += bytes;
+        left -= bytes;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
     return 0;
 }
+
+// gather: writes bufs[i] to blocks[i], each run of consecutive block
+// numbers becomes one request
+int
+Disk::writev_blocks(const unsigned *blocks, uint8_t *const *bufs, unsigned count)
+{
+    unsigned i = 0;
+    while (i < count) {
+        unsigned run = 1;
+        while (i + run < count && blocks[i + run] == blocks[i] + run)
+            run++;
+        if (!valid_range("writev_blocks", blocks[i], run))
+            return -1;
+        if (transfer(true, blocks[i], bufs + i, run) != 0)
+            return written(-1);
+        i += run;
+    }
+    return written(0);
+}
+
+// scatter: reads blocks[i] into bufs[i], each run of consecutive block
+// numbers becomes one request
+int
+Disk::readv_blocks(const unsigned *blocks, uint8_t *const *bufs, unsigned count)
+{
+    unsigned i = 0;
+    while (i < count) {
+        unsigned run = 1;
+        while (i + run < count && blocks[i + run] == blocks[i] + run)
+            run++;
+        if (!valid_range("readv_blocks", blocks[i], run))
+            return -1;
+        if (transfer(false, blocks[i], bufs + i, run) != 0)
+            return -1;
+        i += run;
+    }
+    return 0;
+}
+
+// starts reading count consecutive blocks into buf without waiting. The
+// mmap backend copies at once, there is nothing to wait for.
+uint64_t
+Disk::submit_read(unsigned block_no, unsigned count, uint8_t *buf)
+{
+    if (DEBUG)
+        std::cout << "Disk::submit_read(" << block_no << ", " << count << ")\n";
+    if (!valid_range("submit_read", block_no, count))
+        return 0;
+    if (backend == DISK_MMAP) {
+        memcpy(buf, map + (off_t)block_no * block_size, (size_t)count * block_size);
+        return aio.completed(false, 0);
+    }
+    return aio.submit(false, buf, (size_t)count * block_size, (off_t)block_no * block_size);
+}
+
+// starts writing count consecutive blocks from buf without waiting
+uint64_t
+Disk::submit_write(unsigned block_no, unsigned count, uint8_t *buf)
+{
+    if (DEBUG)
+        std::cout << "Disk::submit_write(" << block_no << ", " << count << ")\n";
+    if (!valid_range("submit_write", block_no, count))
+        return 0;
+    if (backend == DISK_MMAP) {
+        memcpy(map + (off_t)block_no * block_size, buf, (size_t)count * block_size);
+        return aio.completed(true, 0);
+    }
+    return aio.submit(true, buf, (size_t)count * block_size, (off_t)block_no * block_size);
+}
+
+// true if the request is done
+bool
+Disk::poll(uint64_t ticket)
+{
+    return aio.poll(ticket);
+}
+
+// waits for a submitted request, a finished write counts like any other
+// write request for durability
+int
+Disk::wait(uint64_t ticket)
+{
+    bool write;
+    int result = aio.wait(ticket, write);
+    return write ? written(result) : result;
+}
+
+// copies bytes from the disk starting at block_no to out_fd inside the
+// kernel, without passing through a user space buffer
+int
+Disk::send_blocks(unsigned block_no, unsigned count, size_t bytes, int out_fd)
+{
+    if (DEBUG)
+        std::cout << "Disk::send_blocks(" << block_no << ", " << count << ")\n";
+    if (!valid_range("send_blocks", block_no, count) || bytes > (size_t)count * block_size)
+        return -2;
+    off_t offset = (off_t)block_no * block_size;
+    size_t sent = 0;
+    while (sent < bytes) {
+        ssize_t n = sendfile(out_fd, fd, &offset, bytes - sent);
+        if (n <= 0)
+            return sent == 0 ? -1 : -2;
+        sent += n;
+    }
+    return 0;
+}
+
+// copies count consecutive blocks from src_block to dst_block inside the
+// disk file (copy_file_range), or inside the mapping for the mmap backend
+int
+Disk::copy_blocks(unsigned src_block, unsigned dst_block, unsigned count)
+{
+    if (DEBUG)
+        std::cout << "Disk::copy_blocks(" << src_block << ", " << dst_block << ", " << count << ")\n";
+    if (!valid_range("copy_blocks", src_block, count) || !valid_range("copy_blocks", dst_block, count))
+        return -1;
+    size_t left = (size_t)count * block_size;
+    loff_t src = (loff_t)src_block * block_size;
+    loff_t dst = (loff_t)dst_block * block_size;
+    if (backend == DISK_MMAP) {
+        memmove(map + dst, map + src, left);
+        return written(0);
+    }
+    while (left > 0) {
+        ssize_t n = copy_file_range(fd, &src, fd, &dst, left, 0);
+        if (n <= 0)
+            return written(-1);
+        left -= n;
+    }
+    return written(0);
+}
+
+// tells the disk that count blocks from block_no hold no data, punching
+// a hole in the disk file so they read back as zeroes
+int
+Disk::discard(unsigned block_no, unsigned count)
+{
+    if (!valid_range("discard", block_no, count))
+        return -1;
+    off_t offset = (off_t)block_no * block_size;
+    off_t length = (off_t)count * block_size;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+        return written(0);
+    if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+        return written(0);
+    return -1;
+}
+
+// returns a pointer straight into the mapped block (mmap backend only),
+// nullptr if the backend can't provide one
+uint8_t *
+Disk::block_ptr(unsigned block_no)
+{
+    if (backend != DISK_MMAP || block_no >= no_blocks)
+        return nullptr;
+    return map + (size_t)block_no * block_size;
+}
+
+// makes all earlier writes durable (msync / fdatasync)
+int
+Disk::sync()
+{
+    std::lock_guard<std::mutex> lock(sync_lock);
+    return sync_locked();
+}
+
+// sync with sync_lock held
+int
+Disk::sync_locked()
+{
+    dirty = false;
+    syncs++;
+    if (backend == DISK_MMAP)
+        return msync(map, disk_size, MS_SYNC) == 0 ? 0 : -1;
+    return fdatasync(fd) == 0 ? 0 : -1;
+}
+
+// changes when writes are made durable, starting or stopping the periodic
+// sync thread
+void
+Disk::set_durability(DiskDurability mode, unsigned interval_ms)
+{
+    stop_periodic();
+    durability = mode;
+    sync_interval_ms = interval_ms > 0 ? interval_ms : SYNC_DEFAULT_INTERVAL_MS;
+    if (mode == DURABLE_PERIODIC) {
+        stop_syncer = false;
+        syncer = std::thread(&Disk::run_periodic, this);
+    }
+}
+
+// end of a command: syncs in DURABLE_COMMAND mode if anything was written
+int
+Disk::barrier()
+{
+    if (durability == DURABLE_COMMAND && dirty)
+        return sync();
+    return 0;
+}
+
+// stops the periodic sync thread, if it runs
+void
+Disk::stop_periodic()
+{
+    if (!syncer.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(sync_lock);
+        stop_syncer = true;
+    }
+    syncer_wake.notify_one();
+    syncer.join();
+}
+
+// the periodic sync thread: syncs every interval if anything was written
+void
+Disk::run_periodic()
+{
+    std::unique_lock<std::mutex> lock(sync_lock);
+    while (!stop_syncer) {
+        syncer_wake.wait_for(lock, std::chrono::milliseconds(sync_interval_ms));
+        if (!stop_syncer && dirty)
+            sync_locked();
+    }
+}
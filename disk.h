@@ -1,29 +1,141 @@
 #include <iostream>
 #include <fstream>
+#include <string>
 #include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "aio.h"
 
 #ifndef __DISK_H__
 #define __DISK_H__
 
 #define DISKNAME "diskfile.bin"
+// geometry of a newly created disk file, format can change it
 #define BLOCK_SIZE 4096
+#define DEFAULT_NO_BLOCKS 2048
 #define DEBUG false
+// how often the background thread syncs in periodic mode
+#define SYNC_DEFAULT_INTERVAL_MS 1000
+
+// how the disk file is accessed
+enum DiskBackend {
+    DISK_FILE, // positioned reads and writes on the disk file
+    DISK_MMAP  // the whole disk file mapped into memory
+};
+
+// when writes are made durable, besides explicit calls to sync
+enum DiskDurability {
+    DURABLE_NONE,     // only on sync and unmount
+    DURABLE_WRITE,    // every write request is synced before it returns
+    DURABLE_COMMAND,  // at the barrier that ends every file system command
+    DURABLE_PERIODIC  // by a background thread, every sync interval
+};
 
 class Disk {
 private:
-    std::fstream diskfile;
-    const unsigned no_blocks = 2048;
-    const unsigned disk_size = BLOCK_SIZE * no_blocks;
+    std::string name; // path of the disk file
+    int fd = -1;
+    unsigned block_size = BLOCK_SIZE;
+    unsigned no_blocks = DEFAULT_NO_BLOCKS;
+    uint64_t disk_size = (uint64_t)BLOCK_SIZE * DEFAULT_NO_BLOCKS;
+    DiskBackend backend;
+    uint8_t *map = nullptr;  // start of the mapping, mmap backend only
+    DiskDurability durability = DURABLE_NONE;
+    unsigned sync_interval_ms = SYNC_DEFAULT_INTERVAL_MS;
+    // written since the last sync
+    std::atomic<bool> dirty{false};
+    std::atomic<uint64_t> syncs{0};
+    // the periodic sync thread, sync_lock keeps it away from the mapping
+    // while the geometry changes
+    std::thread syncer;
+    std::mutex sync_lock;
+    std::condition_variable syncer_wake;
+    bool stop_syncer = false;
+    // carries out submit_read and submit_write on the disk file
+    AioEngine aio;
     bool disk_file_exists (const std::string& name);
+    bool open_mmap();
+    bool valid_range(const char *op, unsigned block_no, unsigned count);
+    int transfer(bool write, unsigned block_no, uint8_t *const *bufs, unsigned count);
+    int written(int result);
+    int sync_locked();
+    void stop_periodic();
+    void run_periodic();
 public:
-    Disk();
+    // the backend is taken from the FS_DISK_BACKEND environment variable
+    // ("mmap" or "file"), default is file. The durability mode is taken
+    // from FS_DURABILITY ("none", "write", "command" or "periodic"),
+    // default is none, and the periodic interval from FS_SYNC_INTERVAL_MS.
+    // FS_AIO picks how submitted requests are carried out, see AioEngine.
+    // The disk file is name, created if it doesn't exist.
+    Disk(const std::string& name = DISKNAME);
+    Disk(DiskBackend backend, const std::string& name = DISKNAME);
     ~Disk();
+    unsigned get_block_size() { return block_size; }
     unsigned get_no_blocks() { return no_blocks; }
-    unsigned get_disk_size() { return disk_size; }
+    uint64_t get_disk_size() { return disk_size; }
+    // changes the block size and number of blocks, resizing the disk file
+    int set_geometry(unsigned block_size, unsigned no_blocks);
+    DiskBackend get_backend() { return backend; }
     // writes one block to the disk
     int write(unsigned block_no, uint8_t *blk);
     // reads one block from the disk
     int read(unsigned block_no, uint8_t *blk);
+    // writes count consecutive blocks starting at block_no from buf, one request
+    int write_blocks(unsigned block_no, unsigned count, uint8_t *buf);
+    // reads count consecutive blocks starting at block_no into buf, one request
+    int read_blocks(unsigned block_no, unsigned count, uint8_t *buf);
+    // gather: writes bufs[i] to blocks[i], each run of consecutive block
+    // numbers becomes one request
+    int writev_blocks(const unsigned *blocks, uint8_t *const *bufs, unsigned count);
+    // scatter: reads blocks[i] into bufs[i], each run of consecutive block
+    // numbers becomes one request
+    int readv_blocks(const unsigned *blocks, uint8_t *const *bufs, unsigned count);
+    // starts reading count consecutive blocks from block_no into buf and
+    // returns at once with a ticket for wait, 0 if the blocks aren't on the
+    // disk. buf must stay untouched until the ticket is waited for.
+    uint64_t submit_read(unsigned block_no, unsigned count, uint8_t *buf);
+    // starts writing count consecutive blocks from buf to block_no, like
+    // submit_read
+    uint64_t submit_write(unsigned block_no, unsigned count, uint8_t *buf);
+    // true if the request is done, wait then returns at once
+    bool poll(uint64_t ticket);
+    // waits for a submitted request to finish, returns 0 or -1 on error.
+    // Every ticket must be waited for exactly once.
+    int wait(uint64_t ticket);
+    // picks how submitted requests are carried out, see AioBackend
+    void set_aio_backend(AioBackend backend) { aio.set_backend(backend); }
+    AioBackend get_aio_backend() { return aio.get_backend(); }
+    // copies count consecutive blocks from src_block to dst_block without
+    // passing the data through user space. Returns -1 if the disk file
+    // can't be copied within this way, the destination may then be partly
+    // written.
+    int copy_blocks(unsigned src_block, unsigned dst_block, unsigned count);
+    // sends the first bytes of count consecutive blocks to out_fd with
+    // sendfile, straight from the disk file. Returns -1 if out_fd can't be
+    // written this way (nothing was sent) and -2 if it failed part way.
+    int send_blocks(unsigned block_no, unsigned count, size_t bytes, int out_fd);
+    // tells the disk that count blocks from block_no hold no data, punching
+    // a hole in the disk file so they read back as zeroes. Returns -1 if the
+    // file system can't do that, the old contents are then left in place.
+    int discard(unsigned block_no, unsigned count);
+    // returns a pointer straight into the mapped block (mmap backend only),
+    // nullptr if the backend can't provide one
+    uint8_t *block_ptr(unsigned block_no);
+    // makes all earlier writes durable (msync / fdatasync)
+    int sync();
+    // changes when writes are made durable, interval_ms is used by the
+    // periodic mode
+    void set_durability(DiskDurability mode, unsigned interval_ms = SYNC_DEFAULT_INTERVAL_MS);
+    DiskDurability get_durability() { return durability; }
+    unsigned get_sync_interval() { return sync_interval_ms; }
+    // end of a command: syncs in DURABLE_COMMAND mode if anything was
+    // written since the last sync
+    int barrier();
+    // number of syncs since the disk was opened
+    uint64_t get_syncs() { return syncs; }
 };
 
 #endif // __DISK_H__
@@ -4,1474 +4,4185 @@
 #include <iomanip>
 #include <sstream>
 #include <string>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "fs.h"
 
-FS::FS()
+FS::FS(const std::string& diskname) : disk(diskname)
 {
+    if (mount() == 2)
+    {
+        std::cerr << "WARNING: The disk is unformatted or in an older format, "
+                  << "run format before using it" << std::endl;
+    }
 
+    // The cache size can be tuned per deployment without rebuilding
+    const char* cacheBlocks = getenv("FS_CACHE_BLOCKS");
+    if (cacheBlocks != nullptr)
+    {
+        cache.set_capacity(strtoul(cacheBlocks, nullptr, 10));
+    }
+    const char* readahead = getenv("FS_READAHEAD");
+    if (readahead != nullptr)
+    {
+        readaheadBlocks = strtoul(readahead, nullptr, 10);
+    }
 }
 
 FS::~FS()
 {
-
+    // Write back anything still pending before unmounting
+    sync();
 }
 
-// Splits a path into parent path + filename in the form of:
-// path = "/folder/file.txt" into parent = "/folder" + name = "file.txt"
-void
-FS::splitParentPath(const std::string& path, std::string& parent, std::string& name) 
+// Reads the superblock, the FAT and the reference counts. The FAT is
+// loaded once at mount time and kept resident in memory, all later
+// lookups and updates go against this copy. Committed journal
+// transactions are replayed before the FAT is read. A disk without a
+// valid superblock is left unformatted with the default geometry until
+// format is run.
+int
+FS::mount()
 {
-    // Find last '/' in the path
-    size_t pos = path.find_last_of('/');
-    if (pos == std::string::npos) 
+    std::vector<uint8_t> buf(disk.get_block_size());
+    if (disk.read(SUPER_BLOCK, buf.data()) != 0)
     {
-        // No '/' means parent is current directory
-        parent = "";
-        name = path;
-    } 
-    else if (pos == 0) 
+        std::cerr << "ERROR: Can't read superblock from disk" << std::endl;
+        return 1;
+    }
+    superblock onDisk;
+    memcpy(&onDisk, buf.data(), sizeof(superblock));
+    if (onDisk.magic != FS_MAGIC || onDisk.version < FS_MIN_VERSION || onDisk.version > FS_VERSION)
     {
-        // Path like "/file" means parent is root
-        parent = "/";
-        name = path.substr(1);
-    } 
-    else
+        setGeometry(disk.get_block_size(), disk.get_no_blocks());
+        allocator.build(fat.data(), disk.get_no_blocks());
+        cache.set_hold_dirty(false);
+        return 2;
+    }
+    if (onDisk.version < 5)
     {
-        // Default case
-        parent = path.substr(0, pos);
-        name = path.substr(pos + 1);
+        onDisk.journal_start = 0;
+        onDisk.journal_blocks = 0;
     }
+
+    if (disk.set_geometry(onDisk.block_size, onDisk.no_blocks) != 0)
+    {
+        std::cerr << "ERROR: Can't use the geometry in the superblock" << std::endl;
+        return 3;
+    }
+    setGeometry(onDisk.block_size, onDisk.no_blocks, onDisk.journal_blocks);
+    sb = onDisk;
+
+    if (sb.journal_blocks != 0 && replayJournal() != 0)
+    {
+        std::cerr << "ERROR: Can't replay the journal" << std::endl;
+        return 6;
+    }
+    cache.set_hold_dirty(sb.journal_blocks != 0);
+
+    if (disk.read_blocks(FAT_BLOCK, sb.fat_blocks, reinterpret_cast<uint8_t*>(fat.data())) != 0)
+    {
+        std::cerr << "ERROR: Can't read FAT from disk" << std::endl;
+        return 4;
+    }
+    if (disk.read_blocks(sb.ref_start, sb.ref_blocks, refs.data()) != 0)
+    {
+        std::cerr << "ERROR: Can't read reference counts from disk" << std::endl;
+        return 5;
+    }
+    allocator.build(fat.data(), sb.no_blocks);
+    allocator.set_policy(static_cast<AllocPolicy>(sb.alloc_policy));
+    formatted = true;
+    return 0;
 }
-//                  Path to resolve | Directory Flag | Disk block requested
-int              
-FS::resolvePath(const std::string& path, bool mustBeDir, uint16_t& outBlock) 
+
+// Writes the in-memory superblock to the disk
+int
+FS::writeSuperblock()
 {
-    // Determine absolute or relative path
-    uint16_t current = (path.size() > 0 && path[0] == '/') ? ROOT_BLOCK : currentDirectory;
+    std::vector<uint8_t> buf(blockSize);
+    memcpy(buf.data(), &sb, sizeof(superblock));
+    return disk.write(SUPER_BLOCK, buf.data());
+}
 
-    // Split by '/'
-    std::stringstream ss(path);
-    std::string token;
-    std::vector<std::string> tokens;
-    while (std::getline(ss, token, '/')) 
+// Sizes the in-memory FAT, the reference counts and the superblock for the
+// given geometry. The superblock, root, FAT, reference count and journal
+// blocks are marked as used, everything else free.
+void
+FS::setGeometry(unsigned block_size, unsigned no_blocks, unsigned journal_blocks)
+{
+    blockSize = block_size;
+    entriesPerBlock = block_size / sizeof(dir_entry);
+
+    const unsigned entriesPerFatBlock = block_size / sizeof(int32_t);
+    const unsigned fatBlocks = (no_blocks + entriesPerFatBlock - 1) / entriesPerFatBlock;
+    const unsigned refBlocks = (no_blocks + block_size - 1) / block_size;
+
+    sb.magic = FS_MAGIC;
+    sb.version = FS_VERSION;
+    sb.block_size = block_size;
+    sb.no_blocks = no_blocks;
+    sb.fat_start = FAT_BLOCK;
+    sb.fat_blocks = fatBlocks;
+    sb.root_block = ROOT_BLOCK;
+    sb.ref_start = FAT_BLOCK + fatBlocks;
+    sb.ref_blocks = refBlocks;
+    sb.layout = LAYOUT_FAT;
+    sb.inline_data = 0;
+    sb.journal_start = sb.ref_start + refBlocks;
+    sb.journal_blocks = journal_blocks;
+
+    fat.assign((size_t)fatBlocks * entriesPerFatBlock, FAT_FREE);
+    fatBlockDirty.assign(fatBlocks, false);
+    refs.assign((size_t)refBlocks * block_size, 0);
+    refBlockDirty.assign(refBlocks, false);
+    fatDirty = false;
+    fatUpdates = 0;
+    journalHead = 0;
+    journalSeq = 1;
+    journalLogged.clear();
+    journalRevokes.clear();
+    journalFreed.clear();
+    groupCommands = 0;
+
+    fat[SUPER_BLOCK] = FAT_EOF;
+    fat[ROOT_BLOCK] = FAT_EOF;
+    for (unsigned i = 0; i < fatBlocks + refBlocks + journal_blocks; i++)
     {
-        if (!token.empty())
-        {
-            tokens.push_back(token);
-        } 
+        fat[FAT_BLOCK + i] = FAT_EOF;
     }
+}
 
-    // Empty path just means current directory
-    if (tokens.empty()) 
+// Updates one FAT entry and remembers which FAT block it lives in. A block
+// with an image in the journal is revoked when it is freed or allocated
+// again, so the image is not replayed over whatever the block holds next.
+void
+FS::setFat(unsigned block, int32_t value)
+{
+    if ((value == FAT_FREE || fat[block] == FAT_FREE) && journalLogged.count(block) != 0)
     {
-        outBlock = current;
-        return 0;
+        journalRevokes.push_back(block);
+        journalLogged.erase(block);
     }
+    fat[block] = value;
+    fatBlockDirty[block / (blockSize / sizeof(int32_t))] = true;
+    fatDirty = true;
+}
+
+// Sets the number of extra owners of a data block, 0 means the block
+// belongs to one file only
+void
+FS::setRef(unsigned block, uint8_t value)
+{
+    refs[block] = value;
+    refBlockDirty[block / blockSize] = true;
+    fatDirty = true;
+}
 
-    // Traverse
-    for (size_t i = 0; i < tokens.size(); i++) 
+// Records that the in-memory FAT has changed, and writes it back if the
+// configured number of updates has been reached. On a journaled disk it
+// is only written back after a commit.
+void
+FS::markFatDirty()
+{
+    fatDirty = true;
+    fatUpdates++;
+    if (fatSyncInterval != 0 && fatUpdates >= fatSyncInterval && sb.journal_blocks == 0)
     {
-        const std::string& part = tokens[i];
+        syncFat();
+    }
+}
 
-        if (part == "..") 
+// Writes the blocks of an on-disk table whose in-memory copy in data has
+// changed, one disk request per run of dirty blocks
+int
+FS::writeDirtyBlocks(unsigned firstBlock, const uint8_t* data, std::vector<bool>& dirty)
+{
+    unsigned i = 0;
+    while (i < dirty.size())
+    {
+        if (!dirty[i])
         {
-            if (current == ROOT_BLOCK) 
-            {
-                continue; // stay at root
-            }
-
-            uint8_t buf[BLOCK_SIZE];
-            if (disk.read(current, buf) != 0)
-            {
-                return -1;
-            }
-            dir_entry* entries = reinterpret_cast<dir_entry*>(buf);
-            current = entries[0].first_blk; // parent pointer
+            i++;
             continue;
         }
-
-        // Must search current directory for part
-        uint8_t buf[BLOCK_SIZE];
-        if (disk.read(current, buf) != 0)
+        unsigned run = 1;
+        while (i + run < dirty.size() && dirty[i + run])
         {
-            return -2;
-        } 
-        dir_entry* entries = reinterpret_cast<dir_entry*>(buf);
-
-        bool found = false;
-        for (int j = 0; j < BLOCK_SIZE / sizeof(dir_entry); j++) 
+            run++;
+        }
+        uint8_t* src = const_cast<uint8_t*>(data + (size_t)i * blockSize);
+        if (disk.write_blocks(firstBlock + i, run, src) != 0)
         {
-            if (strcmp(entries[j].file_name, part.c_str()) == 0) 
-            {
-                // check execute rights when stepping into a directory
-                if (entries[j].type == TYPE_DIR) 
-                {
-                    if (!(entries[j].access_rights & EXECUTE)) 
-                    {
-                        std::cout << "ERROR: no execute rights on directory " << entries[j].file_name << std::endl;
-                        return -3;
-                    }
-                }
-
-                // If it's the last token, check if it's a directory
-                if (i == tokens.size() - 1) 
-                {
-                    if (mustBeDir && entries[j].type != TYPE_DIR)
-                    {
-                        return -4;
-                    } 
-
-                    current = entries[j].first_blk;
-                    found = true;
-                    break;
-                } 
-                else 
-                {
-                    // must be directory if not last
-                    if (entries[j].type != TYPE_DIR)
-                    {
-                        return -5;
-                    }             
-                    
-                    current = entries[j].first_blk;
-                    found = true;
-                    break;
-                }
-            }
+            return 1;
         }
-        if (!found) 
+        for (unsigned j = i; j < i + run; j++)
         {
-            return -6; // not found
+            dirty[j] = false;
         }
+        i += run;
     }
-
-    outBlock = current;
     return 0;
 }
 
-// formats the disk, i.e., creates an empty file system
-int 
-FS::format()
+// Writes the FAT and reference count blocks that differ from the on-disk
+// copy
+int
+FS::syncFat()
 {
-    // Set root(0) and FAT(1) slots to used
-    fat[ROOT_BLOCK] = FAT_EOF;
-    fat[FAT_BLOCK] = FAT_EOF;
-
-    // Mark all blocks as free (except root and FAT)
-    const unsigned number_of_blocks = disk.get_no_blocks();
-    for (int i = 2; i < number_of_blocks; i++) 
+    if (!fatDirty)
     {
-        fat[i] = FAT_FREE;
+        return 0;
     }
-
-    // Initialize root directory block
-    uint8_t rootBuf[BLOCK_SIZE];
-    memset(rootBuf, 0, BLOCK_SIZE);
-    dir_entry* rootEntries = reinterpret_cast<dir_entry*>(rootBuf);
-
-    // root's ".." points to itself for consistency with helper functions
-    strcpy(rootEntries[0].file_name, "..");
-    rootEntries[0].first_blk = ROOT_BLOCK;  
-    rootEntries[0].type = TYPE_DIR;
-    rootEntries[0].size = 0;
-    rootEntries[0].access_rights = READ | WRITE | EXECUTE;  // Default for root: RWX
-
-    // Write root block
-    if (disk.write(ROOT_BLOCK, rootBuf) != 0)
+    if (writeDirtyBlocks(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat.data()), fatBlockDirty) != 0)
     {
         return 1;
-    }           
-    // Write formatted FAT to disk
-    if (disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat)) != 0)
+    }
+    if (writeDirtyBlocks(sb.ref_start, refs.data(), refBlockDirty) != 0)
     {
-        return 2;
+        return 1;
     }
+    fatDirty = false;
+    fatUpdates = 0;
+    return 0;
+}
 
-    // Clear all other blocks
-    uint8_t emptyBuf[BLOCK_SIZE];
-    memset(emptyBuf, 0, BLOCK_SIZE);
-    for (int i = 2; i < number_of_blocks; i++) 
+// FNV-1a hash of a transaction, a torn write changes it
+uint32_t
+FS::journalChecksum(const uint8_t* data, size_t bytes)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < bytes; i++)
     {
-        if (disk.write(i, emptyBuf) != 0)
-        {
-            return 3;
-        }
+        hash = (hash ^ data[i]) * 16777619u;
     }
-
-    return 0;
+    return hash;
 }
 
-// create <filepath> creates a new file on the disk, the data content is
-// written on the following rows (ended with an empty row)
-int 
-FS::create(std::string filepath)
+// Writes the journal header, the log starts over with transaction journalSeq
+int
+FS::writeJournalHeader()
 {
-    // Split into parent path + file name
-    std::string parentPath, name;
-    splitParentPath(filepath, parentPath, name);
+    std::vector<uint8_t> buf(blockSize, 0);
+    journal_header header{JOURNAL_MAGIC, journalSeq};
+    memcpy(buf.data(), &header, sizeof(header));
+    return disk.write(sb.journal_start, buf.data());
+}
 
-    // Filename length check
-    if (name.size() >= 56) 
+// Writes the images of every committed transaction in the log to their
+// home blocks, in order, skipping images of blocks a later transaction
+// freed. The log ends at the first transaction with a wrong sequence
+// number, a missing commit block or a bad checksum. Afterwards the log
+// starts over.
+int
+FS::replayJournal()
+{
+    const unsigned logBlocks = sb.journal_blocks - 1;
+    std::vector<uint8_t> log((size_t)sb.journal_blocks * blockSize);
+    if (disk.read_blocks(sb.journal_start, sb.journal_blocks, log.data()) != 0)
     {
         return 1;
     }
+    journal_header header;
+    memcpy(&header, log.data(), sizeof(header));
+    uint32_t seq = (header.magic == JOURNAL_MAGIC) ? header.start_seq : 1;
+
+    // Find the committed transactions
+    std::vector<unsigned> starts;
+    std::unordered_map<uint32_t, uint32_t> revokedBy; // block -> last seq that freed it
+    unsigned pos = 0;
+    while (header.magic == JOURNAL_MAGIC && pos + 2 <= logBlocks)
+    {
+        const uint8_t* txn = log.data() + (size_t)(1 + pos) * blockSize;
+        journal_descriptor desc;
+        memcpy(&desc, txn, sizeof(desc));
+        if (desc.magic != JOURNAL_DESC_MAGIC || desc.seq != seq ||
+            desc.blocks > logBlocks || desc.revokes > sb.no_blocks)
+        {
+            break;
+        }
+        uint64_t descBytes = sizeof(desc) + 4 * ((uint64_t)desc.blocks + desc.revokes);
+        uint64_t total = (descBytes + blockSize - 1) / blockSize + desc.blocks + 1;
+        if (pos + total > logBlocks)
+        {
+            break;
+        }
+        journal_commit commit;
+        memcpy(&commit, txn + (total - 1) * blockSize, sizeof(commit));
+        if (commit.magic != JOURNAL_COMMIT_MAGIC || commit.seq != seq ||
+            commit.checksum != journalChecksum(txn, (total - 1) * blockSize))
+        {
+            break;
+        }
+        const uint32_t* revokes = reinterpret_cast<const uint32_t*>(txn + sizeof(desc)) + desc.blocks;
+        for (uint32_t i = 0; i < desc.revokes; i++)
+        {
+            revokedBy[revokes[i]] = seq;
+        }
+        starts.push_back(pos);
+        pos += total;
+        seq++;
+    }
 
-    // Resolve parent directory
-    uint16_t parentBlock;
-    int retVal = resolvePath(parentPath, true, parentBlock);
-    if (retVal != 0) 
+    // Apply them
+    for (unsigned t = 0; t < starts.size(); t++)
     {
-        return retVal;
+        const uint8_t* txn = log.data() + (size_t)(1 + starts[t]) * blockSize;
+        journal_descriptor desc;
+        memcpy(&desc, txn, sizeof(desc));
+        const uint32_t* homes = reinterpret_cast<const uint32_t*>(txn + sizeof(desc));
+        size_t descBlocks = (sizeof(desc) + 4 * ((size_t)desc.blocks + desc.revokes) + blockSize - 1) / blockSize;
+        for (uint32_t i = 0; i < desc.blocks; i++)
+        {
+            auto it = revokedBy.find(homes[i]);
+            if (homes[i] == SUPER_BLOCK || homes[i] >= sb.no_blocks ||
+                (it != revokedBy.end() && it->second > desc.seq))
+            {
+                continue;
+            }
+            uint8_t* image = const_cast<uint8_t*>(txn) + (descBlocks + i) * blockSize;
+            if (disk.write(homes[i], image) != 0)
+            {
+                return 1;
+            }
+        }
     }
-    
-    // Read parent directory
-    uint8_t dirBuffer[BLOCK_SIZE];
-    if (disk.read(parentBlock, dirBuffer) != 0)
+    if (!starts.empty() && disk.sync() != 0)
     {
-        return 2;
+        return 1;
     }
-    dir_entry* directory_entries = reinterpret_cast<dir_entry*>(dirBuffer);
-    
-    // Check write permission on parent directory
-    if (!(directory_entries[0].access_rights & WRITE)) 
+    jstats.replayed += starts.size();
+
+    // A number no stale transaction in the log can have
+    journalSeq = seq + 1;
+    journalHead = 0;
+    journalLogged.clear();
+    return writeJournalHeader();
+}
+
+// Makes the home blocks of every committed transaction durable, then
+// starts the log over so its blocks can be used again. The new header is
+// synced as well, blocks freed afterwards are no longer revoked and the
+// old log must not be replayed over them.
+int
+FS::checkpointJournal()
+{
+    if (disk.sync() != 0)
     {
-        std::cout << "No write rights on parent directory" << std::endl;
-        return 3;
+        return 1;
+    }
+    journalHead = 0;
+    journalLogged.clear();
+    jstats.checkpoints++;
+    if (writeJournalHeader() != 0 || disk.sync() != 0)
+    {
+        return 1;
     }
+    return 0;
+}
 
-    // Check for duplicate file
-    for (int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++) 
+// Commits the metadata changed since the last commit as one transaction.
+// The changed FAT and reference count blocks and the dirty cached blocks,
+// which are directory and layout blocks, are written to the log. File data
+// is written straight to the disk and never logged. A single sync makes
+// the log and the data written before it durable, then the blocks are
+// written to their home locations, and blocks freed by the transaction go
+// back to the allocator. A transaction larger than the whole log is
+// written in place instead, without the journal's protection.
+int
+FS::commitJournal()
+{
+    groupCommands = 0;
+    std::vector<unsigned> homes;
+    std::vector<uint8_t> images;
+    const unsigned entriesPerFatBlock = blockSize / sizeof(int32_t);
+    for (unsigned i = 0; i < fatBlockDirty.size(); i++)
     {
-        if (directory_entries[i].file_name[0] != '\0' && strcmp(directory_entries[i].file_name, name.c_str()) == 0) 
+        if (fatBlockDirty[i])
         {
-            return 4;
+            const uint8_t* src = reinterpret_cast<const uint8_t*>(fat.data() + (size_t)i * entriesPerFatBlock);
+            homes.push_back(FAT_BLOCK + i);
+            images.insert(images.end(), src, src + blockSize);
         }
     }
-
-    // Read file data from stdin
-    std::string completedText, line;
-    while (true) 
+    for (unsigned i = 0; i < refBlockDirty.size(); i++)
     {
-        if (!std::getline(std::cin, line))
-        {
-            break;
-        } 
-        if (line.empty())
+        if (refBlockDirty[i])
         {
-            break;
-        } 
-        completedText.append(line + "\n");
+            const uint8_t* src = refs.data() + (size_t)i * blockSize;
+            homes.push_back(sb.ref_start + i);
+            images.insert(images.end(), src, src + blockSize);
+        }
     }
-
-    // Load FAT
-    if (disk.read(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat)) != 0)
+    cache.get_dirty(homes, images);
+    if (homes.empty() && journalRevokes.empty())
     {
-        return 5;
+        return 0;
     }
 
-    // Allocate blocks for new file
-    std::vector<uint16_t> freeBlocks;
-    int textLeft = completedText.size();
-    int textWritten = 0;
-
-    while (textLeft > 0) 
+    const unsigned logBlocks = sb.journal_blocks - 1;
+    size_t descBytes = sizeof(journal_descriptor) + 4 * (homes.size() + journalRevokes.size());
+    unsigned descBlocks = (descBytes + blockSize - 1) / blockSize;
+    unsigned total = descBlocks + homes.size() + 1;
+    if (total > logBlocks)
     {
-        int freeBlock = -1;
-        for (int i = 0; i < disk.get_no_blocks(); i++) 
+        // Retire the log first so none of it is replayed over these blocks
+        if (checkpointJournal() != 0 ||
+            syncFat() != 0 || cache.sync() != 0 || disk.sync() != 0)
         {
-            if (fat[i] == FAT_FREE) 
-            { 
-                freeBlock = i;
-                break; 
-            }
+            return 1;
         }
-        // No free blocks in FAT
-        if (freeBlock == -1)
-        {
-            return 6;
-        } 
-
-        freeBlocks.push_back(freeBlock);
-
-        uint8_t buf[BLOCK_SIZE]{};
-        int toWrite = std::min(textLeft, BLOCK_SIZE);
-        memcpy(buf, completedText.data() + textWritten, toWrite);
-
-        if (disk.write(freeBlock, buf) != 0)
-        {
-            return 7;
-        } 
-
-        textWritten += toWrite;
-        textLeft -= toWrite;
+        journalRevokes.clear();
+        releaseFreed();
+        return 0;
     }
-
-    // Update FAT
-    for (int i = 0; i < (int)freeBlocks.size(); i++) 
+    if (journalHead + total > logBlocks && checkpointJournal() != 0)
     {
-        fat[freeBlocks[i]] = (i + 1 < (int)freeBlocks.size()) ? freeBlocks[i + 1] : FAT_EOF;
+        return 1;
     }
 
-    if (disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat)) != 0)
+    std::vector<uint8_t> buf((size_t)total * blockSize, 0);
+    journal_descriptor desc{JOURNAL_DESC_MAGIC, journalSeq, (uint32_t)homes.size(), (uint32_t)journalRevokes.size()};
+    memcpy(buf.data(), &desc, sizeof(desc));
+    uint32_t* list = reinterpret_cast<uint32_t*>(buf.data() + sizeof(desc));
+    for (size_t i = 0; i < homes.size(); i++)
     {
-        return 8;
+        list[i] = homes[i];
     }
-        
-    // Create dir_entry
-    dir_entry newFile{};
-    strncpy(newFile.file_name, name.c_str(), sizeof(newFile.file_name) - 1);
-    newFile.file_name[sizeof(newFile.file_name) - 1] = '\0';
-    newFile.size = completedText.size();
-    newFile.first_blk = freeBlocks.empty() ? 0xFFFF : freeBlocks[0];
-    newFile.type = TYPE_FILE;
-    newFile.access_rights = READ | WRITE;
-
-    // Insert into parent directory
-    bool inserted = false;
-    for (int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++) 
+    for (size_t i = 0; i < journalRevokes.size(); i++)
     {
-        if (directory_entries[i].file_name[0] == '\0') 
-        {
-            directory_entries[i] = newFile;
-            inserted = true;
-            break;
-        }
+        list[homes.size() + i] = journalRevokes[i];
     }
-    // Directory full
-    if (!inserted) 
+    memcpy(buf.data() + (size_t)descBlocks * blockSize, images.data(), images.size());
+    size_t commitOffset = (size_t)(total - 1) * blockSize;
+    journal_commit commit{JOURNAL_COMMIT_MAGIC, journalSeq, journalChecksum(buf.data(), commitOffset)};
+    memcpy(buf.data() + commitOffset, &commit, sizeof(commit));
+
+    if (disk.write_blocks(sb.journal_start + 1 + journalHead, total, buf.data()) != 0 || disk.sync() != 0)
     {
-        return 9; 
+        return 1;
     }
-
-    if (disk.write(parentBlock, dirBuffer) != 0)
+    journalHead += total;
+    journalSeq++;
+    journalRevokes.clear();
+    journalLogged.insert(homes.begin(), homes.end());
+    releaseFreed();
+    jstats.commits++;
+    jstats.blocks += homes.size();
+
+    // Committed, so the home blocks can be written in any order
+    if (syncFat() != 0 || cache.sync() != 0)
     {
-        return 10;
+        return 1;
     }
-        
     return 0;
 }
 
-// cat <filepath> reads the content of a file and prints it on the screen
-// in the format of "Folder/SubFolder/File" or "/Folder/SubFolder/file"
+// Writes the metadata changed since the last call to the disk: on a
+// journaled disk by committing it, otherwise in place
 int
-FS::cat(std::string filepath) 
+FS::writeBackMetadata()
 {
-    // Find the parent directory and entry
-    std::string parentPath, filename;
-    splitParentPath(filepath, parentPath, filename);
-
-    uint16_t parentBlock;
-    int retVal = resolvePath(parentPath, true, parentBlock);
-    if (retVal != 0) 
+    if (sb.journal_blocks != 0)
     {
-        return retVal;
+        return commitJournal();
     }
-
-    uint8_t buf[BLOCK_SIZE];
-    if (disk.read(parentBlock, buf) != 0)
+    if (cache.sync() != 0 || syncFat() != 0)
     {
         return 1;
     }
+    return 0;
+}
 
-    dir_entry* entries = reinterpret_cast<dir_entry*>(buf);
-    dir_entry* targetFile = nullptr;
-
-    for (int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++) 
+// Takes metaLock, unless the calling thread already holds it exclusively
+// because a command it runs called another public call
+FS::lock_scope::lock_scope(FS& fs, bool exclusive) : fs(fs), exclusive(exclusive)
+{
+    if (fs.metaOwner.load() == std::this_thread::get_id())
     {
-        if (strcmp(entries[i].file_name, filename.c_str()) == 0) 
-        {
-            targetFile = &entries[i];
-            break;
-        }
+        return;
     }
+    if (exclusive)
+    {
+        fs.metaLock.lock();
+        fs.metaOwner.store(std::this_thread::get_id());
+    }
+    else
+    {
+        fs.metaLock.lock_shared();
+    }
+    locked = true;
+}
 
-    if (!targetFile) 
+FS::lock_scope::~lock_scope()
+{
+    if (!locked)
     {
-        return 2;
+        return;
     }
-    if (targetFile->type == TYPE_DIR)
+    if (exclusive)
     {
-        return 3;
-    } 
-    if (!(targetFile->access_rights & READ))
+        fs.metaOwner.store(std::thread::id());
+        fs.metaLock.unlock();
+    }
+    else
     {
-        //std::cout << "ERROR: no read permission\n";
-        return 4;
+        fs.metaLock.unlock_shared();
     }
+}
 
-    // Load FAT
-    if (disk.read(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat)) != 0)
+// Ends a command that may have changed metadata. With per-write or
+// per-command durability it is written back and synced right away. With
+// periodic durability it is written back once an interval has passed
+// since the first command after the last write-back, the disk's
+// background thread syncs it. On a journaled disk its changes otherwise
+// join the current group, which is committed once it has enough
+// commands, its first command is old enough or it would fill half the log.
+void
+FS::endCommand()
+{
+    DiskDurability durability = disk.get_durability();
+    if (sb.journal_blocks != 0)
     {
-        return 5;
+        jstats.commands++;
     }
-
-    // Traverse file blocks and print
-    int16_t fileBlock = static_cast<int16_t>(targetFile->first_blk);
-    int bytesToRead = targetFile->size;
-
-    while (fileBlock != FAT_EOF && bytesToRead > 0) 
+    if (durability == DURABLE_WRITE || durability == DURABLE_COMMAND)
     {
-        uint8_t blockBuffer[BLOCK_SIZE];
-        if (disk.read(fileBlock, blockBuffer) != 0)
+        if (writeBackMetadata() != 0 || disk.barrier() != 0)
         {
-            return 6;
+            std::cerr << "ERROR: Can't make the command durable" << std::endl;
         }
-
-        int bytesToPrint = std::min(bytesToRead, BLOCK_SIZE);
-        std::cout.write(reinterpret_cast<char*>(blockBuffer), bytesToPrint);
-
-        bytesToRead -= bytesToPrint;
-        fileBlock = fat[fileBlock];
+        return;
     }
-
-    std::cout << std::endl;
-    return 0;
-}
-
-// Helper function for printing access rights
-std::string FS::rightsTripletString(uint8_t rights) 
-{
-    std::string string = "";
-    string += (rights & READ)    ? "r" : "-";
-    string += (rights & WRITE)   ? "w" : "-";
-    string += (rights & EXECUTE) ? "x" : "-";
-    return string;
-}
-
-// ls lists the content in the currect directory (files and sub-directories)
-int
-FS::ls()
-{
-    // Load in current directory to print
-    uint8_t dirBuffer[BLOCK_SIZE];
-    if (disk.read(currentDirectory, dirBuffer) != 0)
+    if (sb.journal_blocks == 0 && durability != DURABLE_PERIODIC)
     {
-        return 1;
+        return;
     }
-    dir_entry* dir_entries = reinterpret_cast<dir_entry*>(dirBuffer);
 
-    // Header format
-    std::cout << std::endl;
-    std::cout 
-    << std::left << std::setw(20)
-    << "name"
-    << std::setw(15)
-    << "type"
-    << std::setw(15)
-    << "accessrights"
-    << std::setw(15)
-    << "size" 
-    << std::endl;
-    
-    std::string type = "";
-    
-    for (int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++)
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (groupCommands++ == 0)
     {
-        if (dir_entries[i].file_name[0] == '\0')
+        groupStart = now;
+    }
+    if (sb.journal_blocks == 0)
+    {
+        if (now - groupStart >= std::chrono::milliseconds(disk.get_sync_interval()))
         {
-            continue;
+            groupCommands = 0;
+            if (writeBackMetadata() != 0)
+            {
+                std::cerr << "ERROR: Can't write back metadata" << std::endl;
+            }
         }
-
-        if (strcmp(dir_entries[i].file_name, "..") == 0)
+        return;
+    }
+    unsigned pending = cache.dirty_count() +
+        std::count(fatBlockDirty.begin(), fatBlockDirty.end(), true) +
+        std::count(refBlockDirty.begin(), refBlockDirty.end(), true);
+    if (groupCommands >= groupMaxCommands || pending >= (sb.journal_blocks - 1) / 2 ||
+        now - groupStart >= std::chrono::milliseconds(groupMaxMs))
+    {
+        if (commitJournal() != 0)
         {
-            continue;
+            std::cerr << "ERROR: Can't commit the journal" << std::endl;
         }
-
-        // Get file type
-        type = (dir_entries[i].type == TYPE_FILE) ? "file" : "dir";
-       
-        std::cout 
-        << std::left << std::setw(20) 
-        << dir_entries[i].file_name 
-        << std::setw(15) 
-        << type 
-        << std::setw(15) 
-        << rightsTripletString(dir_entries[i].access_rights)
-        << std::setw(15) 
-        << ((type == "dir") ? "-" : std::to_string(dir_entries[i].size)) // "-" if tpye is directory, otherwise file size
-        << std::endl; 
     }
-    std::cout << std::endl;
-    
-    return 0;
 }
 
-// cp <sourcepath> <destpath> makes an exact copy of the file
-// <sourcepath> to a new file <destpath>
-int 
-FS::cp(std::string sourcepath, std::string destpath)
+// Links a list of allocated blocks into one FAT chain ending with FAT_EOF
+void
+FS::linkBlocks(const std::vector<uint16_t>& blocks)
 {
-    // Split source path
-    std::string sourceParent, sourceName;
-    splitParentPath(sourcepath, sourceParent, sourceName);
-
-    // Resolve source parent directory
-    uint16_t sourceDirBlock;
-    int retVal = resolvePath(sourceParent, true, sourceDirBlock);
-    if (retVal != 0)
-    {   
-        return retVal; // source parent invalid
+    if (blocks.empty())
+    {
+        return;
     }
-        
-    // Find source file
-    uint8_t sourceDirBuf[BLOCK_SIZE];
-    if (disk.read(sourceDirBlock, sourceDirBuf) != 0)
+    for (size_t i = 0; i < blocks.size(); i++) 
     {
-        return 2;
+        setFat(blocks[i], (i + 1 < blocks.size()) ? blocks[i + 1] : FAT_EOF);
     }
-        
-    dir_entry* sourceEntries = reinterpret_cast<dir_entry*>(sourceDirBuf);
-    dir_entry* sourceFile = nullptr;
-    for (int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++) 
+    markFatDirty();
+}
+
+// Gives blocks that were allocated but never linked back to the allocator
+void
+FS::releaseBlocks(const std::vector<uint16_t>& blocks)
+{
+    for (size_t i = 0; i < blocks.size(); i++)
     {
-        if (sourceEntries[i].file_name[0] != '\0' && strcmp(sourceEntries[i].file_name, sourceName.c_str()) == 0) 
-        {
-            sourceFile = &sourceEntries[i];
-            break;
-        }
+        allocator.release(blocks[i]);
     }
+}
 
-    if (!sourceFile || sourceFile->type != TYPE_FILE)
+// Frees a block of a file. On a journaled disk the allocator only gets it
+// back once the transaction freeing it is committed: until then the FAT
+// on disk still gives it to the file, and new data written to it would
+// show up in that file after a crash.
+void
+FS::freeBlock(unsigned block)
+{
+    setFat(block, FAT_FREE);
+    if (sb.journal_blocks != 0)
     {
-        return 3; // source not found or is a dir
+        journalFreed.push_back(block);
     }
-     // Access rights: must be readable
-    if (!(sourceFile->access_rights & READ)) 
+    else
     {
-        std::cout << "ERROR: no READ permission on " << sourceFile->file_name << "\n";
-        return 4;
+        allocator.release(block);
     }
+}
 
-    // Handle destination
-    std::string destParent, destName;
-    splitParentPath(destpath, destParent, destName);
-
-    uint16_t destDirBlock;
-    retVal = resolvePath(destParent, true, destDirBlock);
-    if (retVal != 0)
+// Gives the blocks freed by a committed transaction to the allocator
+void
+FS::releaseFreed()
+{
+    for (size_t i = 0; i < journalFreed.size(); i++)
     {
-        return retVal; // invalid dest parent
+        allocator.release(journalFreed[i]);
     }
-        
-    // Load destination directory
-    uint8_t destDirBuf[BLOCK_SIZE];
-    if (disk.read(destDirBlock, destDirBuf) != 0)
+    journalFreed.clear();
+}
+
+// Length of the run of consecutive blocks starting at block in its FAT
+// chain, at most maxBlocks long
+unsigned
+FS::chainRun(int32_t block, unsigned maxBlocks)
+{
+    unsigned run = 1;
+    while (run < maxBlocks && fat[block] == block + 1)
     {
-        return 5;
+        block++;
+        run++;
     }
-    
-    dir_entry* destEntries = reinterpret_cast<dir_entry*>(destDirBuf);
+    return run;
+}
 
-    // Check WRITE on destination parent
-    if (destDirBlock != ROOT_BLOCK) 
+// The blocks of the chain starting at firstBlock as extents of consecutive
+// blocks, from the block map cache or else by walking the FAT once. A file
+// stored as extents has them listed in its first block. Returns -1 if that
+// block can't be read.
+int
+FS::chainExtents(uint16_t firstBlock, std::vector<extent>& extents)
+{
+    if (bmap.lookup(firstBlock, extents))
     {
-        if (!(destEntries[0].access_rights & WRITE)) 
-        {
-            std::cout << "No WRITE rights on destination parent directory\n";
-            return 6;
-        }
+        return 0;
     }
-
-    // If destpath refers to an existing directory, copy inside it with same name
-    if (!destName.empty()) 
+    extents.clear();
+    if (fat[firstBlock] == FAT_LAYOUT)
     {
-        for (int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++) 
+        std::vector<uint8_t> buf(blockSize);
+        if (cache.read(firstBlock, buf.data()) != 0)
         {
-            if (destEntries[i].file_name[0] != '\0' && strcmp(destEntries[i].file_name, destName.c_str()) == 0 && destEntries[i].type == TYPE_DIR) 
-            {
-                // Adjust if it's a directory
-                destDirBlock = destEntries[i].first_blk; 
-                destName = sourceName;
-
-                if (disk.read(destDirBlock, destDirBuf) != 0)
-                {
-                    return 7;
-                }
-                    
-                destEntries = reinterpret_cast<dir_entry*>(destDirBuf);
-                break;
-            }
+            return -1;
         }
-    } 
-    else
-    {
-        // Path ended with "/" → means directory, keep same name
-        destName = sourceName;
+        const layout_header* header = reinterpret_cast<const layout_header*>(buf.data());
+        const extent* list = reinterpret_cast<const extent*>(buf.data() + sizeof(layout_header));
+        extents.assign(list, list + std::min(header->extents, layoutCapacity()));
     }
-
-    // Ensure file with destName doesn’t already exist
-    for (int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++) 
+    else
     {
-        if (destEntries[i].file_name[0] != '\0' && strcmp(destEntries[i].file_name, destName.c_str()) == 0) 
+        int32_t block = firstBlock;
+        while (block != FAT_EOF)
         {
-            return 8; // already exists
+            unsigned run = chainRun(block, UINT16_MAX);
+            extents.push_back(extent{(uint16_t)block, (uint16_t)run});
+            block = fat[block + run - 1];
         }
     }
+    bmap.insert(firstBlock, extents);
+    return 0;
+}
 
-    // Load FAT
-    if (disk.read(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat)) != 0)
+// The blocks holding the first bytes of the chain starting at firstBlock,
+// split into runs of at most MAX_IO_BLOCKS blocks, one disk request each
+int
+FS::ioRuns(uint16_t firstBlock, uint64_t bytes, std::vector<extent>& runs)
+{
+    runs.clear();
+    if (bytes == 0)
     {
-        return 9;
+        return 0;
     }
-        
-    // Copy file data into string
-    std::string fileData;
-    int16_t block = sourceFile->first_blk;
-    int bytesLeft = sourceFile->size;
-
-    while (block != FAT_EOF && bytesLeft > 0) 
+    std::vector<extent> extents;
+    if (chainExtents(firstBlock, extents) != 0)
+    {
+        return -1;
+    }
+    uint64_t blocksLeft = (bytes + blockSize - 1) / blockSize;
+    for (size_t i = 0; i < extents.size() && blocksLeft > 0; i++)
     {
-        uint8_t buf[BLOCK_SIZE];
-        if (disk.read(block, buf) != 0)
+        unsigned done = 0;
+        while (done < extents[i].count && blocksLeft > 0)
         {
-            return 10;
+            unsigned run = std::min((uint64_t)std::min(extents[i].count - done, (unsigned)MAX_IO_BLOCKS), blocksLeft);
+            runs.push_back(extent{(uint16_t)(extents[i].start + done), (uint16_t)run});
+            done += run;
+            blocksLeft -= run;
         }
-            
-        int bytesToRead = std::min(bytesLeft, BLOCK_SIZE);
-        fileData.append(reinterpret_cast<char*>(buf), bytesToRead);
-        bytesLeft -= bytesToRead;
-        block = fat[block];
     }
+    return 0;
+}
 
-    // Allocate new blocks for copy
-    std::vector<uint16_t> freeBlocks;
-    int bytesWritten = 0;
-    int bytesLeftToWrite = fileData.size();
-    while (bytesLeftToWrite > 0) 
+// Number of extents a FAT_LAYOUT block has room for
+unsigned
+FS::layoutCapacity()
+{
+    return (blockSize - sizeof(layout_header)) / sizeof(extent);
+}
+
+// Writes the extent list of a file to its FAT_LAYOUT block
+int
+FS::writeLayout(uint16_t layoutBlock, const std::vector<extent>& extents)
+{
+    std::vector<uint8_t> buf(blockSize);
+    layout_header* header = reinterpret_cast<layout_header*>(buf.data());
+    header->extents = extents.size();
+    memcpy(buf.data() + sizeof(layout_header), extents.data(), extents.size() * sizeof(extent));
+    return cache.write(layoutBlock, buf.data());
+}
+
+// Adds blocks to the end of the file starting at firstBlock, linking them
+// into its FAT chain or adding them to its extent list. An empty file
+// (0xFFFF) gets a new chain, an extent list if the disk is set up for
+// that. Returns 1 if there is no block for the list or the list is full
+// and -1 on a write error.
+int
+FS::extendFile(uint16_t& firstBlock, const std::vector<uint16_t>& blocks)
+{
+    if (blocks.empty())
+    {
+        return 0;
+    }
+    bool layout = (firstBlock == 0xFFFF) ? sb.layout == LAYOUT_EXTENTS : fat[firstBlock] == FAT_LAYOUT;
+    if (!layout)
     {
-        int freeBlock = -1;
-        for (int i = 0; i < disk.get_no_blocks(); i++) 
+        linkBlocks(blocks);
+        if (firstBlock == 0xFFFF)
         {
-            if (fat[i] == FAT_FREE) 
-            {
-                freeBlock = i;
-                break;
-            }
+            firstBlock = blocks[0];
         }
-
-        if (freeBlock == -1)
+        else
         {
-            return 11; // no free blocks
-        } 
-
-        freeBlocks.push_back(freeBlock);
-
-        uint8_t buf[BLOCK_SIZE]{};
-        int bytesToWrite = std::min(bytesLeftToWrite, BLOCK_SIZE);
-        memcpy(buf, fileData.data() + bytesWritten, bytesToWrite);
+            setFat(chainTail(firstBlock), blocks[0]);
+            bmap.extend(firstBlock, blocks);
+            markFatDirty();
+        }
+        chainTails[firstBlock] = blocks.back();
+        return 0;
+    }
 
-        if (disk.write(freeBlock, buf) != 0)
+    // The list goes in a block of its own, placed next to the data
+    std::vector<extent> extents;
+    uint16_t layoutBlock = firstBlock;
+    if (firstBlock == 0xFFFF)
+    {
+        int32_t block = allocator.allocate(blocks[0]);
+        if (block == -1)
         {
-            return 12;
+            return 1;
         }
-
-        bytesWritten += bytesToWrite;
-        bytesLeftToWrite -= bytesToWrite;
+        layoutBlock = block;
     }
-
-    // Link blocks in FAT
-    for (int i = 0; i < freeBlocks.size(); i++) 
+    else if (chainExtents(firstBlock, extents) != 0)
     {
-        fat[freeBlocks[i]] = (i + 1 < freeBlocks.size()) ? freeBlocks[i + 1] : FAT_EOF;
+        return -1;
     }
-
-    if (disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat)) != 0)
+    for (size_t i = 0; i < blocks.size(); i++)
     {
-        return 13;
-    }   
-
-    // Create new dir_entry in destination
-    dir_entry newFile{};
-    strncpy(newFile.file_name, destName.c_str(), sizeof(newFile.file_name) - 1);
-    newFile.file_name[sizeof(newFile.file_name) - 1] = '\0';
-    newFile.first_blk = freeBlocks.empty() ? 0xFFFF : freeBlocks[0];
-    newFile.size = fileData.size();
-    newFile.type = TYPE_FILE;
-    newFile.access_rights = sourceFile->access_rights;
+        extent_append(extents, blocks[i]);
+    }
 
-    bool inserted = false;
-    for (int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++) 
+    int retVal = 0;
+    if (extents.size() > layoutCapacity())
+    {
+        retVal = 1;
+    }
+    else if (writeLayout(layoutBlock, extents) != 0)
+    {
+        retVal = -1;
+    }
+    if (retVal != 0)
     {
-        if (destEntries[i].file_name[0] == '\0') 
+        if (firstBlock == 0xFFFF)
         {
-            destEntries[i] = newFile;
-            inserted = true;
-            break;
+            allocator.release(layoutBlock);
         }
+        return retVal;
     }
 
-    if (!inserted)
+    for (size_t i = 0; i < blocks.size(); i++)
     {
-        return 14; // no space in directory
-    } 
-
-    if (disk.write(destDirBlock, destDirBuf) != 0)
-    {
-        return 15;
+        setFat(blocks[i], FAT_EOF);
     }
-        
+    setFat(layoutBlock, FAT_LAYOUT);
+    markFatDirty();
+    firstBlock = layoutBlock;
+    bmap.insert(firstBlock, extents);
+    chainTails[firstBlock] = blocks.back();
     return 0;
 }
 
-// mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
-// or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
-int 
-FS::mv(std::string sourcepath, std::string destpath)
+// Cuts the file starting at firstBlock down to its first keep blocks and
+// frees the rest, dropping their cached copies. The file must not be
+// shared. Returns -1 on an I/O error.
+int
+FS::shrinkFile(uint16_t& firstBlock, size_t keep)
 {
-    if (sourcepath == destpath)
+    if (keep == 0)
     {
+        releaseChain(firstBlock);
+        firstBlock = 0xFFFF;
         return 0;
-    } 
-
-    // Split source path
-    std::string sourceParent, sourceName;
-    splitParentPath(sourcepath, sourceParent, sourceName);
-
-    uint16_t sourceDirBlock;
-    int retVal = resolvePath(sourceParent, true, sourceDirBlock);
-    if (retVal != 0)
-    {
-        return retVal; // invalid source parent
     }
 
-    // Load source dir
-    uint8_t sourceBuf[BLOCK_SIZE];
-    if (disk.read(sourceDirBlock, sourceBuf) != 0)
+    std::vector<extent> extents;
+    if (chainExtents(firstBlock, extents) != 0)
     {
-        return 1;
+        return -1;
     }
-        
-    dir_entry* sourceEntries = reinterpret_cast<dir_entry*>(sourceBuf);
-
-    // Find source entry
-    dir_entry* sourceFile = nullptr;
-    int numEntries = BLOCK_SIZE / sizeof(dir_entry);
-    for (int i = 0; i < numEntries; i++) 
+    std::vector<extent> kept;
+    size_t left = keep;
+    size_t e = 0;
+    while (left > 0 && e < extents.size())
     {
-        if (sourceEntries[i].file_name[0] != '\0' && strcmp(sourceEntries[i].file_name, sourceName.c_str()) == 0) 
+        unsigned n = std::min((size_t)extents[e].count, left);
+        kept.push_back(extent{extents[e].start, (uint16_t)n});
+        left -= n;
+        if (n == extents[e].count)
         {
-            sourceFile = &sourceEntries[i];
-            break;
+            e++;
         }
-    }
-
-    if (!sourceFile) 
-    {
-        return 2; // not found
-    }
-
-     // Check WRITE on source parent
-    if (sourceDirBlock != ROOT_BLOCK) 
-    {
-        if (!(sourceEntries[0].access_rights & WRITE)) 
+        else
         {
-            std::cout << "No WRITE rights on source parent directory\n";
-            return 3;
+            extents[e].start += n;
+            extents[e].count -= n;
         }
     }
+    uint16_t tail = kept.back().start + kept.back().count - 1;
 
-    // Split dest path
-    std::string destParent, destName;
-    splitParentPath(destpath, destParent, destName);
-
-    uint16_t destDirBlock;
-    retVal = resolvePath(destParent, true, destDirBlock);
-    if (retVal != 0)
-    {
-        return retVal; // invalid dest parent
-    }
-
-    // Load dest dir
-    uint8_t destBuf[BLOCK_SIZE];
-    if (disk.read(destDirBlock, destBuf) != 0)
-    {
-        return 4;
-    }
-        
-    dir_entry* destEntries = reinterpret_cast<dir_entry*>(destBuf);
-
-    // Check write on destination parent
-    if (destDirBlock != ROOT_BLOCK) 
+    if (fat[firstBlock] == FAT_LAYOUT)
     {
-        if (!(destEntries[0].access_rights & WRITE)) 
+        if (writeLayout(firstBlock, kept) != 0)
         {
-            std::cout << "No WRITE rights on destination parent directory\n";
-            return 5;
+            return -1;
         }
-    }
-
-    // If dest is an existing directory, move into it
-    if (!destName.empty()) 
-    {
-        for (int i = 0; i < numEntries; i++) 
+        for (; e < extents.size(); e++)
         {
-            if (destEntries[i].file_name[0] != '\0' && strcmp(destEntries[i].file_name, destName.c_str()) == 0 && destEntries[i].type == TYPE_DIR) 
+            for (unsigned b = extents[e].start; b < (unsigned)extents[e].start + extents[e].count; b++)
             {
-                // move into that directory, keep name
-                destDirBlock = destEntries[i].first_blk;   // direct jump
-                destName = sourceName;
-
-                if (disk.read(destDirBlock, destBuf) != 0)
-                {
-                    return 6;
-                }
-                    
-                destEntries = reinterpret_cast<dir_entry*>(destBuf);
-                break;
+                freeBlock(b);
             }
+            cache.drop_blocks(extents[e].start, extents[e].count);
         }
-    } 
-    else 
-    {
-        // path ended with '/', so use same name
-        destName = sourceName;
     }
-
-    // Prevent overwrite
-    for (int i = 0; i < numEntries; i++) 
+    else
     {
-        if (destEntries[i].file_name[0] != '\0' && strcmp(destEntries[i].file_name, destName.c_str()) == 0) 
+        int32_t rest = fat[tail];
+        setFat(tail, FAT_EOF);
+        if (rest != FAT_EOF)
         {
-            return 7; // already exists
+            releaseChain(rest);
         }
     }
+    markFatDirty();
+    bmap.insert(firstBlock, kept);
+    chainTails[firstBlock] = tail;
+    return 0;
+}
+
+// True if size bytes of data fit after a name of nameLength characters in
+// a directory entry and the disk stores small files that way
+bool
+FS::fitsInline(size_t nameLength, uint64_t size)
+{
+    return sb.inline_data != 0 && size > 0 && size < sizeof(dir_entry::file_name) - nameLength;
+}
 
-    // Insert entry into dest dir
-    bool inserted = false;
-    for (int i = 0; i < numEntries; i++) 
+// The data of a file stored in its entry
+std::string
+FS::inlineData(const dir_entry& entry)
+{
+    size_t nameLength = strnlen(entry.file_name, sizeof(entry.file_name));
+    return std::string(entry.file_name + nameLength + 1, entry.size);
+}
+
+// Gives entry, which has no blocks yet, data as its content: after its
+// name if allowInline and it fits, in new blocks near goal otherwise.
+// Returns 6 if the disk is full and 7 on a write error.
+int
+FS::storeData(dir_entry& entry, const std::string& data, unsigned goal, bool allowInline)
+{
+    size_t nameLength = strnlen(entry.file_name, sizeof(entry.file_name));
+    entry.size = data.size();
+    if (allowInline && fitsInline(nameLength, data.size()))
     {
-        if (destEntries[i].file_name[0] == '\0') 
-        {
-            dir_entry moved = *sourceFile;
-            strncpy(moved.file_name, destName.c_str(), sizeof(moved.file_name) - 1);
-            moved.file_name[sizeof(moved.file_name) - 1] = '\0';
-            destEntries[i] = moved;
-            inserted = true;
-            break;
-        }
+        memcpy(entry.file_name + nameLength + 1, data.data(), data.size());
+        entry.access_rights |= INLINE_DATA;
+        return 0;
     }
-    if (!inserted) 
+    if (data.empty())
     {
-        return 8; // destination directory full
+        return 0;
     }
 
-    if (disk.write(destDirBlock, destBuf) != 0)
+    std::vector<uint16_t> blocks;
+    int retVal = writeNewBlocks(reinterpret_cast<const uint8_t*>(data.data()), data.size(), goal, blocks);
+    if (retVal != 0)
     {
-        return 9;
+        return retVal;
     }
-        
-    // Clear source entry
-    memset(sourceFile, 0, sizeof(dir_entry));
-    if (disk.write(sourceDirBlock, sourceBuf) != 0)
+    uint16_t firstBlock = 0xFFFF;
+    retVal = extendFile(firstBlock, blocks);
+    if (retVal != 0)
     {
-        return 10;
+        releaseBlocks(blocks);
+        return (retVal > 0) ? 6 : 7;
     }
-        
+    entry.first_blk = firstBlock;
     return 0;
 }
 
-// rm <filepath> removes / deletes the file <filepath>
-int 
-FS::rm(std::string filepath)
+// Moves the data of a file stored in its entry out to a block near goal,
+// so it can be changed like any other file. Returns 6 if the disk is full
+// and 7 on a write error.
+int
+FS::uninline(dir_entry& entry, unsigned goal)
 {
-    // Split into parent + filename
-    std::string parentPath, name;
-    splitParentPath(filepath, parentPath, name);
-
-    // Resolve parent directory
-    uint16_t parentBlock;
-    int retVal = resolvePath(parentPath, true, parentBlock);
-    if (retVal != 0)
+    if (!(entry.access_rights & INLINE_DATA))
     {
-        return retVal; // invalid parent path
+        return 0;
     }
-        
-    // Read parent directory
-    uint8_t dirBuffer[BLOCK_SIZE];
-    if (disk.read(parentBlock, dirBuffer) != 0)
+    std::string data = inlineData(entry);
+    dir_entry plain = entry;
+    size_t nameLength = strnlen(plain.file_name, sizeof(plain.file_name));
+    memset(plain.file_name + nameLength, 0, sizeof(plain.file_name) - nameLength);
+    plain.access_rights &= ~INLINE_DATA;
+    int retVal = storeData(plain, data, goal, false);
+    if (retVal != 0)
     {
-        return 1;
+        return retVal;
     }
-        
-    dir_entry* dir_entries = reinterpret_cast<dir_entry*>(dirBuffer);
-    int number_of_entries = BLOCK_SIZE / sizeof(dir_entry);
+    entry = plain;
+    return 0;
+}
 
-    // Check write permission on parent directory
-    if (parentBlock != ROOT_BLOCK) // root always allowed
-    {  
-        if (!(dir_entries[0].access_rights & WRITE)) 
-        {
-            std::cout << "No write rights on parent directory" << std::endl;
-            return 2;
-        }
+// Reads size bytes of the file whose FAT chain starts at block into data,
+// with one disk request per contiguous run of blocks
+int
+FS::readChain(int32_t block, uint32_t size, std::string& data)
+{
+    std::vector<extent> runs;
+    if (ioRuns(block, size, runs) != 0)
+    {
+        return -1;
     }
-
-    // Find entry to remove
-    dir_entry* entryToRemove = nullptr;
-    for (int i = 0; i < number_of_entries; i++) 
+    std::vector<uint8_t> buf(MAX_IO_BLOCKS * blockSize);
+    uint32_t bytesLeft = size;
+    for (size_t i = 0; i < runs.size(); i++)
     {
-        if (dir_entries[i].file_name[0] != '\0' && strcmp(dir_entries[i].file_name, name.c_str()) == 0) 
+        if (cache.read_blocks(runs[i].start, runs[i].count, buf.data()) != 0)
         {
-            entryToRemove = &dir_entries[i];
-            break;
+            return -1;
         }
+
+        uint32_t bytes = std::min(bytesLeft, (uint32_t)(runs[i].count * blockSize));
+        data.append(reinterpret_cast<char*>(buf.data()), bytes);
+        bytesLeft -= bytes;
     }
-   
-    if (!entryToRemove)
-    {
-        return 3; // not found
-    } 
+    return 0;
+}
 
-    // Handle directory case
-    if (entryToRemove->type == TYPE_DIR) 
+// Writes size bytes from data to the given blocks, with one disk request
+// per run of consecutive blocks. The last block is padded with zeroes.
+int
+FS::writeBlocks(const std::vector<uint16_t>& blocks, const char* data, size_t size)
+{
+    size_t i = 0;
+    size_t offset = 0;
+    while (i < blocks.size() && offset < size)
     {
-        uint8_t subDirBuffer[BLOCK_SIZE];
-        if (disk.read(entryToRemove->first_blk, subDirBuffer) != 0)
+        unsigned run = 1;
+        while (i + run < blocks.size() && blocks[i + run] == blocks[i] + run)
         {
-            return 4;
+            run++;
         }
-            
-        dir_entry* subDir_entries = reinterpret_cast<dir_entry*>(subDirBuffer);
 
-        bool empty = true;
-        for (int i = 0; i < number_of_entries; i++) 
+        // Whole blocks go straight from data, a partial last block is padded
+        size_t runBytes = std::min(size - offset, (size_t)run * blockSize);
+        unsigned fullBlocks = runBytes / blockSize;
+        if (fullBlocks > 0)
         {
-            if (subDir_entries[i].file_name[0] != '\0' && strcmp(subDir_entries[i].file_name, "..") != 0) 
+            uint8_t* src = reinterpret_cast<uint8_t*>(const_cast<char*>(data + offset));
+            if (cache.write_blocks(blocks[i], fullBlocks, src) != 0)
             {
-                empty = false;
-                break;
+                return -1;
             }
         }
-
-        if (!empty) 
+        if (runBytes % blockSize != 0)
         {
-            std::cout << "ERROR: can't remove non-empty directory" << std::endl;
-            return 5;
+            std::vector<uint8_t> buf(blockSize);
+            memcpy(buf.data(), data + offset + (size_t)fullBlocks * blockSize, runBytes % blockSize);
+            if (cache.write_blocks(blocks[i] + fullBlocks, 1, buf.data()) != 0)
+            {
+                return -1;
+            }
         }
+
+        offset += runBytes;
+        i += run;
     }
+    return 0;
+}
 
-    // Free blocks in FAT
-    if (disk.read(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat)) != 0)
+// Copies the blocks of the chain starting at block to dstBlocks, one run
+// at a time. Runs are copied inside the disk file while the disk can do
+// that. The rest is read ahead and written from the readahead buffers, so
+// the next runs are read while one is written.
+// Returns 1 on a read error and 2 on a write error.
+int
+FS::copyChain(int32_t block, const std::vector<uint16_t>& dstBlocks)
+{
+    std::vector<extent> runs;
+    if (ioRuns(block, (uint64_t)dstBlocks.size() * blockSize, runs) != 0)
     {
-        return 6;
+        return 1;
     }
-        
-    int16_t currentBlock = static_cast<int16_t>(entryToRemove->first_blk);
-    if (currentBlock != 0xFFFF) // Guard against empty file
-    { 
-        while (currentBlock != FAT_EOF) 
+
+    // Split the runs where the destination isn't consecutive
+    std::vector<extent> src;
+    std::vector<uint16_t> dst;
+    size_t i = 0;
+    for (size_t r = 0; r < runs.size() && i < dstBlocks.size(); r++)
+    {
+        unsigned used = 0;
+        while (used < runs[r].count && i < dstBlocks.size())
         {
-            int16_t nextBlock = fat[currentBlock];
-            fat[currentBlock] = FAT_FREE;
-            currentBlock = nextBlock;
+            unsigned run = 1;
+            while (used + run < runs[r].count && dstBlocks[i + run] == dstBlocks[i] + run)
+            {
+                run++;
+            }
+            src.push_back(extent{(uint16_t)(runs[r].start + used), (uint16_t)run});
+            dst.push_back(dstBlocks[i]);
+            used += run;
+            i += run;
         }
     }
 
-    // Clear directory entry
-    memset(entryToRemove, 0, sizeof(dir_entry));
-
-    if (disk.write(parentBlock, dirBuffer) != 0)
+    // The disk file must hold the current source contents before the
+    // kernel copies it, and cached destination copies are stale after
+    size_t first = 0;
+    while (first < src.size())
     {
-        return 7;
+        if (cache.flush_blocks(src[first].start, src[first].count) != 0 ||
+            disk.copy_blocks(src[first].start, dst[first], src[first].count) != 0)
+        {
+            break;
+        }
+        cache.drop_blocks(dst[first], src[first].count);
+        first++;
     }
-        
-    if (disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat)) != 0)
+    if (first == src.size())
     {
-        return 8;
+        return 0;
     }
 
-    return 0;
+    // Readahead pieces never span two of the runs left
+    std::vector<extent> rest(src.begin() + first, src.end());
+    ReadAhead reader(disk, cache, rest, readaheadBlocks, MAX_IO_BLOCKS);
+    extent piece;
+    const uint8_t* data;
+    size_t k = 0;
+    int retVal;
+    while ((retVal = reader.next(piece, data)) == 0)
+    {
+        while (piece.start < rest[k].start || piece.start >= rest[k].start + rest[k].count)
+        {
+            k++;
+        }
+        uint16_t to = dst[first + k] + (piece.start - rest[k].start);
+        if (cache.write_blocks(to, piece.count, const_cast<uint8_t*>(data)) != 0)
+        {
+            return 2;
+        }
+    }
+    return (retVal < 0) ? 1 : 0;
 }
 
-// append <filepath1> <filepath2> appends the contents of file <filepath1> to
-// the end of file <filepath2>. The file <filepath1> is unchanged.
-int 
-FS::append(std::string filepath1, std::string filepath2)
+// Adds an owner to every block of the chain starting at block, chains are
+// only ever shared whole. Returns 1 if a count would overflow or the chain
+// can't be read, the chain must then be copied instead.
+int
+FS::shareChain(int32_t block)
 {
-    // Resolve and find source file
-    std::string sourceParent, sourceName;
-    splitParentPath(filepath1, sourceParent, sourceName);
-
-    uint16_t sourceDirBlock;
-    int retVal = resolvePath(sourceParent, true, sourceDirBlock);
-    if (retVal != 0)
+    std::vector<extent> extents;
+    if (chainExtents(block, extents) != 0)
     {
-        return retVal;
+        return 1;
     }
-        
-    uint8_t sourceBuf[BLOCK_SIZE];
-    if (disk.read(sourceDirBlock, sourceBuf) != 0)
+    if (fat[block] == FAT_LAYOUT)
     {
-        return 1;
+        extents.push_back(extent{(uint16_t)block, 1});
     }
-
-    dir_entry* sourceEntries = reinterpret_cast<dir_entry*>(sourceBuf);
-    dir_entry* sourceFile = nullptr;
-    for (int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++) 
+    for (const extent& e : extents)
     {
-        if (strcmp(sourceEntries[i].file_name, sourceName.c_str()) == 0) 
+        for (unsigned b = e.start; b < (unsigned)e.start + e.count; b++)
         {
-            sourceFile = &sourceEntries[i];
-            break;
+            if (refs[b] == MAX_BLOCK_REFS)
+            {
+                return 1;
+            }
+        }
+    }
+    for (const extent& e : extents)
+    {
+        for (unsigned b = e.start; b < (unsigned)e.start + e.count; b++)
+        {
+            setRef(b, refs[b] + 1);
         }
     }
+    markFatDirty();
+    return 0;
+}
 
-    if (!sourceFile || sourceFile->type != TYPE_FILE)
+// Last block of the chain starting at firstBlock, remembered per chain so
+// the FAT is walked at most once. FAT_EOF if the chain can't be read.
+int32_t
+FS::chainTail(uint16_t firstBlock)
+{
+    auto it = chainTails.find(firstBlock);
+    if (it != chainTails.end())
     {
-        return 2;
+        return it->second;
     }
-    if (!(sourceFile->access_rights & READ)) 
+    std::vector<extent> extents;
+    if (chainExtents(firstBlock, extents) != 0 || extents.empty())
     {
-        std::cout << "No READ rights on source file" << std::endl;
-        return 3;
+        return FAT_EOF;
     }
+    int32_t block = extents.back().start + extents.back().count - 1;
+    chainTails[firstBlock] = block;
+    return block;
+}
 
-    // Resolve and find destination file
-    std::string destParent, destName;
-    splitParentPath(filepath2, destParent, destName);
-
-    uint16_t destDirBlock;
-    retVal = resolvePath(destParent, true, destDirBlock); 
-    if (retVal != 0)
+// Drops one owner of every block of the chain starting at block, blocks
+// without any owner left are freed. The extent list of a file stored as
+// extents goes the same way as its data. Cached copies of freed blocks are
+// dropped, so a journal commit doesn't log a block nothing uses.
+void
+FS::releaseChain(int32_t block)
+{
+    std::vector<extent> extents;
+    if (chainExtents(block, extents) != 0)
     {
-        return retVal;
+        return;
     }
-        
-    uint8_t destBuf[BLOCK_SIZE];
-    if (disk.read(destDirBlock, destBuf) != 0)
+    if (fat[block] == FAT_LAYOUT)
     {
-        return 4;
+        extents.push_back(extent{(uint16_t)block, 1});
     }
-        
-    dir_entry* destEntries = reinterpret_cast<dir_entry*>(destBuf);
-    dir_entry* destFile = nullptr;
-
-    for (int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++) 
+    if (refs[block] == 0)
     {
-        if (strcmp(destEntries[i].file_name, destName.c_str()) == 0) 
+        chainTails.erase(block);
+        bmap.invalidate(block);
+    }
+    for (const extent& e : extents)
+    {
+        for (unsigned b = e.start; b < (unsigned)e.start + e.count; b++)
         {
-            destFile = &destEntries[i];
-            break;
+            if (refs[b] > 0)
+            {
+                setRef(b, refs[b] - 1);
+            }
+            else
+            {
+                freeBlock(b);
+                cache.drop_blocks(b, 1);
+            }
         }
     }
+    markFatDirty();
+}
 
-    if (!destFile || destFile->type != TYPE_FILE)
+// Gives file a private copy of its chain if the chain is shared with other
+// files, so it can be written. Returns 1 if there is no room for the copy
+// and 2 on an I/O error.
+int
+FS::unshareChain(dir_entry& file, unsigned goal)
+{
+    if (file.first_blk == 0xFFFF || refs[file.first_blk] == 0)
     {
-        return 5;
+        return 0;
     }
-    if (!(destFile->access_rights & WRITE))
-    {
-        std::cout << "No write access on destination file" << std::endl;
-        return 6;
-    }    
 
-    // Load FAT
-    if (disk.read(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat)) != 0)
+    std::vector<uint16_t> newBlocks;
+    unsigned blocks = (file.size + blockSize - 1) / blockSize;
+    if (allocator.allocate_blocks(blocks, newBlocks, goal) != 0)
     {
-        return 7;
+        return 1;
     }
-        
-    // Read entire source file into memory
-    std::string sourceFileData;
-    int16_t currentBlock = sourceFile->first_blk;
-    int bytesLeft = sourceFile->size;
-
-    while (currentBlock != FAT_EOF && bytesLeft > 0) 
+    if (copyChain(file.first_blk, newBlocks) != 0)
     {
-        uint8_t buf[BLOCK_SIZE]{};
-        if (disk.read(currentBlock, buf) != 0)
-        {
-            return 8;
-        }
-            
-        int bytesToRead = std::min(bytesLeft, BLOCK_SIZE);
-        sourceFileData.append(reinterpret_cast<char*>(buf), bytesToRead);
-
-        bytesLeft -= bytesToRead;
-        currentBlock = fat[currentBlock];
+        releaseBlocks(newBlocks);
+        return 2;
     }
-
-    if (sourceFileData.empty())
+    uint16_t newFirst = 0xFFFF;
+    int retVal = extendFile(newFirst, newBlocks);
+    if (retVal != 0)
     {
-        return 0; // nothing to append, no error, just return safely
+        releaseBlocks(newBlocks);
+        return (retVal > 0) ? 1 : 2;
     }
+    releaseChain(file.first_blk);
+    file.first_blk = newFirst;
+    return 0;
+}
 
-    // Append to dest
-    int sourceFileBytesLeft = sourceFileData.size();
-    int bytesWritten = 0;
-    std::vector<int16_t> destNewBlocks;
-
-    if (destFile->first_blk != 0xFFFF) 
+// Reads every slot of the directory starting at dirBlock, one disk request
+// per contiguous run of its blocks. The blocks of the chain are returned
+// in blocks if given.
+int
+FS::readDir(uint16_t dirBlock, std::vector<dir_entry>& entries, std::vector<uint16_t>* blocks)
+{
+    entries.clear();
+    int32_t block = dirBlock;
+    while (block != FAT_EOF)
     {
-        // Find last block
-        int16_t lastBlock = destFile->first_blk;
-        while (fat[lastBlock] != FAT_EOF)
+        unsigned run = chainRun(block, MAX_IO_BLOCKS);
+        size_t first = entries.size();
+        entries.resize(first + (size_t)run * entriesPerBlock);
+        if (cache.read_blocks(block, run, reinterpret_cast<uint8_t*>(&entries[first])) != 0)
         {
-            lastBlock = fat[lastBlock];
+            return -1;
         }
-            
-        // See if last block has free space
-        int usedBytes = destFile->size % BLOCK_SIZE;
-        if (usedBytes != 0 && sourceFileBytesLeft > 0) 
+        if (blocks != nullptr)
         {
-            uint8_t blockBuf[BLOCK_SIZE];
-            if (disk.read(lastBlock, blockBuf) != 0)
-            {
-                return 9;
-            }
-                
-            int freeSpace = BLOCK_SIZE - usedBytes;
-            int bytesToCopy = std::min(sourceFileBytesLeft, freeSpace);
-
-            memcpy(blockBuf + usedBytes, sourceFileData.data() + bytesWritten, bytesToCopy);
-
-            if (disk.write(lastBlock, blockBuf) != 0)
+            for (unsigned i = 0; i < run; i++)
             {
-                return 10;
+                blocks->push_back(block + i);
             }
-
-            bytesWritten += bytesToCopy;
-            sourceFileBytesLeft -= bytesToCopy;
         }
+        block = fat[block + run - 1];
     }
+    return 0;
+}
 
-    // Allocate new blocks if needed
-    while (sourceFileBytesLeft > 0) 
+// Returns the name index of the directory starting at dirBlock if it has
+// been built, nullptr otherwise
+FS::dir_index*
+FS::findDirIndex(uint16_t dirBlock)
+{
+    std::lock_guard<std::mutex> guard(indexLock);
+    auto it = dirIndexes.find(dirBlock);
+    if (it != dirIndexes.end())
     {
-        int freeBlock = -1;
-        for (int i = 0; i < disk.get_no_blocks(); i++) 
-        {
-            if (fat[i] == FAT_FREE) 
-            { 
-                freeBlock = i; 
-                break; 
-            }
-        }
-
-        // No free blocks in FAT
-        if (freeBlock == -1)
-        {
-            return 11; 
-        } 
-
-        destNewBlocks.push_back(freeBlock);
-
-        uint8_t buf[BLOCK_SIZE]{};
-        int bytesToWrite = std::min(sourceFileBytesLeft, BLOCK_SIZE);
-        memcpy(buf, sourceFileData.data() + bytesWritten, bytesToWrite);
+        return &it->second;
+    }
+    return nullptr;
+}
 
-        if (disk.write(freeBlock, buf) != 0)
-        {
-            return 12;
-        }
-            
-        bytesWritten += bytesToWrite;
-        sourceFileBytesLeft -= bytesToWrite;
+// Returns the name index of the directory starting at dirBlock, reading
+// the directory to build it if it has not been used since mount. Indexes
+// are only removed by commands holding metaLock exclusively, so the
+// pointer stays valid while the caller holds metaLock.
+FS::dir_index*
+FS::getDirIndex(uint16_t dirBlock)
+{
+    dir_index* found = findDirIndex(dirBlock);
+    if (found != nullptr)
+    {
+        return found;
     }
 
-    // Link new blocks
-    for (int i = 0; i < (int)destNewBlocks.size(); i++) 
+    // Another thread may be building the same index, it is built once
+    std::lock_guard<std::mutex> building(dirLocks[dirBlock % LOCK_STRIPES]);
+    found = findDirIndex(dirBlock);
+    if (found != nullptr)
     {
-        fat[destNewBlocks[i]] = (i + 1 < (int)destNewBlocks.size()) ? destNewBlocks[i + 1] : FAT_EOF;
+        return found;
     }
 
-    // Attach to destination file
-    if (destFile->first_blk == 0xFFFF) 
+    std::vector<dir_entry> entries;
+    std::vector<uint16_t> blocks;
+    if (readDir(dirBlock, entries, &blocks) != 0)
     {
-        destFile->first_blk = destNewBlocks[0];
-    } 
-    else if (!destNewBlocks.empty()) 
+        return nullptr;
+    }
+
+    dir_index index;
+    std::vector<std::pair<uint16_t, std::string>> subdirs;
+    index.blocks.swap(blocks);
+    for (uint32_t slot = 0; slot < entries.size(); slot++)
     {
-        int16_t lastBlock = destFile->first_blk;
-        while (fat[lastBlock] != FAT_EOF)
+        if (entries[slot].file_name[0] == '\0')
         {
-            lastBlock = fat[lastBlock];
+            index.freeSlots.insert(index.freeSlots.end(), slot);
         }
-        fat[lastBlock] = destNewBlocks[0];
-    }
-
-    // Update size
-    destFile->size += sourceFileData.size();
+        else
+        {
+            std::string name(entries[slot].file_name, strnlen(entries[slot].file_name, sizeof(entries[slot].file_name)));
+            index.names[name] = slot;
+            if (entries[slot].type == TYPE_DIR && name != "..")
+            {
+                subdirs.push_back(std::make_pair(entries[slot].first_blk, name));
+            }
+        }
+    }
 
-    // Save back
-    if (disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat)) != 0)
+    std::lock_guard<std::mutex> guard(indexLock);
+    dir_index& dir = dirIndexes[dirBlock];
+    dir = std::move(index);
+    for (size_t i = 0; i < subdirs.size(); i++)
     {
-        return 13;
+        parentNames[subdirs[i].first] = dir_parent{dirBlock, subdirs[i].second};
     }
-        
-    if (disk.write(destDirBlock, destBuf) != 0)
+    return &dir;
+}
+
+// Looks up name in the directory, returns 0 and the entry and its slot if
+// found, 1 if there is no such entry and -1 on a read error
+int
+FS::findEntry(dir_index& dir, const std::string& name, dir_entry& entry, uint32_t& slot)
+{
+    auto it = dir.names.find(name);
+    if (it == dir.names.end())
     {
-        return 14;
+        return 1;
     }
-        
-    return 0;
+    slot = it->second;
+    return readEntry(dir, slot, entry);
 }
 
-// mkdir <dirpath> creates a new sub-directory with the name <dirpath>
-// in the current directory
-int 
-FS::mkdir(std::string dirpath) 
+// Reads the entry in the given slot of the directory
+int
+FS::readEntry(dir_index& dir, uint32_t slot, dir_entry& entry)
 {
-    // Split path into parent + name
-    std::string parentPath, newName;
-    splitParentPath(dirpath, parentPath, newName);
-
-    // Resolve parent directory
-    uint16_t parentBlock;
-    int retVal = resolvePath(parentPath, true, parentBlock);
-    if (retVal != 0)
+    std::vector<uint8_t> buf(blockSize);
+    if (cache.read(dir.blocks[slot / entriesPerBlock], buf.data()) != 0)
     {
-        return retVal;
-    } 
-
-    // Read parent directory
-    uint8_t buf[BLOCK_SIZE];
-    if (disk.read(parentBlock, buf) != 0)
-    {   
-        return 1;
-    } 
+        return -1;
+    }
+    entry = reinterpret_cast<dir_entry*>(buf.data())[slot % entriesPerBlock];
+    return 0;
+}
 
-    dir_entry* entries = reinterpret_cast<dir_entry*>(buf);
+// Overwrites the entry in the given slot of the directory, the name index
+// is left as it is so the name must not change
+int
+FS::writeEntry(dir_index& dir, uint32_t slot, const dir_entry& entry)
+{
+    uint16_t block = dir.blocks[slot / entriesPerBlock];
+    std::vector<uint8_t> buf(blockSize);
+    if (cache.read(block, buf.data()) != 0)
+    {
+        return -1;
+    }
+    reinterpret_cast<dir_entry*>(buf.data())[slot % entriesPerBlock] = entry;
+    dcache.invalidate(dir.blocks[0], entry.file_name);
 
-    // Check write permission on parent directory
-    if (parentBlock != ROOT_BLOCK)   // root always allowed
+    // Open handles on the entry keep a copy of it, their block map is stale
+    // once the chain or the size changes
+    for (open_file& file : openFiles)
     {
-        if (!(entries[0].access_rights & WRITE)) 
+        if (file.used && file.dirBlock == dir.blocks[0] && file.slot == slot)
         {
-            std::cout << "No WRITE rights on parent directory" << std::endl;
-            return 2;
+            if (file.entry.first_blk != entry.first_blk || file.entry.size != entry.size)
+            {
+                file.mapped = false;
+            }
+            file.entry = entry;
         }
     }
+    return cache.write(block, buf.data());
+}
 
-    // Check if name already exists in parent
-    for (int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++) 
+// Puts entry in the lowest free slot of the directory, growing it by one
+// block at the end of its chain when all slots are used. Returns 1 if
+// there is no free block left to grow into and -1 on an I/O error.
+int
+FS::addEntry(dir_index& dir, const dir_entry& entry)
+{
+    if (dir.freeSlots.empty())
     {
-        if (entries[i].file_name[0] != '\0' && strcmp(entries[i].file_name, newName.c_str()) == 0) 
+        uint16_t lastBlock = dir.blocks.back();
+        int32_t newBlock = allocator.allocate(lastBlock + 1);
+        if (newBlock == -1)
+        {
+            return 1;
+        }
+        std::vector<uint8_t> emptyBuf(blockSize);
+        if (cache.write(newBlock, emptyBuf.data()) != 0)
+        {
+            allocator.release(newBlock);
+            return -1;
+        }
+        setFat(newBlock, FAT_EOF);
+        setFat(lastBlock, newBlock);
+        markFatDirty();
+        bmap.extend(dir.blocks[0], std::vector<uint16_t>(1, newBlock));
+
+        uint32_t firstSlot = dir.blocks.size() * entriesPerBlock;
+        dir.blocks.push_back(newBlock);
+        for (unsigned i = 0; i < entriesPerBlock; i++)
         {
-            return 3; // already exists
+            dir.freeSlots.insert(dir.freeSlots.end(), firstSlot + i);
         }
     }
 
-    // Allocate a free block for the new directory
-    if (disk.read(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat)) != 0)
+    uint32_t slot = *dir.freeSlots.begin();
+    if (writeEntry(dir, slot, entry) != 0)
     {
-        return 4;
-    } 
-    
-    int16_t newBlock = -1;
-    for (int i = 0; i < disk.get_no_blocks(); i++) 
+        return -1;
+    }
+    dir.freeSlots.erase(dir.freeSlots.begin());
+    dir.names[entry.file_name] = slot;
+    dcache.invalidate(dir.blocks[0], entry.file_name);
+    if (entry.type == TYPE_DIR)
     {
-        if (fat[i] == FAT_FREE) 
-        {
-            newBlock = i;
-            break;
-        }
+        parentNames[entry.first_blk] = dir_parent{dir.blocks[0], entry.file_name};
     }
+    return 0;
+}
 
-    // No free slots in FAT
-    if (newBlock == -1)
+// Clears the entry in the given slot of the directory. Blocks the
+// directory has grown into stay part of it.
+int
+FS::removeEntry(dir_index& dir, uint32_t slot)
+{
+    dir_entry entry;
+    if (readEntry(dir, slot, entry) != 0)
     {
-        return 5;
-    } 
-    fat[newBlock] = FAT_EOF;
-
-    // Initialize new directory block
-    uint8_t newBuf[BLOCK_SIZE];
-    memset(newBuf, 0, BLOCK_SIZE);
-    dir_entry* newEntries = reinterpret_cast<dir_entry*>(newBuf);
-
-    // Parent '..' entry
-    strcpy(newEntries[0].file_name, "..");
-    newEntries[0].first_blk = parentBlock;
-    newEntries[0].type = TYPE_DIR;
-    newEntries[0].size = 0;
-    newEntries[0].access_rights = READ | WRITE | EXECUTE;
+        return -1;
+    }
+    dir_entry empty{};
+    if (writeEntry(dir, slot, empty) != 0)
+    {
+        return -1;
+    }
+    dir.names.erase(entry.file_name);
+    dir.freeSlots.insert(slot);
+    dcache.invalidate(dir.blocks[0], entry.file_name);
+
+    // A directory moved elsewhere is already linked from its new parent
+    auto it = parentNames.find(entry.first_blk);
+    if (entry.type == TYPE_DIR && it != parentNames.end() &&
+        it->second.parent == dir.blocks[0] && it->second.name == entry.file_name)
+    {
+        parentNames.erase(it);
+    }
+    return 0;
+}
 
-    disk.write(newBlock, newBuf);
+// Copies the parent and name of the directory starting at dirBlock,
+// false if its parent has not been indexed since mount
+bool
+FS::findParent(uint16_t dirBlock, dir_parent& parent)
+{
+    std::lock_guard<std::mutex> guard(indexLock);
+    auto it = parentNames.find(dirBlock);
+    if (it == parentNames.end())
+    {
+        return false;
+    }
+    parent = it->second;
+    return true;
+}
 
-    // Add new entry in parent directory
-    for (int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++) 
+// True if ancestor is dirBlock or one of the directories above it
+bool
+FS::isAncestor(uint16_t dirBlock, uint16_t ancestor)
+{
+    while (dirBlock != ancestor && dirBlock != ROOT_BLOCK)
     {
-        if (entries[i].file_name[0] == '\0') 
+        dir_parent parent;
+        if (!findParent(dirBlock, parent))
         {
-            strcpy(entries[i].file_name, newName.c_str());
-            entries[i].first_blk = newBlock;
-            entries[i].type = TYPE_DIR;
-            entries[i].size = 0;
-            entries[i].access_rights = READ | WRITE | EXECUTE;
-            break;
+            return false;
         }
+        dirBlock = parent.parent;
     }
-    
-    // Update parent directory
-    if (disk.write(parentBlock, buf) != 0)
+    return dirBlock == ancestor;
+}
+
+// Resolves name in the directory starting at dirBlock, through the dentry
+// cache. Returns 0 if found, 1 if there is no such name and -1 on a read
+// error.
+int
+FS::lookupName(uint16_t dirBlock, const std::string& name, dentry& entry)
+{
+    if (dcache.lookup(dirBlock, name, entry))
     {
-        return 6;
+        return entry.negative ? 1 : 0;
     }
 
-    // Update FAT
-    if (disk.write(FAT_BLOCK, reinterpret_cast<uint8_t*>(fat)) != 0)
+    dir_index* dir = getDirIndex(dirBlock);
+    if (dir == nullptr)
     {
-        return 7;
+        return -1;
     }
-
-    return 0;
+    dir_entry found{};
+    uint32_t slot;
+    int retVal = findEntry(*dir, name, found, slot);
+    if (retVal < 0)
+    {
+        return -1;
+    }
+    entry.negative = (retVal > 0);
+    entry.block = found.first_blk;
+    entry.type = found.type;
+    entry.access_rights = found.access_rights;
+    dcache.insert(dirBlock, name, entry);
+    return retVal;
 }
 
-// cd <dirpath> changes the current (working) directory to the directory named <dirpath>
-int
-FS::cd(std::string dirpath)
+// Splits a path into parent path + filename in the form of:
+// path = "/folder/file.txt" into parent = "/folder" + name = "file.txt"
+void
+FS::splitParentPath(const std::string& path, std::string& parent, std::string& name) 
 {
-    uint16_t targetBlock;
-    
-    // Update current directory using the output of targetBlock
-    int retVal = resolvePath(dirpath, true, targetBlock);
-    if (retVal != 0) 
+    // Find last '/' in the path
+    size_t pos = path.find_last_of('/');
+    if (pos == std::string::npos) 
     {
-        return retVal;
+        // No '/' means parent is current directory
+        parent = "";
+        name = path;
+    } 
+    else if (pos == 0) 
+    {
+        // Path like "/file" means parent is root
+        parent = "/";
+        name = path.substr(1);
+    } 
+    else
+    {
+        // Default case
+        parent = path.substr(0, pos);
+        name = path.substr(pos + 1);
     }
+}
 
-    currentDirectory = targetBlock;
-    return 0;
+// current directory of the calling thread
+uint16_t
+FS::currentDirectory()
+{
+    std::lock_guard<std::mutex> guard(sessionLock);
+    auto it = sessionDirs.find(std::this_thread::get_id());
+    return (it != sessionDirs.end()) ? it->second : ROOT_BLOCK;
 }
 
-// pwd prints the full path, i.e., from the root directory, to the current
-// directory, including the currect directory name
-int
-FS::pwd()
+// changes the current directory of the calling thread
+void
+FS::setCurrentDirectory(uint16_t dirBlock)
 {
-    // If already at root, print and return
-    if (currentDirectory == ROOT_BLOCK)
+    std::lock_guard<std::mutex> guard(sessionLock);
+    if (dirBlock == ROOT_BLOCK)
     {
-        std::cout << "/" << std::endl;
-        return 0;
+        sessionDirs.erase(std::this_thread::get_id());
     }
+    else
+    {
+        sessionDirs[std::this_thread::get_id()] = dirBlock;
+    }
+}
 
-    std::vector<std::string> filePath;
-    uint16_t currentBlock = currentDirectory;
+// True if dirBlock is the current directory of any thread
+bool
+FS::isCurrentDirectory(uint16_t dirBlock)
+{
+    std::lock_guard<std::mutex> guard(sessionLock);
+    for (const auto& session : sessionDirs)
+    {
+        if (session.second == dirBlock)
+        {
+            return true;
+        }
+    }
+    return false;
+}
 
-    // Traverse up the file hierarchy to find root and save the path taken
-    while (currentBlock != ROOT_BLOCK)
+//                  Path to resolve | Directory Flag | Disk block requested
+int              
+FS::resolvePath(const std::string& path, bool mustBeDir, uint16_t& outBlock) 
+{
+    // Determine absolute or relative path
+    uint16_t current = (path.size() > 0 && path[0] == '/') ? ROOT_BLOCK : currentDirectory();
+
+    // Walk the components separated by '/', an empty path just means the
+    // current directory
+    size_t pos = 0;
+    while (pos < path.size()) 
     {
-        uint8_t currentBuffer[BLOCK_SIZE];
-        if (disk.read(currentBlock, currentBuffer) != 0)
+        size_t end = path.find('/', pos);
+        if (end == std::string::npos)
         {
-            return 1;
+            end = path.size();
         }
-        dir_entry* current_entries = reinterpret_cast<dir_entry*>(currentBuffer);
+        if (end == pos)
+        {
+            pos++;
+            continue;
+        }
+        std::string part = path.substr(pos, end - pos);
+        bool last = path.find_first_not_of('/', end) == std::string::npos;
+        pos = end + 1;
 
-        uint16_t parentBlock = current_entries[0].first_blk;
-        uint8_t parentBuffer[BLOCK_SIZE];
-        if (disk.read(parentBlock, parentBuffer) != 0)
+        if (part == "..") 
         {
-            return 2;
+            if (current == ROOT_BLOCK) 
+            {
+                continue; // stay at root
+            }
+
+            dentry parent;
+            if (lookupName(current, part, parent) != 0)
+            {
+                return -1;
+            }
+            current = parent.block; // parent pointer
+            continue;
         }
 
-        dir_entry* parent_entries = reinterpret_cast<dir_entry*>(parentBuffer);
-        std::string currentPath = "";
+        // Must search current directory for part
+        dentry entry;
+        int found = lookupName(current, part, entry);
+        if (found < 0)
+        {
+            return -2;
+        }
+        if (found > 0) 
+        {
+            return -6; // not found
+        }
 
-        for (int i = 0; i < BLOCK_SIZE / sizeof(dir_entry); i++)
+        // check execute rights when stepping into a directory
+        if (entry.type == TYPE_DIR) 
         {
-            if (parent_entries[i].file_name[0] != '\0')
+            if (!(entry.access_rights & EXECUTE)) 
             {
-                if (parent_entries[i].first_blk == currentBlock)
-                {
-                    if (parent_entries[i].type == TYPE_DIR)
-                    {
-                        currentPath = parent_entries[i].file_name;
-                        break;
-                    }
-                }
+                std::cout << "ERROR: no execute rights on directory " << part << std::endl;
+                return -3;
             }
         }
 
-        // Add current the current path taken to the total path and move up to parent
-        filePath.push_back(currentPath);
-        currentBlock = parentBlock;
-    }
-
-    // Print working directory path
-    std::cout << "/";
-    for (int i = (int)filePath.size() - 1; i >= 0; i--)
-    {
-        std::cout << filePath[i];
-        if (i != 0)
+        // If it's the last token, check if it's a directory
+        if (last) 
+        {
+            if (mustBeDir && entry.type != TYPE_DIR)
+            {
+                return -4;
+            } 
+        } 
+        else 
         {
-            std::cout << "/";
+            // must be directory if not last
+            if (entry.type != TYPE_DIR)
+            {
+                return -5;
+            }             
         }
+        current = entry.block;
     }
-    std::cout << std::endl;
 
+    outBlock = current;
     return 0;
 }
 
-// chmod <accessrights> <filepath> changes the access rights for the
-// file <filepath> to <accessrights>.
+// formats the disk, i.e., creates an empty file system
 int 
-FS::chmod(std::string accessrights, std::string filepath)
+FS::format()
 {
-    // Parse access rights
-    int rights = std::stoi(accessrights);
-    if (rights < 0 || rights > 7) 
+    return format(format_options());
+}
+
+// formats the disk with the given options
+int
+FS::format(const format_options& options)
+{
+    command_scope scope(*this);
+    unsigned newBlockSize = options.block_size != 0 ? options.block_size : blockSize;
+    unsigned newNoBlocks = options.no_blocks != 0 ? options.no_blocks : disk.get_no_blocks();
+    if (options.block_size != 0 && options.no_blocks == 0)
     {
-        return 1;
+        // Keep the size of the disk when only the block size changes
+        newNoBlocks = disk.get_disk_size() / newBlockSize;
     }
 
-    // Split path into parent + name
-    std::string parentPath, name;
-    splitParentPath(filepath, parentPath, name);
-
-    // Resolve parent directory
-    uint16_t parentBlock;
-    int retVal = resolvePath(parentPath, true, parentBlock);
-    if (retVal != 0)
+    // Block size must be a power of two the directory entries fit in
+    if (newBlockSize < MIN_BLOCK_SIZE || newBlockSize > MAX_BLOCK_SIZE ||
+        (newBlockSize & (newBlockSize - 1)) != 0)
     {
-        return retVal;
+        return 4;
     }
-
-    // Load parent directory
-    uint8_t buf[BLOCK_SIZE];
-    if (disk.read(parentBlock, buf) != 0)
+    if ((uint64_t)newBlockSize * newNoBlocks < MIN_DISK_SIZE || newNoBlocks > MAX_NO_BLOCKS)
     {
-        return 2;
-    } 
-    dir_entry* entries = reinterpret_cast<dir_entry*>(buf);
+        return 4;
+    }
+    unsigned journalBlocks = std::min(options.journal_blocks, newNoBlocks / 8);
+    if (options.journal_blocks != 0 && journalBlocks < JOURNAL_MIN_BLOCKS)
+    {
+        return 4;
+    }
 
-     // Check write rights on the parent directory
-    if (parentBlock != ROOT_BLOCK) 
+    // Everything cached belongs to the old file system
+    cache.invalidate();
+    dirIndexes.clear();
+    parentNames.clear();
+    chainTails.clear();
+    dcache.clear();
+    bmap.clear();
     {
-        if (!(entries[0].access_rights & WRITE)) 
-        {
-            std::cout << "ERROR: no write rights on parent directory\n";
-            return 3;
-        }
+        std::lock_guard<std::mutex> guard(fileTableLock);
+        openFiles.clear();
+    }
+    formatCount++;
+    formatted = false;
+    {
+        // Every thread starts over in the new root directory
+        std::lock_guard<std::mutex> guard(sessionLock);
+        sessionDirs.clear();
     }
 
-    // Find target entry
-    dir_entry* target = nullptr;
-    int numEntries = BLOCK_SIZE / sizeof(dir_entry);
-    for (int i = 0; i < numEntries; i++) 
+    if (newBlockSize != blockSize || newNoBlocks != disk.get_no_blocks())
     {
-        if (strcmp(entries[i].file_name, name.c_str()) == 0) 
+        if (disk.set_geometry(newBlockSize, newNoBlocks) != 0)
         {
-            target = &entries[i];
-            break;
+            return 5;
         }
     }
-    if (!target)
-    {
-        return 4; // not found
-    } 
 
-    // Update rights
-    target->access_rights = rights;
+    // Superblock, root, FAT and journal blocks are used, all other blocks
+    // are free
+    setGeometry(newBlockSize, newNoBlocks, journalBlocks);
+    sb.alloc_policy = options.policy;
+    sb.layout = options.extents ? LAYOUT_EXTENTS : LAYOUT_FAT;
+    sb.inline_data = options.inline_data ? 1 : 0;
+    const unsigned number_of_blocks = newNoBlocks;
+    const unsigned firstDataBlock = sb.journal_start + sb.journal_blocks;
 
-    // Save back
-    if (disk.write(parentBlock, buf) != 0)
+    allocator.build(fat.data(), number_of_blocks);
+    allocator.set_policy(options.policy);
+
+    // Write the superblock
+    if (writeSuperblock() != 0)
     {
-        return 5;
+        return 1;
+    }
+
+    // Initialize root directory block
+    std::vector<uint8_t> rootBuf(blockSize);
+    dir_entry* rootEntries = reinterpret_cast<dir_entry*>(rootBuf.data());
+
+    // root's ".." points to itself for consistency with helper functions
+    strcpy(rootEntries[0].file_name, "..");
+    rootEntries[0].first_blk = ROOT_BLOCK;  
+    rootEntries[0].type = TYPE_DIR;
+    rootEntries[0].size = 0;
+    rootEntries[0].access_rights = READ | WRITE | EXECUTE;  // Default for root: RWX
+
+    // Write root block
+    if (cache.write(ROOT_BLOCK, rootBuf.data()) != 0)
+    {
+        return 1;
+    }           
+    // Write formatted FAT to disk
+    fatBlockDirty.assign(sb.fat_blocks, true);
+    refBlockDirty.assign(sb.ref_blocks, true);
+    fatDirty = true;
+    if (syncFat() != 0)
+    {
+        return 2;
+    }
+
+    // An empty log: stale transactions of an earlier journal in the same
+    // place are cleared, the root is written in place
+    cache.set_hold_dirty(journalBlocks != 0);
+    if (journalBlocks != 0)
+    {
+        std::vector<uint8_t> emptyLog((size_t)journalBlocks * blockSize, 0);
+        if (disk.write_blocks(sb.journal_start, journalBlocks, emptyLog.data()) != 0 ||
+            writeJournalHeader() != 0 || cache.sync() != 0)
+        {
+            return 2;
+        }
+    }
+
+    // The FAT says every data block is free, so their old contents can never
+    // be reached and are only cleared for a secure format. A fast format
+    // just releases them from the disk file where the file system allows it.
+    if (!options.secure)
+    {
+        if (disk.discard(firstDataBlock, number_of_blocks - firstDataBlock) != 0)
+        {
+            std::cerr << "WARNING: Can't release the data blocks from the disk file, "
+                      << "their old contents stay in the image until overwritten "
+                      << "(format secure clears them)" << std::endl;
+        }
+        formatted = true;
+        return 0;
+    }
+
+    // Clear all other blocks, straight to disk since none of them are cached
+    std::vector<uint8_t> emptyBuf(MAX_IO_BLOCKS * blockSize, 0);
+    for (unsigned i = firstDataBlock; i < number_of_blocks; i += MAX_IO_BLOCKS) 
+    {
+        unsigned count = std::min(number_of_blocks - i, (unsigned)MAX_IO_BLOCKS);
+        if (disk.write_blocks(i, count, emptyBuf.data()) != 0)
+        {
+            return 3;
+        }
+    }
+
+    formatted = true;
+    return 0;
+}
+
+// create <filepath> creates a new file on the disk, the data content is
+// written on the following rows (ended with an empty row)
+int 
+FS::create(std::string filepath)
+{
+    return createFile(filepath, false, 0);
+}
+
+// create <filepath> <nbytes> creates a new file from exactly nbytes bytes
+// of stdin, taken as they are
+int
+FS::create(std::string filepath, uint64_t nbytes)
+{
+    return createFile(filepath, true, nbytes);
+}
+
+// Allocates blocks near goal for bytes of data and writes it to them,
+// adding the blocks to the end of blocks. Returns 6 if the disk is full
+// and 7 on a write error.
+int
+FS::writeNewBlocks(const uint8_t* data, size_t bytes, unsigned goal, std::vector<uint16_t>& blocks)
+{
+    std::vector<uint16_t> newBlocks;
+    if (allocator.allocate_blocks((bytes + blockSize - 1) / blockSize, newBlocks, goal) != 0)
+    {
+        return 6;
+    }
+    if (writeBlocks(newBlocks, reinterpret_cast<const char*>(data), bytes) != 0)
+    {
+        releaseBlocks(newBlocks);
+        return 7;
+    }
+    blocks.insert(blocks.end(), newBlocks.begin(), newBlocks.end());
+    return 0;
+}
+
+// Creates a file from stdin, either the lines up to an empty line or,
+// in raw mode, nbytes bytes. The data is written as it arrives through a
+// one block buffer, each block goes right after the previous one.
+int
+FS::createFile(const std::string& filepath, bool raw, uint64_t nbytes)
+{
+    command_scope scope(*this);
+    if (!formatted)
+    {
+        return FS_UNFORMATTED;
+    }
+    // Split into parent path + file name
+    std::string parentPath, name;
+    splitParentPath(filepath, parentPath, name);
+
+    // Filename length check
+    if (name.size() >= 56) 
+    {
+        return 1;
+    }
+
+    // Resolve parent directory
+    uint16_t parentBlock;
+    int retVal = resolvePath(parentPath, true, parentBlock);
+    if (retVal != 0) 
+    {
+        return retVal;
+    }
+    
+    // Read parent directory
+    dir_index* dir = getDirIndex(parentBlock);
+    dir_entry parentEntry;
+    if (dir == nullptr || readEntry(*dir, 0, parentEntry) != 0)
+    {
+        return 2;
+    }
+    
+    // Check write permission on parent directory
+    if (!(parentEntry.access_rights & WRITE)) 
+    {
+        std::cout << "No write rights on parent directory" << std::endl;
+        return 3;
+    }
+
+    // Check for duplicate file
+    if (dir->names.count(name) != 0) 
+    {
+        return 4;
+    }
+
+    // Read file data from stdin, writing each block out as soon as it is
+    // full. On an error the rest of the input is still consumed so it isn't
+    // taken as shell commands.
+    std::vector<uint8_t> buf(blockSize);
+    size_t fill = 0;
+    uint64_t fileSize = 0;
+    std::vector<uint16_t> freeBlocks;
+    int error = 0;
+    std::string line;
+    bool done = false;
+    while (!done) 
+    {
+        if (raw)
+        {
+            size_t n = std::min((uint64_t)(buf.size() - fill), nbytes - fileSize);
+            std::cin.read(reinterpret_cast<char*>(buf.data()) + fill, n);
+            n = std::cin.gcount();
+            fill += n;
+            fileSize += n;
+            if (fileSize == nbytes || n == 0)
+            {
+                done = true;
+            }
+        }
+        else if (!std::getline(std::cin, line) || line.empty())
+        {
+            done = true;
+        } 
+        else
+        {
+            line.push_back('\n');
+            size_t taken = 0;
+            while (taken < line.size())
+            {
+                size_t n = std::min(line.size() - taken, buf.size() - fill);
+                memcpy(buf.data() + fill, line.data() + taken, n);
+                fill += n;
+                taken += n;
+                fileSize += n;
+                if (fill == buf.size())
+                {
+                    if (error == 0)
+                    {
+                        unsigned goal = freeBlocks.empty() ? parentBlock : freeBlocks.back() + 1;
+                        error = writeNewBlocks(buf.data(), fill, goal, freeBlocks);
+                    }
+                    fill = 0;
+                }
+            }
+            continue;
+        }
+
+        // A file small enough to go in its entry stays in the buffer
+        if (done && freeBlocks.empty() && fitsInline(name.size(), fileSize))
+        {
+            break;
+        }
+        if (fill == buf.size() || (done && fill > 0))
+        {
+            if (error == 0)
+            {
+                unsigned goal = freeBlocks.empty() ? parentBlock : freeBlocks.back() + 1;
+                error = writeNewBlocks(buf.data(), fill, goal, freeBlocks);
+            }
+            fill = 0;
+        }
+    }
+    if (error == 0 && raw && fileSize != nbytes)
+    {
+        error = 8; // input ended early
+    }
+    if (error != 0)
+    {
+        releaseBlocks(freeBlocks);
+        return error;
+    }
+        
+    // Update FAT
+    uint16_t firstBlock = 0xFFFF;
+    retVal = extendFile(firstBlock, freeBlocks);
+    if (retVal != 0)
+    {
+        releaseBlocks(freeBlocks);
+        return (retVal > 0) ? 6 : 7;
+    }
+
+    // Create dir_entry
+    dir_entry newFile{};
+    strncpy(newFile.file_name, name.c_str(), sizeof(newFile.file_name) - 1);
+    newFile.file_name[sizeof(newFile.file_name) - 1] = '\0';
+    newFile.size = fileSize;
+    newFile.first_blk = firstBlock;
+    newFile.type = TYPE_FILE;
+    newFile.access_rights = READ | WRITE;
+    if (freeBlocks.empty() && fill > 0)
+    {
+        // storeData releases what it allocated when it fails
+        retVal = storeData(newFile, std::string(reinterpret_cast<char*>(buf.data()), fill), parentBlock, true);
+        if (retVal != 0)
+        {
+            return retVal; // disk full / write error
+        }
+    }
+
+    // Insert into parent directory
+    retVal = addEntry(*dir, newFile);
+    if (retVal != 0) 
+    {
+        if (newFile.first_blk != 0xFFFF)
+        {
+            releaseChain(newFile.first_blk);
+        }
+        return (retVal > 0) ? 9 : 10; // directory can't grow / write error
+    }
+        
+    return 0;
+}
+
+// cat <filepath> reads the content of a file and prints it on the screen
+// in the format of "Folder/SubFolder/File" or "/Folder/SubFolder/file"
+int
+FS::cat(std::string filepath) 
+{
+    lock_scope scope(*this, false);
+    if (!formatted)
+    {
+        return FS_UNFORMATTED;
+    }
+    // Find the parent directory and entry
+    std::string parentPath, filename;
+    splitParentPath(filepath, parentPath, filename);
+
+    uint16_t parentBlock;
+    int retVal = resolvePath(parentPath, true, parentBlock);
+    if (retVal != 0) 
+    {
+        return retVal;
+    }
+
+    dir_index* dir = getDirIndex(parentBlock);
+    if (dir == nullptr)
+    {
+        return 1;
+    }
+
+    dir_entry targetFile;
+    uint32_t slot;
+    retVal = findEntry(*dir, filename, targetFile, slot);
+    if (retVal < 0)
+    {
+        return 1;
+    }
+    if (retVal > 0) 
+    {
+        return 2;
+    }
+    if (targetFile.type == TYPE_DIR)
+    {
+        return 3;
     } 
+    if (!(targetFile.access_rights & READ))
+    {
+        //std::cout << "ERROR: no read permission\n";
+        return 4;
+    }
+
+    if (targetFile.access_rights & INLINE_DATA)
+    {
+        std::string text = inlineData(targetFile) + "\n";
+        std::cout.write(text.data(), text.size()).flush();
+        return 0;
+    }
+
+    // Traverse file blocks and print, one contiguous run at a time
+    std::vector<extent> runs;
+    if (ioRuns(targetFile.first_blk, targetFile.size, runs) != 0)
+    {
+        return 6;
+    }
+    uint64_t bytesToRead = targetFile.size;
+
+    // Runs go from the disk file to stdout inside the kernel when stdout is
+    // a file, pipe or socket nothing else has been buffered for
+    bool zeroCopy = stdoutIsPlainFd();
+    if (zeroCopy)
+    {
+        std::cout.flush();
+    }
+    for (size_t i = 0; zeroCopy && i < runs.size(); i++)
+    {
+        size_t bytesToPrint = std::min(bytesToRead, (uint64_t)runs[i].count * blockSize);
+        if (cache.flush_blocks(runs[i].start, runs[i].count) != 0)
+        {
+            return 6;
+        }
+        int sent = disk.send_blocks(runs[i].start, runs[i].count, bytesToPrint, STDOUT_FILENO);
+        if (sent == -2 || (sent == -1 && i != 0))
+        {
+            return 7;
+        }
+        if (sent == -1)
+        {
+            zeroCopy = false; // stdout refused the first run, copy instead
+            break;
+        }
+        bytesToRead -= bytesToPrint;
+    }
+
+    // Otherwise the blocks after the ones being printed are read ahead
+    if (!zeroCopy)
+    {
+        ReadAhead reader(disk, cache, runs, readaheadBlocks, MAX_IO_BLOCKS);
+        extent piece;
+        const uint8_t* data;
+        while (bytesToRead > 0)
+        {
+            if (reader.next(piece, data) != 0)
+            {
+                return 6;
+            }
+            size_t bytesToPrint = std::min(bytesToRead, (uint64_t)piece.count * blockSize);
+            std::cout.write(reinterpret_cast<const char*>(data), bytesToPrint);
+            bytesToRead -= bytesToPrint;
+        }
+    }
 
+    std::cout << std::endl;
     return 0;
-}
\ No newline at end of file
+}
+
+// True if std::cout still writes to file descriptor 1 and that is a
+// regular file, pipe or socket, which sendfile can write to
+bool
+FS::stdoutIsPlainFd()
+{
+    if (std::cout.rdbuf() != stdoutBuffer)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(STDOUT_FILENO, &st) != 0)
+    {
+        return false;
+    }
+    return S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode);
+}
+
+// Helper function for printing access rights
+std::string FS::rightsTripletString(uint8_t rights) 
+{
+    std::string string = "";
+    string += (rights & READ)    ? "r" : "-";
+    string += (rights & WRITE)   ? "w" : "-";
+    string += (rights & EXECUTE) ? "x" : "-";
+    return string;
+}
+
+// ls lists the content in the currect directory (files and sub-directories)
+int
+FS::ls()
+{
+    lock_scope scope(*this, false);
+    if (!formatted)
+    {
+        return FS_UNFORMATTED;
+    }
+    // Load in current directory to print
+    std::vector<dir_entry> dir_entries;
+    if (readDir(currentDirectory(), dir_entries) != 0)
+    {
+        return 1;
+    }
+
+    // The listing goes out in one write, the width and alignment settings
+    // of std::cout are shared by every thread
+    std::ostringstream out;
+
+    // Header format
+    out << std::endl;
+    out 
+    << std::left << std::setw(20)
+    << "name"
+    << std::setw(15)
+    << "type"
+    << std::setw(15)
+    << "accessrights"
+    << std::setw(15)
+    << "size" 
+    << std::endl;
+    
+    std::string type = "";
+    
+    for (size_t i = 0; i < dir_entries.size(); i++)
+    {
+        if (dir_entries[i].file_name[0] == '\0')
+        {
+            continue;
+        }
+
+        if (strcmp(dir_entries[i].file_name, "..") == 0)
+        {
+            continue;
+        }
+
+        // Get file type
+        type = (dir_entries[i].type == TYPE_FILE) ? "file" : "dir";
+       
+        out 
+        << std::left << std::setw(20) 
+        << dir_entries[i].file_name 
+        << std::setw(15) 
+        << type 
+        << std::setw(15) 
+        << rightsTripletString(dir_entries[i].access_rights)
+        << std::setw(15) 
+        << ((type == "dir") ? "-" : std::to_string(dir_entries[i].size)) // "-" if tpye is directory, otherwise file size
+        << std::endl; 
+    }
+    out << std::endl;
+    std::string listing = out.str();
+    std::cout.write(listing.data(), listing.size()).flush();
+    
+    return 0;
+}
+
+// cp <sourcepath> <destpath> makes an exact copy of the file
+// <sourcepath> to a new file <destpath>
+int 
+FS::cp(std::string sourcepath, std::string destpath)
+{
+    command_scope scope(*this);
+    if (!formatted)
+    {
+        return FS_UNFORMATTED;
+    }
+    // Split source path
+    std::string sourceParent, sourceName;
+    splitParentPath(sourcepath, sourceParent, sourceName);
+
+    // Resolve source parent directory
+    uint16_t sourceDirBlock;
+    int retVal = resolvePath(sourceParent, true, sourceDirBlock);
+    if (retVal != 0)
+    {   
+        return retVal; // source parent invalid
+    }
+        
+    // Find source file
+    dir_index* sourceDir = getDirIndex(sourceDirBlock);
+    if (sourceDir == nullptr)
+    {
+        return 2;
+    }
+        
+    dir_entry sourceFile;
+    uint32_t sourceSlot;
+    retVal = findEntry(*sourceDir, sourceName, sourceFile, sourceSlot);
+    if (retVal < 0)
+    {
+        return 2;
+    }
+    if (retVal > 0 || sourceFile.type != TYPE_FILE)
+    {
+        return 3; // source not found or is a dir
+    }
+     // Access rights: must be readable
+    if (!(sourceFile.access_rights & READ)) 
+    {
+        std::cout << "ERROR: no READ permission on " << sourceFile.file_name << "\n";
+        return 4;
+    }
+
+    // Handle destination
+    std::string destParent, destName;
+    splitParentPath(destpath, destParent, destName);
+
+    uint16_t destDirBlock;
+    retVal = resolvePath(destParent, true, destDirBlock);
+    if (retVal != 0)
+    {
+        return retVal; // invalid dest parent
+    }
+        
+    // Load destination directory
+    dir_index* destDir = getDirIndex(destDirBlock);
+    dir_entry destDirEntry;
+    if (destDir == nullptr || readEntry(*destDir, 0, destDirEntry) != 0)
+    {
+        return 5;
+    }
+
+    // Check WRITE on destination parent
+    if (destDirBlock != ROOT_BLOCK) 
+    {
+        if (!(destDirEntry.access_rights & WRITE)) 
+        {
+            std::cout << "No WRITE rights on destination parent directory\n";
+            return 6;
+        }
+    }
+
+    // If destpath refers to an existing directory, copy inside it with same name
+    if (!destName.empty()) 
+    {
+        dir_entry destEntry;
+        uint32_t destSlot;
+        if (findEntry(*destDir, destName, destEntry, destSlot) == 0 && destEntry.type == TYPE_DIR) 
+        {
+            // Adjust if it's a directory
+            destDirBlock = destEntry.first_blk; 
+            destName = sourceName;
+
+            destDir = getDirIndex(destDirBlock);
+            if (destDir == nullptr)
+            {
+                return 7;
+            }
+        }
+    } 
+    else
+    {
+        // Path ended with "/" → means directory, keep same name
+        destName = sourceName;
+    }
+
+    // Ensure file with destName doesn’t already exist
+    if (destDir->names.count(destName) != 0) 
+    {
+        return 8; // already exists
+    }
+
+    // The copy shares the blocks of the source, they are only copied once
+    // either file is written. Files with too many copies already get their
+    // own blocks.
+    std::vector<uint16_t> freeBlocks;
+    bool shared = (sourceFile.first_blk != 0xFFFF && shareChain(sourceFile.first_blk) == 0);
+    if (!shared)
+    {
+        unsigned blocksToCopy = (sourceFile.first_blk == 0xFFFF) ? 0 : (sourceFile.size + blockSize - 1) / blockSize;
+        if (allocator.allocate_blocks(blocksToCopy, freeBlocks, destDirBlock) != 0)
+        {
+            return 11; // no free blocks
+        }
+
+        // Copy the data run by run, never holding more than a few blocks
+        retVal = copyChain(sourceFile.first_blk, freeBlocks);
+        if (retVal != 0)
+        {
+            releaseBlocks(freeBlocks);
+            return (retVal == 1) ? 10 : 12; // read error / write error
+        }
+    }
+
+    // Link blocks in FAT
+    uint16_t firstBlock = shared ? sourceFile.first_blk : 0xFFFF;
+    if (!shared)
+    {
+        retVal = extendFile(firstBlock, freeBlocks);
+        if (retVal != 0)
+        {
+            releaseBlocks(freeBlocks);
+            return (retVal > 0) ? 11 : 12;
+        }
+    }
+
+    // Create new dir_entry in destination
+    dir_entry newFile{};
+    strncpy(newFile.file_name, destName.c_str(), sizeof(newFile.file_name) - 1);
+    newFile.file_name[sizeof(newFile.file_name) - 1] = '\0';
+    newFile.first_blk = firstBlock;
+    newFile.size = sourceFile.size;
+    newFile.type = TYPE_FILE;
+    newFile.access_rights = sourceFile.access_rights & ~INLINE_DATA;
+    if (sourceFile.access_rights & INLINE_DATA)
+    {
+        // The new name may leave too little room, then the data gets a block
+        retVal = storeData(newFile, inlineData(sourceFile), destDirBlock, true);
+        if (retVal != 0)
+        {
+            return (retVal == 6) ? 11 : 12;
+        }
+        firstBlock = newFile.first_blk;
+    }
+
+    retVal = addEntry(*destDir, newFile);
+    if (retVal != 0)
+    {
+        if (firstBlock != 0xFFFF)
+        {
+            releaseChain(firstBlock);
+        }
+        return (retVal > 0) ? 14 : 15; // no space in directory / write error
+    } 
+        
+    return 0;
+}
+
+// mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
+// or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
+int 
+FS::mv(std::string sourcepath, std::string destpath)
+{
+    command_scope scope(*this);
+    if (!formatted)
+    {
+        return FS_UNFORMATTED;
+    }
+    if (sourcepath == destpath)
+    {
+        return 0;
+    } 
+
+    // Split source path
+    std::string sourceParent, sourceName;
+    splitParentPath(sourcepath, sourceParent, sourceName);
+
+    uint16_t sourceDirBlock;
+    int retVal = resolvePath(sourceParent, true, sourceDirBlock);
+    if (retVal != 0)
+    {
+        return retVal; // invalid source parent
+    }
+
+    // Load source dir
+    dir_index* sourceDir = getDirIndex(sourceDirBlock);
+    dir_entry sourceDirEntry;
+    if (sourceDir == nullptr || readEntry(*sourceDir, 0, sourceDirEntry) != 0)
+    {
+        return 1;
+    }
+
+    // Find source entry
+    dir_entry sourceFile;
+    uint32_t sourceSlot;
+    retVal = findEntry(*sourceDir, sourceName, sourceFile, sourceSlot);
+    if (retVal < 0)
+    {
+        return 1;
+    }
+    if (retVal > 0) 
+    {
+        return 2; // not found
+    }
+
+     // Check WRITE on source parent
+    if (sourceDirBlock != ROOT_BLOCK) 
+    {
+        if (!(sourceDirEntry.access_rights & WRITE)) 
+        {
+            std::cout << "No WRITE rights on source parent directory\n";
+            return 3;
+        }
+    }
+
+    // Split dest path
+    std::string destParent, destName;
+    splitParentPath(destpath, destParent, destName);
+
+    uint16_t destDirBlock;
+    retVal = resolvePath(destParent, true, destDirBlock);
+    if (retVal != 0)
+    {
+        return retVal; // invalid dest parent
+    }
+
+    // Load dest dir
+    dir_index* destDir = getDirIndex(destDirBlock);
+    dir_entry destDirEntry;
+    if (destDir == nullptr || readEntry(*destDir, 0, destDirEntry) != 0)
+    {
+        return 4;
+    }
+
+    // Check write on destination parent
+    if (destDirBlock != ROOT_BLOCK) 
+    {
+        if (!(destDirEntry.access_rights & WRITE)) 
+        {
+            std::cout << "No WRITE rights on destination parent directory\n";
+            return 5;
+        }
+    }
+
+    // If dest is an existing directory, move into it
+    if (!destName.empty()) 
+    {
+        dir_entry destEntry;
+        uint32_t destSlot;
+        if (findEntry(*destDir, destName, destEntry, destSlot) == 0 && destEntry.type == TYPE_DIR) 
+        {
+            // move into that directory, keep name
+            destDirBlock = destEntry.first_blk;   // direct jump
+            destName = sourceName;
+
+            destDir = getDirIndex(destDirBlock);
+            if (destDir == nullptr)
+            {
+                return 6;
+            }
+        }
+    } 
+    else 
+    {
+        // path ended with '/', so use same name
+        destName = sourceName;
+    }
+
+    // Prevent overwrite
+    if (destDir->names.count(destName) != 0) 
+    {
+        return 7; // already exists
+    }
+
+    // A directory can't be moved into itself or below itself
+    if (sourceFile.type == TYPE_DIR && isAncestor(destDirBlock, sourceFile.first_blk))
+    {
+        return 11;
+    }
+
+    // Insert entry into dest dir. Data kept after the name is written
+    // again after the new one, or moved to a block if it no longer fits.
+    dir_entry moved = sourceFile;
+    std::string inlined;
+    if (sourceFile.access_rights & INLINE_DATA)
+    {
+        inlined = inlineData(sourceFile);
+        moved.access_rights &= ~INLINE_DATA;
+    }
+    strncpy(moved.file_name, destName.c_str(), sizeof(moved.file_name) - 1);
+    moved.file_name[sizeof(moved.file_name) - 1] = '\0';
+    if (!inlined.empty() && storeData(moved, inlined, destDirBlock, true) != 0)
+    {
+        return 13;
+    }
+    retVal = addEntry(*destDir, moved);
+    if (retVal != 0)
+    {
+        if (moved.first_blk != sourceFile.first_blk)
+        {
+            releaseChain(moved.first_blk);
+        }
+        return (retVal > 0) ? 8 : 9; // destination directory full / write error
+    }
+
+    // Open handles follow the file to its new slot
+    uint32_t movedSlot = destDir->names[moved.file_name];
+    for (open_file& file : openFiles)
+    {
+        if (file.used && file.dirBlock == sourceDirBlock && file.slot == sourceSlot)
+        {
+            file.dirBlock = destDirBlock;
+            file.slot = movedSlot;
+            file.entry = moved;
+            file.mapped = false;
+        }
+    }
+        
+    // Clear source entry
+    if (removeEntry(*sourceDir, sourceSlot) != 0)
+    {
+        return 10;
+    }
+
+    // A moved directory's ".." must point to its new parent
+    if (sourceFile.type == TYPE_DIR && destDirBlock != sourceDirBlock)
+    {
+        dir_index* movedDir = getDirIndex(sourceFile.first_blk);
+        dir_entry parentEntry;
+        if (movedDir == nullptr || readEntry(*movedDir, 0, parentEntry) != 0)
+        {
+            return 12;
+        }
+        parentEntry.first_blk = destDirBlock;
+        if (writeEntry(*movedDir, 0, parentEntry) != 0)
+        {
+            return 12;
+        }
+    }
+        
+    return 0;
+}
+
+// rm <filepath> removes / deletes the file <filepath>
+int 
+FS::rm(std::string filepath)
+{
+    command_scope scope(*this);
+    if (!formatted)
+    {
+        return FS_UNFORMATTED;
+    }
+    // Split into parent + filename
+    std::string parentPath, name;
+    splitParentPath(filepath, parentPath, name);
+
+    // Resolve parent directory
+    uint16_t parentBlock;
+    int retVal = resolvePath(parentPath, true, parentBlock);
+    if (retVal != 0)
+    {
+        return retVal; // invalid parent path
+    }
+        
+    // Read parent directory
+    dir_index* dir = getDirIndex(parentBlock);
+    dir_entry parentEntry;
+    if (dir == nullptr || readEntry(*dir, 0, parentEntry) != 0)
+    {
+        return 1;
+    }
+
+    // Check write permission on parent directory
+    if (parentBlock != ROOT_BLOCK) // root always allowed
+    {  
+        if (!(parentEntry.access_rights & WRITE)) 
+        {
+            std::cout << "No write rights on parent directory" << std::endl;
+            return 2;
+        }
+    }
+
+    // Find entry to remove
+    dir_entry entryToRemove;
+    uint32_t slot;
+    retVal = findEntry(*dir, name, entryToRemove, slot);
+    if (retVal < 0)
+    {
+        return 1;
+    }
+    if (retVal > 0 || name == "..")
+    {
+        return 3; // not found
+    } 
+    if (isOpen(parentBlock, slot))
+    {
+        return 8; // still open
+    }
+
+    // Handle directory case
+    if (entryToRemove.type == TYPE_DIR) 
+    {
+        dir_index* subDir = getDirIndex(entryToRemove.first_blk);
+        if (subDir == nullptr)
+        {
+            return 4;
+        }
+
+        // Only the ".." entry may be left
+        if (subDir->names.size() > 1) 
+        {
+            std::cout << "ERROR: can't remove non-empty directory" << std::endl;
+            return 5;
+        }
+        if (isCurrentDirectory(entryToRemove.first_blk))
+        {
+            return 8; // some thread is in it
+        }
+        dirIndexes.erase(entryToRemove.first_blk);
+        dcache.invalidate_dir(entryToRemove.first_blk);
+    }
+
+    // Free blocks in FAT, blocks shared with copies stay with them
+    if (entryToRemove.first_blk != 0xFFFF) // Guard against empty file
+    { 
+        releaseChain(entryToRemove.first_blk);
+    }
+
+    // Clear directory entry
+    if (removeEntry(*dir, slot) != 0)
+    {
+        return 7;
+    }
+        
+    markFatDirty();
+
+    return 0;
+}
+
+// append <filepath1> <filepath2> appends the contents of file <filepath1> to
+// the end of file <filepath2>. The file <filepath1> is unchanged.
+int 
+FS::append(std::string filepath1, std::string filepath2)
+{
+    command_scope scope(*this);
+    if (!formatted)
+    {
+        return FS_UNFORMATTED;
+    }
+    // Resolve and find source file
+    std::string sourceParent, sourceName;
+    splitParentPath(filepath1, sourceParent, sourceName);
+
+    uint16_t sourceDirBlock;
+    int retVal = resolvePath(sourceParent, true, sourceDirBlock);
+    if (retVal != 0)
+    {
+        return retVal;
+    }
+        
+    dir_index* sourceDir = getDirIndex(sourceDirBlock);
+    if (sourceDir == nullptr)
+    {
+        return 1;
+    }
+
+    dir_entry sourceFile;
+    uint32_t sourceSlot;
+    retVal = findEntry(*sourceDir, sourceName, sourceFile, sourceSlot);
+    if (retVal < 0)
+    {
+        return 1;
+    }
+    if (retVal > 0 || sourceFile.type != TYPE_FILE)
+    {
+        return 2;
+    }
+    if (!(sourceFile.access_rights & READ)) 
+    {
+        std::cout << "No READ rights on source file" << std::endl;
+        return 3;
+    }
+
+    // Resolve and find destination file
+    std::string destParent, destName;
+    splitParentPath(filepath2, destParent, destName);
+
+    uint16_t destDirBlock;
+    retVal = resolvePath(destParent, true, destDirBlock); 
+    if (retVal != 0)
+    {
+        return retVal;
+    }
+        
+    dir_index* destDir = getDirIndex(destDirBlock);
+    if (destDir == nullptr)
+    {
+        return 4;
+    }
+        
+    dir_entry destFile;
+    uint32_t destSlot;
+    retVal = findEntry(*destDir, destName, destFile, destSlot);
+    if (retVal < 0)
+    {
+        return 4;
+    }
+    if (retVal > 0 || destFile.type != TYPE_FILE)
+    {
+        return 5;
+    }
+    if (!(destFile.access_rights & WRITE))
+    {
+        std::cout << "No write access on destination file" << std::endl;
+        return 6;
+    }    
+
+    if (sourceFile.size == 0)
+    {
+        return 0; // nothing to append, no error, just return safely
+    }
+
+    // Data kept in the entries is joined there while it still fits,
+    // otherwise the destination is given a block first
+    std::string sourceInline;
+    if (sourceFile.access_rights & INLINE_DATA)
+    {
+        sourceInline = inlineData(sourceFile);
+    }
+    if (destFile.access_rights & INLINE_DATA)
+    {
+        std::string joined = inlineData(destFile) + sourceInline;
+        if (!sourceInline.empty() && fitsInline(destName.size(), joined.size()))
+        {
+            storeData(destFile, joined, destDirBlock, true);
+            return (writeEntry(*destDir, destSlot, destFile) != 0) ? 14 : 0;
+        }
+        retVal = uninline(destFile, destDirBlock);
+        if (retVal != 0)
+        {
+            return (retVal == 6) ? 11 : 12;
+        }
+    }
+
+    // The last block and its FAT entry are about to change, a chain shared
+    // with copies is copied first
+    retVal = unshareChain(destFile, destDirBlock);
+    if (retVal != 0)
+    {
+        return (retVal == 1) ? 11 : 12;
+    }
+    if (writeEntry(*destDir, destSlot, destFile) != 0)
+    {
+        return 14;
+    }
+
+    // The data lands in the free part of the last block, if any, and then
+    // in new blocks right after it
+    std::vector<uint16_t> destBlocks;
+    int32_t lastBlock = FAT_EOF;
+    unsigned usedBytes = 0;
+    unsigned allocGoal = destDirBlock;
+    if (destFile.first_blk != 0xFFFF) 
+    {
+        lastBlock = chainTail(destFile.first_blk);
+        if (lastBlock == FAT_EOF)
+        {
+            return 9;
+        }
+        allocGoal = lastBlock + 1;
+        usedBytes = destFile.size % blockSize;
+        if (usedBytes != 0)
+        {
+            destBlocks.push_back(lastBlock);
+        }
+    }
+    unsigned tailSpace = (usedBytes != 0) ? blockSize - usedBytes : 0;
+    unsigned newBlockCount = 0;
+    if (sourceFile.size > tailSpace)
+    {
+        newBlockCount = (sourceFile.size - tailSpace + blockSize - 1) / blockSize;
+    }
+
+    // Allocate new blocks if needed, error if there are no free blocks in FAT
+    std::vector<uint16_t> destNewBlocks;
+    if (allocator.allocate_blocks(newBlockCount, destNewBlocks, allocGoal) != 0)
+    {
+        return 11; 
+    }
+    destBlocks.insert(destBlocks.end(), destNewBlocks.begin(), destNewBlocks.end());
+
+    // Stream the source through two bounded buffers: source runs are read
+    // into sourceBuf and repacked into whole destination blocks in destBuf
+    std::vector<uint8_t> sourceBuf(MAX_IO_BLOCKS * blockSize);
+    std::vector<uint8_t> destBuf(MAX_IO_BLOCKS * blockSize);
+    size_t destFill = 0;      // bytes in destBuf
+    size_t destFlushed = 0;   // destBlocks already written
+    if (usedBytes != 0)
+    {
+        if (cache.read(lastBlock, destBuf.data()) != 0)
+        {
+            releaseBlocks(destNewBlocks);
+            return 9;
+        }
+        destFill = usedBytes;
+    }
+
+    // A source kept in its entry is a single run
+    std::vector<extent> sourceRuns;
+    if (sourceInline.empty() && ioRuns(sourceFile.first_blk, sourceFile.size, sourceRuns) != 0)
+    {
+        releaseBlocks(destNewBlocks);
+        return 8;
+    }
+    size_t runCount = sourceInline.empty() ? sourceRuns.size() : 1;
+    uint32_t sourceLeft = sourceFile.size;
+    for (size_t r = 0; r < runCount; r++)
+    {
+        const uint8_t* runData = reinterpret_cast<const uint8_t*>(sourceInline.data());
+        if (sourceInline.empty())
+        {
+            if (cache.read_blocks(sourceRuns[r].start, sourceRuns[r].count, sourceBuf.data()) != 0)
+            {
+                releaseBlocks(destNewBlocks);
+                return 8;
+            }
+            runData = sourceBuf.data();
+        }
+        size_t runBytes = sourceInline.empty() ? std::min((size_t)sourceLeft, (size_t)sourceRuns[r].count * blockSize) : sourceInline.size();
+        sourceLeft -= runBytes;
+
+        size_t taken = 0;
+        while (taken < runBytes)
+        {
+            size_t n = std::min(runBytes - taken, destBuf.size() - destFill);
+            memcpy(destBuf.data() + destFill, runData + taken, n);
+            destFill += n;
+            taken += n;
+
+            // Write out destBuf when it is full or everything has been read
+            if (destFill == destBuf.size() || (sourceLeft == 0 && taken == runBytes))
+            {
+                size_t blocks = (destFill + blockSize - 1) / blockSize;
+                std::vector<uint16_t> target(destBlocks.begin() + destFlushed, destBlocks.begin() + destFlushed + blocks);
+                if (writeBlocks(target, reinterpret_cast<char*>(destBuf.data()), destFill) != 0)
+                {
+                    releaseBlocks(destNewBlocks);
+                    return (destFlushed == 0 && usedBytes != 0) ? 10 : 12;
+                }
+                destFlushed += blocks;
+                destFill = 0;
+            }
+        }
+    }
+
+    // Link new blocks and attach them to the destination file
+    retVal = extendFile(destFile.first_blk, destNewBlocks);
+    if (retVal != 0)
+    {
+        releaseBlocks(destNewBlocks);
+        return (retVal > 0) ? 11 : 12;
+    }
+
+    // Update size
+    destFile.size += sourceFile.size;
+
+    // Save back
+    markFatDirty();
+
+    if (writeEntry(*destDir, destSlot, destFile) != 0)
+    {
+        return 14;
+    }
+        
+    return 0;
+}
+
+// mkdir <dirpath> creates a new sub-directory with the name <dirpath>
+// in the current directory
+int 
+FS::mkdir(std::string dirpath) 
+{
+    command_scope scope(*this);
+    if (!formatted)
+    {
+        return FS_UNFORMATTED;
+    }
+    // Split path into parent + name
+    std::string parentPath, newName;
+    splitParentPath(dirpath, parentPath, newName);
+
+    // Resolve parent directory
+    uint16_t parentBlock;
+    int retVal = resolvePath(parentPath, true, parentBlock);
+    if (retVal != 0)
+    {
+        return retVal;
+    } 
+
+    // Read parent directory
+    dir_index* dir = getDirIndex(parentBlock);
+    dir_entry parentEntry;
+    if (dir == nullptr || readEntry(*dir, 0, parentEntry) != 0)
+    {   
+        return 1;
+    } 
+
+    // Check write permission on parent directory
+    if (parentBlock != ROOT_BLOCK)   // root always allowed
+    {
+        if (!(parentEntry.access_rights & WRITE)) 
+        {
+            std::cout << "No WRITE rights on parent directory" << std::endl;
+            return 2;
+        }
+    }
+
+    // Check if name already exists in parent
+    if (dir->names.count(newName) != 0) 
+    {
+        return 3; // already exists
+    }
+
+    // Allocate a free block for the new directory
+    int32_t newBlock = allocator.allocate(parentBlock);
+
+    // No free slots in FAT
+    if (newBlock == -1)
+    {
+        return 5;
+    } 
+
+    // Initialize new directory block
+    std::vector<uint8_t> newBuf(blockSize);
+    dir_entry* newEntries = reinterpret_cast<dir_entry*>(newBuf.data());
+
+    // Parent '..' entry
+    strcpy(newEntries[0].file_name, "..");
+    newEntries[0].first_blk = parentBlock;
+    newEntries[0].type = TYPE_DIR;
+    newEntries[0].size = 0;
+    newEntries[0].access_rights = READ | WRITE | EXECUTE;
+
+    if (cache.write(newBlock, newBuf.data()) != 0)
+    {
+        allocator.release(newBlock);
+        return 6; // write error
+    }
+
+    // Add new entry in parent directory
+    dir_entry newDir{};
+    strncpy(newDir.file_name, newName.c_str(), sizeof(newDir.file_name) - 1);
+    newDir.first_blk = newBlock;
+    newDir.type = TYPE_DIR;
+    newDir.size = 0;
+    newDir.access_rights = READ | WRITE | EXECUTE;
+
+    // Update parent directory
+    retVal = addEntry(*dir, newDir);
+    if (retVal != 0)
+    {
+        allocator.release(newBlock);
+        cache.drop_blocks(newBlock, 1);
+        return (retVal > 0) ? 4 : 6; // parent can't grow / write error
+    }
+
+    // Update FAT
+    setFat(newBlock, FAT_EOF);
+    markFatDirty();
+
+    return 0;
+}
+
+// cd <dirpath> changes the current (working) directory to the directory named <dirpath>
+int
+FS::cd(std::string dirpath)
+{
+    lock_scope scope(*this, false);
+    if (!formatted)
+    {
+        return FS_UNFORMATTED;
+    }
+    uint16_t targetBlock;
+    
+    // Update current directory using the output of targetBlock
+    int retVal = resolvePath(dirpath, true, targetBlock);
+    if (retVal != 0) 
+    {
+        return retVal;
+    }
+
+    setCurrentDirectory(targetBlock);
+    return 0;
+}
+
+// pwd prints the full path, i.e., from the root directory, to the current
+// directory, including the currect directory name
+int
+FS::pwd()
+{
+    lock_scope scope(*this, false);
+    if (!formatted)
+    {
+        return FS_UNFORMATTED;
+    }
+    uint16_t currentBlock = currentDirectory();
+
+    // If already at root, print and return
+    if (currentBlock == ROOT_BLOCK)
+    {
+        std::cout.write("/\n", 2).flush();
+        return 0;
+    }
+
+    std::vector<std::string> filePath;
+
+    // Traverse up the file hierarchy to find root and save the path taken
+    while (currentBlock != ROOT_BLOCK)
+    {
+        dir_parent parent;
+        if (!findParent(currentBlock, parent))
+        {
+            // The parent has not been indexed since mount, indexing it
+            // records the name of this directory
+            dir_index* current = getDirIndex(currentBlock);
+            dir_entry currentEntry;
+            if (current == nullptr || readEntry(*current, 0, currentEntry) != 0)
+            {
+                return 1;
+            }
+            if (getDirIndex(currentEntry.first_blk) == nullptr)
+            {
+                return 2;
+            }
+            if (!findParent(currentBlock, parent))
+            {
+                return 2;
+            }
+        }
+
+        // Add current the current path taken to the total path and move up to parent
+        filePath.push_back(parent.name);
+        currentBlock = parent.parent;
+    }
+
+    // Print working directory path, in one write like ls
+    std::string path = "/";
+    for (int i = (int)filePath.size() - 1; i >= 0; i--)
+    {
+        path += filePath[i];
+        if (i != 0)
+        {
+            path += "/";
+        }
+    }
+    path += "\n";
+    std::cout.write(path.data(), path.size()).flush();
+
+    return 0;
+}
+
+// ends the session of the calling thread
+void
+FS::end_session()
+{
+    std::lock_guard<std::mutex> guard(sessionLock);
+    sessionDirs.erase(std::this_thread::get_id());
+}
+
+// chmod <accessrights> <filepath> changes the access rights for the
+// file <filepath> to <accessrights>.
+int 
+FS::chmod(std::string accessrights, std::string filepath)
+{
+    command_scope scope(*this);
+    if (!formatted)
+    {
+        return FS_UNFORMATTED;
+    }
+    // Parse access rights
+    int rights = std::stoi(accessrights);
+    if (rights < 0 || rights > 7) 
+    {
+        return 1;
+    }
+
+    // Split path into parent + name
+    std::string parentPath, name;
+    splitParentPath(filepath, parentPath, name);
+
+    // Resolve parent directory
+    uint16_t parentBlock;
+    int retVal = resolvePath(parentPath, true, parentBlock);
+    if (retVal != 0)
+    {
+        return retVal;
+    }
+
+    // Load parent directory
+    dir_index* dir = getDirIndex(parentBlock);
+    dir_entry parentEntry;
+    if (dir == nullptr || readEntry(*dir, 0, parentEntry) != 0)
+    {
+        return 2;
+    } 
+
+     // Check write rights on the parent directory
+    if (parentBlock != ROOT_BLOCK) 
+    {
+        if (!(parentEntry.access_rights & WRITE)) 
+        {
+            std::cout << "ERROR: no write rights on parent directory\n";
+            return 3;
+        }
+    }
+
+    // Find target entry
+    dir_entry target;
+    uint32_t slot;
+    retVal = findEntry(*dir, name, target, slot);
+    if (retVal < 0)
+    {
+        return 2;
+    }
+    if (retVal > 0)
+    {
+        return 4; // not found
+    } 
+
+    // Update rights, whether the data is inline stays as it is
+    target.access_rights = rights | (target.access_rights & INLINE_DATA);
+
+    // Save back
+    if (writeEntry(*dir, slot, target) != 0)
+    {
+        return 5;
+    } 
+
+    return 0;
+}
+
+// Rewrites the FAT chain of every file in the directory tree below dirBlock
+// as an extent list. converted maps the first block of each chain already
+// rewritten to its FAT_LAYOUT block, so copies sharing a chain keep
+// sharing it. Files with more extents than fit in a block stay chains.
+int
+FS::convertDir(uint16_t dirBlock, std::unordered_map<uint16_t, uint16_t>& converted)
+{
+    dir_index* dir = getDirIndex(dirBlock);
+    if (dir == nullptr)
+    {
+        return 1;
+    }
+    std::vector<uint32_t> slots;
+    for (auto it = dir->names.begin(); it != dir->names.end(); ++it)
+    {
+        if (it->first != "..")
+        {
+            slots.push_back(it->second);
+        }
+    }
+
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        dir_entry entry;
+        if (readEntry(*dir, slots[i], entry) != 0)
+        {
+            return 1;
+        }
+        if (entry.type == TYPE_DIR)
+        {
+            int retVal = convertDir(entry.first_blk, converted);
+            if (retVal != 0)
+            {
+                return retVal;
+            }
+            continue;
+        }
+        if (entry.first_blk == 0xFFFF || fat[entry.first_blk] == FAT_LAYOUT)
+        {
+            continue;
+        }
+
+        auto found = converted.find(entry.first_blk);
+        if (found == converted.end())
+        {
+            std::vector<extent> extents;
+            if (chainExtents(entry.first_blk, extents) != 0)
+            {
+                return 1;
+            }
+            if (extents.size() > layoutCapacity())
+            {
+                continue;
+            }
+            int32_t layoutBlock = allocator.allocate(entry.first_blk);
+            if (layoutBlock == -1)
+            {
+                return 2;
+            }
+            if (writeLayout(layoutBlock, extents) != 0)
+            {
+                allocator.release(layoutBlock);
+                return 1;
+            }
+
+            // The data blocks leave the chain, the list has as many owners
+            for (const extent& e : extents)
+            {
+                for (unsigned b = e.start; b < (unsigned)e.start + e.count; b++)
+                {
+                    setFat(b, FAT_EOF);
+                }
+            }
+            setFat(layoutBlock, FAT_LAYOUT);
+            setRef(layoutBlock, refs[entry.first_blk]);
+            markFatDirty();
+            chainTails.erase(entry.first_blk);
+            bmap.invalidate(entry.first_blk);
+            found = converted.insert(std::make_pair(entry.first_blk, (uint16_t)layoutBlock)).first;
+        }
+
+        entry.first_blk = found->second;
+        if (writeEntry(*dir, slots[i], entry) != 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// convert rewrites every file stored as a FAT chain as an extent list,
+// files created afterwards are stored as extents as well. Returns 1 on an
+// I/O error and 2 if the disk is full, files converted until then stay
+// converted.
+int
+FS::convert_extents()
+{
+    command_scope scope(*this);
+    if (!formatted)
+    {
+        return FS_UNFORMATTED;
+    }
+    sb.version = FS_VERSION;
+    sb.layout = LAYOUT_EXTENTS;
+    if (writeSuperblock() != 0)
+    {
+        return 1;
+    }
+    std::unordered_map<uint16_t, uint16_t> converted;
+    return convertDir(ROOT_BLOCK, converted);
+}
+
+// Returns the open file behind handle fd, nullptr if fd is not open
+FS::open_file*
+FS::getOpenFile(int fd)
+{
+    std::lock_guard<std::mutex> guard(fileTableLock);
+    if (fd < 0 || (size_t)fd >= openFiles.size() || !openFiles[fd].used)
+    {
+        return nullptr;
+    }
+    return &openFiles[fd];
+}
+
+// True if a handle is open on the entry in the given slot of the directory
+// starting at dirBlock
+bool
+FS::isOpen(uint16_t dirBlock, uint32_t slot)
+{
+    for (const open_file& file : openFiles)
+    {
+        if (file.used && file.dirBlock == dirBlock && file.slot == slot)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Builds the block map of an open file from its FAT chain, so any offset
+// is found without walking the chain again
+int
+FS::loadBlockMap(open_file& file)
+{
+    if (file.mapped)
+    {
+        return 0;
+    }
+    file.blocks.clear();
+    if (file.entry.first_blk != 0xFFFF)
+    {
+        std::vector<extent> extents;
+        if (chainExtents(file.entry.first_blk, extents) != 0)
+        {
+            return 1;
+        }
+        for (const extent& e : extents)
+        {
+            for (unsigned b = e.start; b < (unsigned)e.start + e.count; b++)
+            {
+                file.blocks.push_back(b);
+            }
+        }
+    }
+    if (file.blocks.size() < (file.entry.size + (uint64_t)blockSize - 1) / blockSize)
+    {
+        return 1; // chain shorter than the file
+    }
+    file.mapped = true;
+    return 0;
+}
+
+// Length of the run of consecutive blocks starting at blocks[index], at
+// most maxBlocks long
+unsigned
+FS::mapRun(const std::vector<uint16_t>& blocks, size_t index, unsigned maxBlocks)
+{
+    unsigned run = 1;
+    while (run < maxBlocks && index + run < blocks.size() && blocks[index + run] == blocks[index] + run)
+    {
+        run++;
+    }
+    return run;
+}
+
+// Writes the entry of an open file back to its directory
+int
+FS::saveOpenFile(open_file& file)
+{
+    dir_index* dir = getDirIndex(file.dirBlock);
+    if (dir == nullptr || writeEntry(*dir, file.slot, file.entry) != 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+// Gets an open file ready to be changed: data kept in its entry is moved
+// to a block and a chain shared with copies is copied first, and the block
+// map is loaded. Returns -3 on an I/O error and -4 if there is no room.
+int
+FS::prepareWrite(open_file& file)
+{
+    if (file.entry.access_rights & INLINE_DATA)
+    {
+        int retVal = uninline(file.entry, file.dirBlock);
+        if (retVal != 0)
+        {
+            return (retVal == 6) ? -4 : -3;
+        }
+        file.mapped = false;
+        if (saveOpenFile(file) != 0)
+        {
+            return -3;
+        }
+    }
+    if (isShared(file.entry))
+    {
+        int retVal = unshareChain(file.entry, file.dirBlock);
+        if (retVal != 0)
+        {
+            return (retVal == 1) ? -4 : -3;
+        }
+        file.mapped = false;
+        if (saveOpenFile(file) != 0)
+        {
+            return -3;
+        }
+    }
+    return (loadBlockMap(file) != 0) ? -3 : 0;
+}
+
+// Grows or shrinks a prepared open file to size bytes. Added blocks are
+// filled with zeroes, and the part of the last block past the end of the
+// file is kept zero so a file that grows again reads zeroes there.
+int
+FS::resizeFile(open_file& file, uint32_t size)
+{
+    size_t oldBlocks = file.blocks.size();
+    size_t keep = ((uint64_t)size + blockSize - 1) / blockSize;
+    if (keep > oldBlocks)
+    {
+        std::vector<uint16_t> newBlocks;
+        unsigned goal = (oldBlocks != 0) ? file.blocks.back() + 1 : file.dirBlock;
+        if (allocator.allocate_blocks(keep - oldBlocks, newBlocks, goal) != 0)
+        {
+            return -4;
+        }
+        std::vector<uint8_t> zeroBuf(std::min(newBlocks.size(), (size_t)MAX_IO_BLOCKS) * blockSize, 0);
+        size_t i = 0;
+        while (i < newBlocks.size())
+        {
+            unsigned run = mapRun(newBlocks, i, MAX_IO_BLOCKS);
+            if (cache.write_blocks(newBlocks[i], run, zeroBuf.data()) != 0)
+            {
+                releaseBlocks(newBlocks);
+                return -3;
+            }
+            i += run;
+        }
+
+        int retVal = extendFile(file.entry.first_blk, newBlocks);
+        if (retVal != 0)
+        {
+            releaseBlocks(newBlocks);
+            return (retVal > 0) ? -4 : -3;
+        }
+        file.blocks.insert(file.blocks.end(), newBlocks.begin(), newBlocks.end());
+    }
+    else if (keep < oldBlocks)
+    {
+        if (shrinkFile(file.entry.first_blk, keep) != 0)
+        {
+            return -3;
+        }
+        file.blocks.resize(keep);
+    }
+
+    if (size < file.entry.size && size % blockSize != 0)
+    {
+        std::vector<uint8_t> buf(blockSize);
+        if (cache.read(file.blocks[keep - 1], buf.data()) != 0)
+        {
+            return -3;
+        }
+        memset(buf.data() + size % blockSize, 0, blockSize - size % blockSize);
+        if (cache.write_blocks(file.blocks[keep - 1], 1, buf.data()) != 0)
+        {
+            return -3;
+        }
+    }
+
+    markFatDirty();
+    file.entry.size = size;
+    return (saveOpenFile(file) != 0) ? -3 : 0;
+}
+
+// Opens the file at filepath, creating it if create is set and there is
+// none. Returns what open returns. Without create it changes no metadata
+// and only needs metaLock shared.
+int
+FS::openEntry(const std::string& filepath, int mode, bool create)
+{
+    // Resolve parent directory
+    std::string parentPath, name;
+    splitParentPath(filepath, parentPath, name);
+    uint16_t parentBlock;
+    int retVal = resolvePath(parentPath, true, parentBlock);
+    if (retVal != 0)
+    {
+        return retVal;
+    }
+    dir_index* dir = getDirIndex(parentBlock);
+    if (dir == nullptr)
+    {
+        return -8;
+    }
+
+    // Find the file, or create it empty
+    dir_entry entry;
+    uint32_t slot;
+    retVal = findEntry(*dir, name, entry, slot);
+    if (retVal < 0)
+    {
+        return -8;
+    }
+    if (retVal > 0)
+    {
+        if (!create)
+        {
+            return -6;
+        }
+        if (name.empty() || name.size() >= 56)
+        {
+            return -9;
+        }
+        dir_entry parentEntry;
+        if (readEntry(*dir, 0, parentEntry) != 0)
+        {
+            return -8;
+        }
+        if (!(parentEntry.access_rights & WRITE))
+        {
+            std::cout << "No write rights on parent directory" << std::endl;
+            return -10;
+        }
+
+        entry = dir_entry{};
+        strncpy(entry.file_name, name.c_str(), sizeof(entry.file_name) - 1);
+        entry.size = 0;
+        entry.first_blk = 0xFFFF;
+        entry.type = TYPE_FILE;
+        entry.access_rights = READ | WRITE;
+        retVal = addEntry(*dir, entry);
+        if (retVal != 0)
+        {
+            return (retVal > 0) ? -11 : -8;
+        }
+        slot = dir->names[entry.file_name];
+    }
+
+    if (entry.type != TYPE_FILE)
+    {
+        return -12;
+    }
+    if (((mode & READ) && !(entry.access_rights & READ)) ||
+        ((mode & WRITE) && !(entry.access_rights & WRITE)))
+    {
+        return -10;
+    }
+
+    // Take the lowest free handle, the block map is built on first use
+    std::lock_guard<std::mutex> guard(fileTableLock);
+    size_t fd = 0;
+    while (fd < openFiles.size() && openFiles[fd].used)
+    {
+        fd++;
+    }
+    if (fd == openFiles.size())
+    {
+        openFiles.emplace_back();
+    }
+    open_file& file = openFiles[fd];
+    file.used = true;
+    file.mode = mode & (READ | WRITE);
+    file.dirBlock = parentBlock;
+    file.slot = slot;
+    file.entry = entry;
+    file.blocks.clear();
+    file.mapped = false;
+    return fd;
+}
+
+// open <filepath> <mode> opens a file for reading (READ) and/or writing
+// (WRITE), with OPEN_CREATE an empty file is created if there is none.
+// Returns the lowest free handle, or the negative codes of resolvePath,
+// -6 if there is no such file, -7 for an invalid mode, -8 on an I/O error,
+// -9 for an invalid name, -10 without the access rights, -11 if the
+// directory is full and -12 if the path is a directory.
+int
+FS::open(std::string filepath, int mode)
+{
+    if ((mode & (READ | WRITE)) == 0 || (mode & ~(READ | WRITE | OPEN_CREATE)) != 0)
+    {
+        return -7;
+    }
+
+    // An existing file is opened with metaLock shared, only creating one
+    // is a command
+    {
+        lock_scope scope(*this, false);
+        if (!formatted)
+        {
+            return -FS_UNFORMATTED;
+        }
+        int fd = openEntry(filepath, mode, false);
+        if (fd != -6 || !(mode & OPEN_CREATE))
+        {
+            return fd;
+        }
+    }
+    command_scope scope(*this);
+    return openEntry(filepath, mode, true);
+}
+
+// reads up to count bytes starting at offset, one disk request per run of
+// consecutive blocks. Returns the number of bytes read, -1 for a bad
+// handle, -2 if it is not open for reading and -3 on an I/O error.
+int64_t
+FS::pread(int fd, char* buf, uint32_t count, uint32_t offset)
+{
+    if (fd < 0)
+    {
+        return -1;
+    }
+    std::lock_guard<std::mutex> handle(handleLocks[fd % LOCK_STRIPES]);
+    lock_scope scope(*this, false);
+    open_file* file = getOpenFile(fd);
+    if (file == nullptr)
+    {
+        return -1;
+    }
+    if (!(file->mode & READ))
+    {
+        return -2;
+    }
+    if (offset >= file->entry.size)
+    {
+        return 0;
+    }
+    count = std::min(count, file->entry.size - offset);
+    if (file->entry.access_rights & INLINE_DATA)
+    {
+        memcpy(buf, inlineData(file->entry).data() + offset, count);
+        return count;
+    }
+    if (loadBlockMap(*file) != 0)
+    {
+        return -3;
+    }
+
+    uint64_t totalBlocks = ((uint64_t)offset % blockSize + count + blockSize - 1) / blockSize;
+    std::vector<uint8_t> ioBuf(std::min(totalBlocks, (uint64_t)MAX_IO_BLOCKS) * blockSize);
+    uint32_t done = 0;
+    while (done < count)
+    {
+        uint32_t pos = offset + done;
+        size_t index = pos / blockSize;
+        unsigned inBlock = pos % blockSize;
+        uint64_t blocksLeft = ((uint64_t)inBlock + (count - done) + blockSize - 1) / blockSize;
+        unsigned run = mapRun(file->blocks, index, std::min(blocksLeft, (uint64_t)MAX_IO_BLOCKS));
+        if (cache.read_blocks(file->blocks[index], run, ioBuf.data()) != 0)
+        {
+            return -3;
+        }
+        uint32_t n = std::min((uint64_t)(count - done), (uint64_t)run * blockSize - inBlock);
+        memcpy(buf + done, ioBuf.data() + inBlock, n);
+        done += n;
+    }
+    return done;
+}
+
+// True if cp has shared the blocks of the file with a copy, they must be
+// unshared before the file is written
+bool
+FS::isShared(const dir_entry& entry)
+{
+    return entry.first_blk != 0xFFFF && refs[entry.first_blk] != 0;
+}
+
+// Writes count bytes at offset into the blocks of a file, one disk request
+// per run of consecutive blocks. Blocks before oldBlocks hold data, the
+// parts of them that are not written are kept, the others are padded
+// with zeroes. Returns 0 or -3 on an I/O error.
+int
+FS::writeData(const std::vector<uint16_t>& blocks, size_t oldBlocks, const char* buf, uint32_t count, uint32_t offset)
+{
+    uint64_t totalBlocks = ((uint64_t)offset % blockSize + count + blockSize - 1) / blockSize;
+    std::vector<uint8_t> ioBuf(std::min(totalBlocks, (uint64_t)MAX_IO_BLOCKS) * blockSize);
+    uint32_t done = 0;
+    while (done < count)
+    {
+        uint32_t pos = offset + done;
+        size_t index = pos / blockSize;
+        unsigned inBlock = pos % blockSize;
+        uint64_t blocksLeft = ((uint64_t)inBlock + (count - done) + blockSize - 1) / blockSize;
+        unsigned run = mapRun(blocks, index, std::min(blocksLeft, (uint64_t)MAX_IO_BLOCKS));
+        uint32_t n = std::min((uint64_t)(count - done), (uint64_t)run * blockSize - inBlock);
+        size_t lastIndex = index + run - 1;
+        uint8_t* lastBuf = ioBuf.data() + (size_t)(run - 1) * blockSize;
+        bool head = inBlock != 0;
+        bool tail = (inBlock + n) % blockSize != 0 && !(lastIndex == index && head);
+
+        // The first and last block of the run may be partly written. Old
+        // ones are read first, under their block locks so another writer
+        // of the same block doesn't lose its update.
+        std::unique_lock<std::mutex> headLock(blockLocks[blocks[index] % LOCK_STRIPES], std::defer_lock);
+        std::unique_lock<std::mutex> tailLock(blockLocks[blocks[lastIndex] % LOCK_STRIPES], std::defer_lock);
+        bool lockHead = head && index < oldBlocks;
+        bool lockTail = tail && lastIndex < oldBlocks;
+        if (lockHead && lockTail && headLock.mutex() != tailLock.mutex())
+        {
+            std::lock(headLock, tailLock);
+        }
+        else if (lockHead || lockTail)
+        {
+            (lockHead ? headLock : tailLock).lock();
+        }
+
+        bool failed = false;
+        if (head)
+        {
+            if (index < oldBlocks)
+            {
+                failed = cache.read(blocks[index], ioBuf.data()) != 0;
+            }
+            else
+            {
+                memset(ioBuf.data(), 0, blockSize);
+            }
+        }
+        if (tail)
+        {
+            if (lastIndex < oldBlocks)
+            {
+                failed = failed || cache.read(blocks[lastIndex], lastBuf) != 0;
+            }
+            else
+            {
+                memset(lastBuf, 0, blockSize);
+            }
+        }
+        memcpy(ioBuf.data() + inBlock, buf + done, n);
+        if (failed || cache.write_blocks(blocks[index], run, ioBuf.data()) != 0)
+        {
+            return -3;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// writes count bytes starting at offset. Blocks that are only partly
+// written keep the rest of their data. Returns count, -1 for a bad handle,
+// -2 if it is not open for writing, -3 on an I/O error, -4 if the disk is
+// full and -5 if the file would grow past 4 GiB.
+//
+// A write inside the blocks and size the file already has changes no
+// metadata and runs with metaLock shared. Otherwise the blocks it needs
+// are allocated as a command, the data is written with metaLock shared,
+// and they are linked to the file as a second command. If the file
+// changes in between, the write starts over.
+int64_t
+FS::pwrite(int fd, const char* buf, uint32_t count, uint32_t offset)
+{
+    if (fd < 0)
+    {
+        return -1;
+    }
+    std::lock_guard<std::mutex> handle(handleLocks[fd % LOCK_STRIPES]);
+    while (true)
+    {
+        uint32_t end = offset + count;
+        {
+            lock_scope scope(*this, false);
+            open_file* file = getOpenFile(fd);
+            if (file == nullptr)
+            {
+                return -1;
+            }
+            if (!(file->mode & WRITE))
+            {
+                return -2;
+            }
+            if ((uint64_t)offset + count > UINT32_MAX)
+            {
+                return -5;
+            }
+            if (count == 0)
+            {
+                return 0;
+            }
+            bool inPlace = end <= file->entry.size && !(file->entry.access_rights & INLINE_DATA) &&
+                           file->entry.first_blk != 0xFFFF && !isShared(file->entry);
+            if (inPlace)
+            {
+                if (loadBlockMap(*file) != 0 ||
+                    writeData(file->blocks, file->blocks.size(), buf, count, offset) != 0)
+                {
+                    return -3;
+                }
+                if (disk.barrier() != 0)
+                {
+                    std::cerr << "ERROR: Can't make the command durable" << std::endl;
+                }
+                return count;
+            }
+        }
+
+        // Make the file writable, fill a gap before offset and allocate the
+        // blocks past its end after its last block
+        std::vector<uint16_t> blocks;
+        std::vector<uint16_t> newBlocks;
+        size_t oldBlocks;
+        uint64_t formats;
+        {
+            command_scope scope(*this);
+            open_file* file = getOpenFile(fd);
+            if (file == nullptr)
+            {
+                return -1;
+            }
+            int retVal = prepareWrite(*file);
+            if (retVal != 0)
+            {
+                return retVal;
+            }
+            if (offset > file->entry.size)
+            {
+                retVal = resizeFile(*file, offset);
+                if (retVal != 0)
+                {
+                    return retVal;
+                }
+            }
+            if (loadBlockMap(*file) != 0)
+            {
+                return -3;
+            }
+            oldBlocks = file->blocks.size();
+            size_t needBlocks = ((uint64_t)end + blockSize - 1) / blockSize;
+            if (needBlocks > oldBlocks)
+            {
+                unsigned goal = (oldBlocks != 0) ? file->blocks.back() + 1 : file->dirBlock;
+                if (allocator.allocate_blocks(needBlocks - oldBlocks, newBlocks, goal) != 0)
+                {
+                    return -4;
+                }
+            }
+            else if (end <= file->entry.size)
+            {
+                continue; // the file was only made writable, write in place
+            }
+            blocks = file->blocks;
+            blocks.insert(blocks.end(), newBlocks.begin(), newBlocks.end());
+            formats = formatCount;
+        }
+
+        // The new blocks belong to no file yet, only this call writes them.
+        // A change of the file clears its block map, and cp sharing its
+        // blocks with a copy raises their reference count, either sends
+        // the write back through prepareWrite.
+        bool changed = false;
+        int written = 0;
+        {
+            lock_scope scope(*this, false);
+            open_file* file = getOpenFile(fd);
+            if (formatCount != formats || file == nullptr)
+            {
+                return -1; // format closed the handle and freed the blocks
+            }
+            changed = !file->mapped || isShared(file->entry);
+            if (!changed)
+            {
+                written = writeData(blocks, oldBlocks, buf, count, offset);
+            }
+        }
+
+        // Link the new blocks after the last block of the file
+        command_scope scope(*this);
+        open_file* file = getOpenFile(fd);
+        if (formatCount != formats || file == nullptr)
+        {
+            return -1;
+        }
+        if (changed || !file->mapped || isShared(file->entry) || written != 0)
+        {
+            releaseBlocks(newBlocks);
+            if (written != 0)
+            {
+                return written;
+            }
+            continue;
+        }
+        if (!newBlocks.empty())
+        {
+            int retVal = extendFile(file->entry.first_blk, newBlocks);
+            if (retVal != 0)
+            {
+                releaseBlocks(newBlocks);
+                return (retVal > 0) ? -4 : -3;
+            }
+            file->blocks.swap(blocks);
+        }
+        if (end > file->entry.size)
+        {
+            file->entry.size = end;
+        }
+        if (saveOpenFile(*file) != 0)
+        {
+            return -3;
+        }
+        return count;
+    }
+}
+
+// truncate <fd> <size> sets the size of the file, bytes added read as
+// zeroes. Returns the error codes of pwrite.
+int
+FS::truncate(int fd, uint32_t size)
+{
+    if (fd < 0)
+    {
+        return -1;
+    }
+    std::lock_guard<std::mutex> handle(handleLocks[fd % LOCK_STRIPES]);
+    command_scope scope(*this);
+    open_file* file = getOpenFile(fd);
+    if (file == nullptr)
+    {
+        return -1;
+    }
+    if (!(file->mode & WRITE))
+    {
+        return -2;
+    }
+    if (size == file->entry.size)
+    {
+        return 0;
+    }
+    int retVal = prepareWrite(*file);
+    if (retVal != 0)
+    {
+        return retVal;
+    }
+    return resizeFile(*file, size);
+}
+
+// close <fd> releases the handle, -1 if it is not open
+int
+FS::close(int fd)
+{
+    if (fd < 0)
+    {
+        return -1;
+    }
+    std::lock_guard<std::mutex> handle(handleLocks[fd % LOCK_STRIPES]);
+    lock_scope scope(*this, false);
+    open_file* file = getOpenFile(fd);
+    if (file == nullptr)
+    {
+        return -1;
+    }
+    std::lock_guard<std::mutex> guard(fileTableLock);
+    *file = open_file();
+    return 0;
+}
+
+// sync writes all pending metadata (the FAT) and cached blocks back to
+// the disk, on a journaled disk by committing them first. The log is
+// checkpointed afterwards, so nothing in it is replayed at the next mount.
+int
+FS::sync()
+{
+    lock_scope scope(*this, true);
+    if (sb.journal_blocks != 0)
+    {
+        if (commitJournal() != 0)
+        {
+            return 2;
+        }
+        if (journalHead != 0 && checkpointJournal() != 0)
+        {
+            return 3;
+        }
+        return (disk.sync() != 0) ? 3 : 0;
+    }
+    groupCommands = 0;
+    if (cache.sync() != 0)
+    {
+        return 1;
+    }
+    if (syncFat() != 0)
+    {
+        return 2;
+    }
+    if (disk.sync() != 0)
+    {
+        return 3;
+    }
+    return 0;
+}
+
+// sets how many FAT updates may accumulate before the FAT is written
+// back automatically, 0 means only on sync() and unmount
+void
+FS::set_fat_sync_interval(unsigned updates)
+{
+    lock_scope scope(*this, true);
+    fatSyncInterval = updates;
+    if (fatSyncInterval != 0 && fatUpdates >= fatSyncInterval && sb.journal_blocks == 0)
+    {
+        syncFat();
+    }
+}
+
+// sets how many commands may share one journal commit and how old the
+// first of them may get before they are committed
+void
+FS::set_journal_group(unsigned commands, unsigned millis)
+{
+    lock_scope scope(*this, true);
+    groupMaxCommands = std::max(commands, 1u);
+    groupMaxMs = millis;
+}
+
+// returns the commit counters of the journal
+journal_stats
+FS::get_journal_stats()
+{
+    lock_scope scope(*this, false);
+    return jstats;
+}
+
+// sets when writes are made durable besides sync, interval_ms is used by
+// the periodic mode
+void
+FS::set_durability(DiskDurability mode, unsigned interval_ms)
+{
+    lock_scope scope(*this, true);
+    disk.set_durability(mode, interval_ms);
+}
+
+// returns how many times the disk has been synced since mount
+uint64_t
+FS::get_disk_syncs()
+{
+    return disk.get_syncs();
+}
+
+// picks how cat and cp carry out the reads and writes they keep in flight
+void
+FS::set_aio_backend(AioBackend backend)
+{
+    lock_scope scope(*this, true);
+    disk.set_aio_backend(backend);
+}
+
+// sets how many blocks cat and cp may read ahead, 0 turns readahead off
+void
+FS::set_readahead(unsigned blocks)
+{
+    lock_scope scope(*this, true);
+    readaheadBlocks = blocks;
+}
+
+// sets how many blocks the block cache may hold, 0 disables caching
+int
+FS::set_cache_capacity(unsigned blocks)
+{
+    lock_scope scope(*this, true);
+    return cache.set_capacity(blocks);
+}
+
+// returns the hit/miss/eviction counters of the block cache
+cache_stats
+FS::get_cache_stats()
+{
+    return cache.get_stats();
+}
+
+// sets how many path components the dentry cache may hold, 0 disables it
+void
+FS::set_dcache_capacity(unsigned entries)
+{
+    lock_scope scope(*this, true);
+    dcache.set_capacity(entries);
+}
+
+// returns the hit/miss counters of the dentry cache
+dcache_stats
+FS::get_dcache_stats()
+{
+    return dcache.get_stats();
+}
+
+// sets how many file block maps may be cached, 0 disables the cache
+void
+FS::set_bmap_capacity(unsigned maps)
+{
+    lock_scope scope(*this, true);
+    bmap.set_capacity(maps);
+}
+
+// returns the hit/miss counters of the block map cache
+bmap_stats
+FS::get_bmap_stats()
+{
+    return bmap.get_stats();
+}
+
+// Adds the block layout of every file in the directory tree below dirBlock
+void
+FS::collectFragmentation(uint16_t dirBlock, frag_stats& stats)
+{
+    std::vector<dir_entry> entries;
+    if (readDir(dirBlock, entries) != 0)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (entries[i].file_name[0] == '\0' || strcmp(entries[i].file_name, "..") == 0)
+        {
+            continue;
+        }
+        if (entries[i].type == TYPE_DIR)
+        {
+            collectFragmentation(entries[i].first_blk, stats);
+            continue;
+        }
+        if (entries[i].first_blk == 0xFFFF)
+        {
+            continue; // empty file, no blocks
+        }
+
+        // Every jump to a non-adjacent block starts a new fragment
+        std::vector<extent> extents;
+        if (chainExtents(entries[i].first_blk, extents) != 0)
+        {
+            continue;
+        }
+        unsigned fragments = extents.size();
+
+        stats.files++;
+        stats.fragments += fragments;
+        if (fragments > 1)
+        {
+            stats.fragmented_files++;
+        }
+    }
+}
+
+// reports how scattered the blocks of files and the free space are
+int
+FS::fragmentation(frag_stats& stats)
+{
+    lock_scope scope(*this, false);
+    if (!formatted)
+    {
+        return FS_UNFORMATTED;
+    }
+    stats = frag_stats{};
+    collectFragmentation(ROOT_BLOCK, stats);
+    allocator.free_runs(stats.free_runs, stats.largest_free_run);
+    stats.free_blocks = allocator.get_free_count();
+    return 0;
+}
@@ -1,20 +1,93 @@
 #include <iostream>
 #include <cstdint>
+#include <vector>
+#include <string>
+#include <set>
+#include <deque>
+#include <unordered_map>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <atomic>
 #include "disk.h"
+#include "cache.h"
+#include "dcache.h"
+#include "bmap.h"
+#include "alloc.h"
+#include "readahead.h"
+#include "rwlock.h"
 
 #ifndef __FS_H__
 #define __FS_H__
 
-#define ROOT_BLOCK 0
-#define FAT_BLOCK 1
+// Disk layout: the superblock, the root directory, the FAT (as many
+// blocks as the geometry needs), the block reference counts, the metadata
+// journal if the disk has one, then data blocks
+#define SUPER_BLOCK 0
+#define ROOT_BLOCK 1
+#define FAT_BLOCK 2
 #define FAT_FREE 0
 #define FAT_EOF -1
+// first block of a file stored as extents, it holds the extent list. The
+// data blocks of such a file are marked FAT_EOF.
+#define FAT_LAYOUT -2
+
+#define FS_MAGIC 0x31544146 // "FAT1"
+#define FS_VERSION 5
+// oldest version that can still be mounted, version 2 has no extent files,
+// version 3 no inline files and version 4 no journal
+#define FS_MIN_VERSION 2
+// returned by every command but format while the disk holds no file system
+// this version can mount, negated by the handle calls
+#define FS_UNFORMATTED 100
+
+// how new files store their blocks
+#define LAYOUT_FAT 0     // a chain of FAT entries
+#define LAYOUT_EXTENTS 1 // an extent list in a FAT_LAYOUT block
+
+// limits on the geometry chosen at format time. first_blk is 16 bits and
+// 0xFFFF marks an empty file, so there can be at most 0xFFFF blocks.
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define MIN_DISK_SIZE (64 * 1024)
+#define MAX_NO_BLOCKS 0xFFFF
+
+// most extra owners a shared block can have, one byte per block on disk
+#define MAX_BLOCK_REFS 255
+
+// largest number of blocks moved in one disk request
+#define MAX_IO_BLOCKS 64
+
+// number of locks directories and open files are spread over
+#define LOCK_STRIPES 64
 
 #define TYPE_FILE 0
 #define TYPE_DIR 1
 #define READ 0x04
 #define WRITE 0x02
 #define EXECUTE 0x01
+// access_rights flag of a file whose data follows its name in file_name,
+// such a file has no blocks
+#define INLINE_DATA 0x80
+
+// extra open() mode bit, creates an empty file if there is none
+#define OPEN_CREATE 0x08
+
+// The journal is a header block followed by a log of transactions. Each
+// transaction is a descriptor (one or more blocks listing the home blocks
+// of the images and the blocks freed since they were logged), the block
+// images and a commit block.
+#define JOURNAL_MAGIC 0x4C4E524A       // "JRNL"
+#define JOURNAL_DESC_MAGIC 0x4353444A  // "JDSC"
+#define JOURNAL_COMMIT_MAGIC 0x4D4F434A // "JCOM"
+// journal size used by format when asked for one, at most an eighth of the disk
+#define JOURNAL_DEFAULT_BLOCKS 256
+// header, descriptor, one image and a commit block
+#define JOURNAL_MIN_BLOCKS 4
+// a group of commands is committed together once it has this many
+// commands or its first command is this old
+#define JOURNAL_GROUP_COMMANDS 16
+#define JOURNAL_GROUP_MS 20
 
 struct dir_entry {
     char file_name[56]; // name of the file / sub-directory
@@ -24,25 +97,293 @@ struct dir_entry {
     uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
 };
 
+// first block of the disk, describes the layout of the file system
+struct superblock {
+    uint32_t magic;        // FS_MAGIC
+    uint32_t version;      // FS_VERSION
+    uint32_t block_size;   // bytes per block
+    uint32_t no_blocks;    // blocks on the disk, including the reserved ones
+    uint32_t fat_start;    // first block of the FAT
+    uint32_t fat_blocks;   // number of FAT blocks, 4-byte entries
+    uint32_t root_block;   // block of the root directory
+    uint32_t alloc_policy; // AllocPolicy for new blocks
+    uint32_t ref_start;    // first block of the reference counts
+    uint32_t ref_blocks;   // number of reference count blocks, 1-byte entries
+    uint32_t layout;       // LAYOUT_FAT or LAYOUT_EXTENTS for new files
+    uint32_t inline_data;  // 1 if small files may be stored in their entry
+    uint32_t journal_start;  // first block of the journal
+    uint32_t journal_blocks; // number of journal blocks, 0 if there is none
+};
+
+// first block of the journal, transactions before start_seq are applied
+struct journal_header {
+    uint32_t magic;     // JOURNAL_MAGIC
+    uint32_t start_seq; // sequence number of the first transaction in the log
+};
+
+// start of a transaction, followed by the home block numbers of the
+// images and then the freed block numbers, 4 bytes each
+struct journal_descriptor {
+    uint32_t magic;   // JOURNAL_DESC_MAGIC
+    uint32_t seq;     // sequence number of the transaction
+    uint32_t blocks;  // block images in the transaction
+    uint32_t revokes; // blocks whose earlier images must not be replayed
+};
+
+// end of a transaction, only transactions with a valid one are replayed
+struct journal_commit {
+    uint32_t magic;    // JOURNAL_COMMIT_MAGIC
+    uint32_t seq;      // same as in the descriptor
+    uint32_t checksum; // of the descriptor and image blocks
+};
+
+// start of a FAT_LAYOUT block, the extents of the file follow it
+struct layout_header {
+    uint32_t extents;  // number of extents in the block
+    uint32_t reserved;
+};
+
+// settings chosen when the disk is formatted
+struct format_options {
+    AllocPolicy policy = ALLOC_FIRST_FIT; // block placement policy
+    bool secure = false; // overwrite every data block with zeroes
+    unsigned block_size = 0; // bytes per block, 0 keeps the current size
+    unsigned no_blocks = 0;  // blocks on the disk, 0 keeps the current number
+    bool extents = false;    // store new files as extent lists
+    bool inline_data = true; // store files that fit after their name in the entry
+    unsigned journal_blocks = 0; // blocks for the metadata journal, 0 for none
+};
+
+// journal activity since mount
+struct journal_stats {
+    uint64_t commands;     // commands that may have changed metadata
+    uint64_t commits;      // transactions written to the log
+    uint64_t blocks;       // block images written to the log
+    uint64_t checkpoints;  // times the whole log was applied and reused
+    uint64_t replayed;     // transactions replayed at mount
+};
+
+// how scattered the blocks on the disk are
+struct frag_stats {
+    unsigned files;            // files with at least one block
+    unsigned fragmented_files; // files whose blocks are not one contiguous run
+    unsigned fragments;        // contiguous runs summed over all files
+    unsigned free_blocks;
+    unsigned free_runs;        // contiguous runs of free blocks
+    unsigned largest_free_run;
+};
+
 class FS {
 private:
+    // in-memory index of one directory, built the first time the directory
+    // is used. Slots are numbered across the blocks of the directory chain.
+    struct dir_index {
+        std::vector<uint16_t> blocks; // blocks of the directory in chain order
+        std::unordered_map<std::string, uint32_t> names; // name -> slot
+        std::set<uint32_t> freeSlots; // empty slots, lowest is used first
+    };
+    // where a directory is linked from
+    struct dir_parent {
+        uint16_t parent; // first block of the parent directory
+        std::string name; // name of the directory in its parent
+    };
+    // a file opened with open(), until it is closed
+    struct open_file {
+        bool used = false;
+        uint8_t mode = 0;      // READ and/or WRITE
+        uint16_t dirBlock = 0; // first block of the directory holding the entry
+        uint32_t slot = 0;     // slot of the entry in that directory
+        dir_entry entry{};     // copy of the entry
+        std::vector<uint16_t> blocks; // block map, the n-th block of the file
+        bool mapped = false;   // blocks matches the chain of entry
+    };
+
     Disk disk;
-    // size of a FAT entry is 2 bytes
-    int16_t fat[BLOCK_SIZE/2];
-    uint16_t currentDirectory = ROOT_BLOCK;
+    // write-back cache for directory and data blocks
+    BlockCache cache{disk};
+    // (directory, name) -> block lookups for resolvePath
+    DentryCache dcache;
+    // first block -> extents of file chains, so chains are not walked again
+    BlockMapCache bmap;
+    superblock sb{};
+    unsigned blockSize = BLOCK_SIZE;
+    unsigned entriesPerBlock = BLOCK_SIZE / sizeof(dir_entry);
+    // size of a FAT entry is 4 bytes, padded to whole FAT blocks
+    std::vector<int32_t> fat;
+    // FAT blocks that differ from the copy on disk
+    std::vector<bool> fatBlockDirty;
+    // extra owners of each block beyond the first, for blocks cp shares
+    // between files
+    std::vector<uint8_t> refs;
+    // reference count blocks that differ from the copy on disk
+    std::vector<bool> refBlockDirty;
+    // true when any FAT or reference count block differs from the copy on disk
+    bool fatDirty = false;
+    // number of FAT updates since the FAT was last written back
+    unsigned fatUpdates = 0;
+    // write the FAT back after this many updates, 0 = only on sync/unmount
+    unsigned fatSyncInterval = 0;
+    // free-space bitmap built from the FAT
+    BlockAllocator allocator;
+    // current directory of every thread that has cd'd out of the root
+    // directory, the others are in the root directory
+    std::unordered_map<std::thread::id, uint16_t> sessionDirs;
+    std::mutex sessionLock;
+    // last block of file chains appended to since mount, by first block
+    std::unordered_map<uint16_t, uint16_t> chainTails;
+    // what std::cout wrote to when the file system was mounted
+    std::streambuf* stdoutBuffer = std::cout.rdbuf();
+    // name indexes of the directories used since mount, by first block
+    std::unordered_map<uint16_t, dir_index> dirIndexes;
+    // parent and name of every directory listed in an indexed directory,
+    // by first block, so pwd needs no disk access
+    std::unordered_map<uint16_t, dir_parent> parentNames;
+    // open file table, indexed by handle. Handles stay where they are while
+    // open adds more, fileTableLock guards the table itself.
+    std::deque<open_file> openFiles;
+    std::mutex fileTableLock;
+    // bumped by format, which closes every handle
+    uint64_t formatCount = 0;
+    // false until a file system has been mounted or formatted, every
+    // command but format is refused until then
+    bool formatted = false;
+    // next free block of the journal log and sequence number of the next
+    // transaction
+    unsigned journalHead = 0;
+    uint32_t journalSeq = 1;
+    // blocks with an image in the log, and those of them freed since the
+    // last commit
+    std::set<uint16_t> journalLogged;
+    std::vector<uint16_t> journalRevokes;
+    // blocks freed since the last commit, the allocator gets them back
+    // once the commit has made the free durable
+    std::vector<uint16_t> journalFreed;
+    // commands since the last commit or periodic write-back, and when the
+    // first of them ended
+    unsigned groupCommands = 0;
+    std::chrono::steady_clock::time_point groupStart;
+    unsigned groupMaxCommands = JOURNAL_GROUP_COMMANDS;
+    unsigned groupMaxMs = JOURNAL_GROUP_MS;
+    journal_stats jstats{};
+    // largest readahead window of cat and cp in blocks, 0 turns it off
+    unsigned readaheadBlocks = READAHEAD_DEFAULT_BLOCKS;
+    // Commands that may change metadata hold metaLock exclusively, those
+    // that only read hold it shared. metaOwner is the thread holding it
+    // exclusively, so calls it makes to other public calls don't lock again.
+    RWLock metaLock;
+    std::atomic<std::thread::id> metaOwner{std::thread::id()};
+    // Calls holding metaLock shared may build directory indexes and write
+    // file data at the same time: dirLocks keep them from building one
+    // directory twice, indexLock guards dirIndexes and parentNames, and
+    // blockLocks keep two writers from updating parts of one block at once
+    std::mutex dirLocks[LOCK_STRIPES];
+    std::mutex indexLock;
+    std::mutex blockLocks[LOCK_STRIPES];
+    // Calls on one handle run one at a time. The handle lock is taken
+    // before metaLock, so a write may let go of metaLock between steps.
+    std::mutex handleLocks[LOCK_STRIPES];
+    // holds metaLock until it goes out of scope
+    struct lock_scope {
+        FS& fs;
+        bool exclusive;
+        bool locked = false; // false if the thread already held it
+        lock_scope(FS& fs, bool exclusive);
+        ~lock_scope();
+    };
+    // ends a command that may change metadata when it goes out of scope,
+    // metaLock is held exclusively until then
+    struct command_scope {
+        FS& fs;
+        lock_scope lock;
+        command_scope(FS& fs) : fs(fs), lock(fs, true) {}
+        ~command_scope() { if (lock.locked) fs.endCommand(); }
+    };
     
+    int mount();
+    int writeSuperblock();
+    void setGeometry(unsigned block_size, unsigned no_blocks, unsigned journal_blocks = 0);
+    void setFat(unsigned block, int32_t value);
+    void setRef(unsigned block, uint8_t value);
+    int writeDirtyBlocks(unsigned firstBlock, const uint8_t* data, std::vector<bool>& dirty);
+    void markFatDirty();
+    int syncFat();
+    void linkBlocks(const std::vector<uint16_t>& blocks);
+    void releaseBlocks(const std::vector<uint16_t>& blocks);
+    void freeBlock(unsigned block);
+    void releaseFreed();
+    unsigned chainRun(int32_t block, unsigned maxBlocks);
+    int chainExtents(uint16_t firstBlock, std::vector<extent>& extents);
+    int ioRuns(uint16_t firstBlock, uint64_t bytes, std::vector<extent>& runs);
+    unsigned layoutCapacity();
+    int writeLayout(uint16_t layoutBlock, const std::vector<extent>& extents);
+    int extendFile(uint16_t& firstBlock, const std::vector<uint16_t>& blocks);
+    int shrinkFile(uint16_t& firstBlock, size_t keep);
+    int convertDir(uint16_t dirBlock, std::unordered_map<uint16_t, uint16_t>& converted);
+    bool fitsInline(size_t nameLength, uint64_t size);
+    std::string inlineData(const dir_entry& entry);
+    int storeData(dir_entry& entry, const std::string& data, unsigned goal, bool allowInline);
+    int uninline(dir_entry& entry, unsigned goal);
+    int readChain(int32_t block, uint32_t size, std::string& data);
+    int writeBlocks(const std::vector<uint16_t>& blocks, const char* data, size_t size);
+    int copyChain(int32_t block, const std::vector<uint16_t>& dstBlocks);
+    int32_t chainTail(uint16_t firstBlock);
+    int shareChain(int32_t block);
+    void releaseChain(int32_t block);
+    int unshareChain(dir_entry& file, unsigned goal);
+    int readDir(uint16_t dirBlock, std::vector<dir_entry>& entries, std::vector<uint16_t>* blocks = nullptr);
+    dir_index* findDirIndex(uint16_t dirBlock);
+    dir_index* getDirIndex(uint16_t dirBlock);
+    int lookupName(uint16_t dirBlock, const std::string& name, dentry& entry);
+    int findEntry(dir_index& dir, const std::string& name, dir_entry& entry, uint32_t& slot);
+    int readEntry(dir_index& dir, uint32_t slot, dir_entry& entry);
+    int writeEntry(dir_index& dir, uint32_t slot, const dir_entry& entry);
+    int addEntry(dir_index& dir, const dir_entry& entry);
+    int removeEntry(dir_index& dir, uint32_t slot);
+    bool findParent(uint16_t dirBlock, dir_parent& parent);
+    bool isAncestor(uint16_t dirBlock, uint16_t ancestor);
+    int writeNewBlocks(const uint8_t* data, size_t bytes, unsigned goal, std::vector<uint16_t>& blocks);
+    int createFile(const std::string& filepath, bool raw, uint64_t nbytes);
     void splitParentPath(const std::string& path, std::string& parent, std::string& name);
     int resolvePath(const std::string& path, bool mustBeDir, uint16_t& outBlock);
+    uint16_t currentDirectory();
+    void setCurrentDirectory(uint16_t dirBlock);
+    bool isCurrentDirectory(uint16_t dirBlock);
+    bool stdoutIsPlainFd();
     std::string rightsTripletString(uint8_t rights);
+    void collectFragmentation(uint16_t dirBlock, frag_stats& stats);
+    open_file* getOpenFile(int fd);
+    int openEntry(const std::string& filepath, int mode, bool create);
+    bool isOpen(uint16_t dirBlock, uint32_t slot);
+    int loadBlockMap(open_file& file);
+    unsigned mapRun(const std::vector<uint16_t>& blocks, size_t index, unsigned maxBlocks);
+    int saveOpenFile(open_file& file);
+    bool isShared(const dir_entry& entry);
+    int prepareWrite(open_file& file);
+    int writeData(const std::vector<uint16_t>& blocks, size_t oldBlocks, const char* buf, uint32_t count, uint32_t offset);
+    int resizeFile(open_file& file, uint32_t size);
+    uint32_t journalChecksum(const uint8_t* data, size_t bytes);
+    int writeJournalHeader();
+    int replayJournal();
+    int commitJournal();
+    int checkpointJournal();
+    int writeBackMetadata();
+    void endCommand();
 
 public:
-    FS();
+    // Any number of threads may use one FS at once. Each thread has its own
+    // current directory for cd, pwd, ls and relative paths. The disk file
+    // is diskname, benches and tests use one of their own.
+    FS(const std::string& diskname = DISKNAME);
     ~FS();
     // formats the disk, i.e., creates an empty file system
     int format();
+    int format(const format_options& options);
     // create <filepath> creates a new file on the disk, the data content is
     // written on the following rows (ended with an empty row)
     int create(std::string filepath);
+    // create <filepath> <nbytes> creates a new file from exactly nbytes bytes
+    // of stdin, taken as they are
+    int create(std::string filepath, uint64_t nbytes);
     // cat <filepath> reads the content of a file and prints it on the screen
     int cat(std::string filepath);
     // ls lists the content in the current directory (files and sub-directories)
@@ -68,10 +409,76 @@ public:
     // pwd prints the full path, i.e., from the root directory, to the current
     // directory, including the current directory name
     int pwd();
+    // ends the session of the calling thread, its current directory is
+    // forgotten. A thread that has used cd calls it before it exits, so a
+    // later thread given the same id starts in the root directory.
+    void end_session();
 
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
     int chmod(std::string accessrights, std::string filepath);
+
+    // open <filepath> <mode> opens a file for reading (READ) and/or writing
+    // (WRITE), with OPEN_CREATE an empty file is created if there is none.
+    // Returns a handle >= 0. Like the other handle calls below it returns a
+    // negative error code on failure.
+    int open(std::string filepath, int mode);
+    // reads up to count bytes starting at offset, returns the number of
+    // bytes read, 0 at the end of the file
+    int64_t pread(int fd, char* buf, uint32_t count, uint32_t offset);
+    // writes count bytes starting at offset, the file grows as needed and a
+    // gap before offset reads as zeroes. Returns count.
+    int64_t pwrite(int fd, const char* buf, uint32_t count, uint32_t offset);
+    // truncate <fd> <size> sets the size of the file, bytes added read as zeroes
+    int truncate(int fd, uint32_t size);
+    // close <fd> releases the handle
+    int close(int fd);
+
+    // convert rewrites every file stored as a FAT chain as an extent list,
+    // files created afterwards are stored as extents as well
+    int convert_extents();
+
+    // sync writes all pending metadata (the FAT) and cached blocks back to
+    // the disk, on a journaled disk by committing them first
+    int sync();
+    // sets how many FAT updates may accumulate before the FAT is written
+    // back automatically, 0 means only on sync() and unmount
+    void set_fat_sync_interval(unsigned updates);
+    // sets how many commands may share one journal commit and how old the
+    // first of them may get, in milliseconds, before they are committed.
+    // 1 commits every command on its own.
+    void set_journal_group(unsigned commands, unsigned millis);
+    // returns the commit counters of the journal
+    journal_stats get_journal_stats();
+    // sets when writes are made durable besides sync: after every write,
+    // at the end of every command, or every interval_ms by a background
+    // thread. Metadata is written back at the same points.
+    void set_durability(DiskDurability mode, unsigned interval_ms = SYNC_DEFAULT_INTERVAL_MS);
+    // returns how many times the disk has been synced since mount
+    uint64_t get_disk_syncs();
+    // picks how cat and cp carry out the reads and writes they keep in
+    // flight: synchronously, with io_uring or with a thread pool
+    void set_aio_backend(AioBackend backend);
+    // sets how many blocks cat and cp may read ahead of the ones in use,
+    // 0 turns readahead off
+    void set_readahead(unsigned blocks);
+    // sets how many blocks the block cache may hold, 0 disables caching
+    int set_cache_capacity(unsigned blocks);
+    // returns the hit/miss/eviction counters of the block cache
+    cache_stats get_cache_stats();
+    // sets how many path components the dentry cache may hold, 0 disables it
+    void set_dcache_capacity(unsigned entries);
+    // returns the hit/miss counters of the dentry cache
+    dcache_stats get_dcache_stats();
+    // sets how many file block maps may be cached, 0 disables the cache
+    void set_bmap_capacity(unsigned maps);
+    // returns the hit/miss counters of the block map cache
+    bmap_stats get_bmap_stats();
+    unsigned get_block_size() { return blockSize; }
+    unsigned get_no_blocks() { return disk.get_no_blocks(); }
+    // reports how scattered the blocks of files and the free space are,
+    // fragments / files is 1.0 when every file is contiguous
+    int fragmentation(frag_stats& stats);
 };
 
 #endif // __FS_H__
@@ -1,10 +1,20 @@
 #include "shell.h"
 #include "fs.h"
 #include "disk.h"
+#include <cstdlib>
+#include <cstring>
 
 int
 main(int argc, char **argv)
 {
+    // --mmap selects the memory-mapped disk backend, --durability=<mode>
+    // when writes are synced (none, write, command or periodic)
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mmap") == 0)
+            setenv("FS_DISK_BACKEND", "mmap", 1);
+        else if (strncmp(argv[i], "--durability=", 13) == 0)
+            setenv("FS_DURABILITY", argv[i] + 13, 1);
+    }
     Shell shell;
     shell.run();
     return 0;
@@ -0,0 +1,116 @@
+#include <algorithm>
+#include "readahead.h"
+
+ReadAhead::ReadAhead(Disk& disk, BlockCache& cache, const std::vector<extent>& runs,
+                     unsigned max_window, unsigned max_request)
+    : disk(disk), cache(cache), runs(runs), max_window(max_window), max_request(max_request)
+{
+    window = std::min((unsigned)READAHEAD_MIN_BLOCKS, max_window);
+}
+
+ReadAhead::~ReadAhead()
+{
+    for (size_t i = 0; i < pieces.size(); i++)
+    {
+        if (pieces[i].ticket != 0)
+        {
+            disk.wait(pieces[i].ticket);
+        }
+    }
+}
+
+// Starts reading the next piece of the file, no larger than the window.
+// Returns -1 if the read can't be started.
+int
+ReadAhead::start_next()
+{
+    unsigned count = std::min(runs[run].count - used, max_request);
+    if (window > 0)
+    {
+        count = std::min(count, window);
+    }
+    piece p;
+    p.blocks = extent{(uint16_t)(runs[run].start + used), (uint16_t)count};
+    p.ticket = 0;
+    if (!spare.empty())
+    {
+        p.buf.swap(spare.back());
+        spare.pop_back();
+    }
+
+    // The read goes around the cache, so the disk file must be current
+    if (cache.peek(p.blocks.start, count) == nullptr)
+    {
+        if (cache.flush_blocks(p.blocks.start, count) != 0)
+        {
+            return -1;
+        }
+        p.buf.resize((size_t)count * disk.get_block_size());
+        p.ticket = disk.submit_read(p.blocks.start, count, p.buf.data());
+        if (p.ticket == 0)
+        {
+            return -1;
+        }
+    }
+
+    used += count;
+    if (used == runs[run].count)
+    {
+        run++;
+        used = 0;
+    }
+    in_flight += count;
+    pieces.push_back(std::move(p));
+    return 0;
+}
+
+// hands out the next piece of the file
+int
+ReadAhead::next(extent& blocks, const uint8_t*& data)
+{
+    // The piece handed out last is used up, the window grows with it
+    if (handed_out)
+    {
+        in_flight -= pieces.front().blocks.count;
+        spare.push_back(std::move(pieces.front().buf));
+        pieces.pop_front();
+        handed_out = false;
+        window = std::min(window * 2, max_window);
+    }
+
+    while (run < runs.size() && (pieces.empty() || in_flight < window))
+    {
+        if (start_next() != 0)
+        {
+            return -1;
+        }
+    }
+    if (pieces.empty())
+    {
+        return 1;
+    }
+
+    piece& p = pieces.front();
+    handed_out = true;
+    blocks = p.blocks;
+    if (p.ticket != 0)
+    {
+        int failed = disk.wait(p.ticket);
+        p.ticket = 0;
+        data = p.buf.data();
+        return (failed != 0) ? -1 : 0;
+    }
+
+    // Straight from the cache or disk mapping when they still hold it
+    data = cache.peek(blocks.start, blocks.count);
+    if (data == nullptr)
+    {
+        p.buf.resize((size_t)blocks.count * disk.get_block_size());
+        if (cache.read_blocks(blocks.start, blocks.count, p.buf.data()) != 0)
+        {
+            return -1;
+        }
+        data = p.buf.data();
+    }
+    return 0;
+}
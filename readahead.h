@@ -0,0 +1,56 @@
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include "disk.h"
+#include "cache.h"
+#include "bmap.h"
+
+#ifndef __READAHEAD_H__
+#define __READAHEAD_H__
+
+// blocks read ahead at the start of a file, the window doubles with every
+// piece used
+#define READAHEAD_MIN_BLOCKS 16
+// largest readahead window unless configured otherwise
+#define READAHEAD_DEFAULT_BLOCKS 512
+
+// Reads the blocks of a file in order, piece by piece. The reads of the
+// pieces after the one in use are kept in flight, as many blocks as the
+// window, which grows while the file is read sequentially. The pieces are
+// read into buffers of their own, around the cache, unless the cache or
+// disk mapping already holds them.
+class ReadAhead {
+private:
+    struct piece {
+        extent blocks;
+        uint64_t ticket; // 0 if the cache or disk mapping holds the blocks
+        std::vector<uint8_t> buf;
+    };
+    Disk& disk;
+    BlockCache& cache;
+    std::vector<extent> runs;
+    size_t run = 0;    // run the next piece starts in
+    unsigned used = 0; // blocks of that run already started
+    std::deque<piece> pieces; // started and not used up, oldest first
+    std::vector<std::vector<uint8_t>> spare; // buffers of used pieces
+    unsigned max_window;
+    unsigned max_request;
+    unsigned window;
+    unsigned in_flight = 0; // blocks in pieces
+    bool handed_out = false; // the oldest piece is in use
+
+    int start_next();
+public:
+    // runs are the blocks of the file in order, read max_request blocks
+    // at a time at most. max_window 0 turns readahead off, each piece is
+    // then read only once it is needed.
+    ReadAhead(Disk& disk, BlockCache& cache, const std::vector<extent>& runs,
+              unsigned max_window, unsigned max_request);
+    // waits for the reads still in flight
+    ~ReadAhead();
+    // hands out the next piece: its blocks and their contents, valid until
+    // the next call. Returns 1 after the last piece and -1 on a read error.
+    int next(extent& blocks, const uint8_t*& data);
+};
+
+#endif // __READAHEAD_H__
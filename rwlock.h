@@ -0,0 +1,32 @@
+#include <pthread.h>
+
+#ifndef __RWLOCK_H__
+#define __RWLOCK_H__
+
+// Reader/writer lock: any number of threads hold it shared, or one holds
+// it exclusively. C++11 has no shared mutex, this wraps the pthread one.
+// Waiting writers go before new readers, so a steady stream of readers
+// can't starve them; a thread must therefore never take it shared twice.
+class RWLock {
+private:
+    pthread_rwlock_t rwlock;
+public:
+    RWLock()
+    {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&rwlock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
+    ~RWLock() { pthread_rwlock_destroy(&rwlock); }
+    RWLock(const RWLock&) = delete;
+    RWLock& operator=(const RWLock&) = delete;
+    // exclusive, so std::lock_guard and std::unique_lock work with it
+    void lock() { pthread_rwlock_wrlock(&rwlock); }
+    void unlock() { pthread_rwlock_unlock(&rwlock); }
+    void lock_shared() { pthread_rwlock_rdlock(&rwlock); }
+    void unlock_shared() { pthread_rwlock_unlock(&rwlock); }
+};
+
+#endif // __RWLOCK_H__
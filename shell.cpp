@@ -1,6 +1,7 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <cstdlib>
 #include <vector>
 #include "shell.h"
 #include "fs.h"
@@ -9,7 +10,7 @@ std::string commands_str[] = {
     "format", "create", "cat", "ls",
     "cp", "mv", "rm", "append",
     "mkdir", "cd", "pwd",
-    "chmod",
+    "chmod", "convert", "sync",
     "help", "quit"
 };
 
@@ -66,26 +67,57 @@ Shell::run()
         }
 
         if (cmd == "format") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: format\n";
+            format_options options;
+            bool valid = true;
+            for (unsigned i = 1; i < cmd_line.size(); ++i) {
+                if (cmd_line[i] == "first")
+                    options.policy = ALLOC_FIRST_FIT;
+                else if (cmd_line[i] == "next")
+                    options.policy = ALLOC_NEXT_FIT;
+                else if (cmd_line[i] == "best")
+                    options.policy = ALLOC_BEST_FIT;
+                else if (cmd_line[i] == "secure")
+                    options.secure = true;
+                else if (cmd_line[i] == "extents")
+                    options.extents = true;
+                else if (cmd_line[i] == "noinline")
+                    options.inline_data = false;
+                else if (cmd_line[i] == "journal")
+                    options.journal_blocks = JOURNAL_DEFAULT_BLOCKS;
+                else if (cmd_line[i].compare(0, 8, "journal=") == 0)
+                    options.journal_blocks = strtoul(cmd_line[i].c_str() + 8, nullptr, 10);
+                else if (cmd_line[i].compare(0, 3, "bs=") == 0)
+                    options.block_size = strtoul(cmd_line[i].c_str() + 3, nullptr, 10);
+                else if (cmd_line[i].compare(0, 7, "blocks=") == 0)
+                    options.no_blocks = strtoul(cmd_line[i].c_str() + 7, nullptr, 10);
+                else
+                    valid = false;
+            }
+            if (!valid) {
+                std::cout << "Usage: format [first|next|best] [secure] [extents] [noinline] [journal[=<blocks>]] [bs=<bytes>] [blocks=<count>]\n";
                 continue;
             }
             // check return value so everything is ok
-            ret_val = filesystem.format();
+            ret_val = filesystem.format(options);
             if (ret_val) {
                 std::cout << "Error: format failed, error code " << ret_val << std::endl;
             }
         }
 
         else if (cmd == "create") {
-            if (cmd_line.size() != 2) {
-                std::cout << "Usage: create <file>\n";
+            if (cmd_line.size() != 2 && cmd_line.size() != 3) {
+                std::cout << "Usage: create <file> [<nbytes>]\n";
                 continue;
             }
             arg1 = cmd_line[1];
-            std::cout << "Enter data. Empty line to end.\n";
             // check return value so everything is ok
-            ret_val = filesystem.create(arg1);
+            if (cmd_line.size() == 3) {
+                std::cout << "Enter " << cmd_line[2] << " bytes of data.\n";
+                ret_val = filesystem.create(arg1, strtoull(cmd_line[2].c_str(), nullptr, 10));
+            } else {
+                std::cout << "Enter data. Empty line to end.\n";
+                ret_val = filesystem.create(arg1);
+            }
             if (ret_val) {
                 std::cout << "Error: create " << arg1;
                 std::cout << " failed, error code " << ret_val << std::endl;
@@ -232,12 +264,36 @@ Shell::run()
             }
         }
 
+        else if (cmd == "convert") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: convert\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.convert_extents();
+            if (ret_val) {
+                std::cout << "Error: convert failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "sync" || cmd == "fsync") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: sync\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.sync();
+            if (ret_val) {
+                std::cout << "Error: sync failed, error code " << ret_val << std::endl;
+            }
+        }
+
         else if (cmd == "quit")
             running = false;
 
         else if (cmd == "help") {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, convert, sync, help, quit\n";
         }
 
         else if (cmd == "") {
@@ -246,7 +302,7 @@ Shell::run()
 
         else {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, convert, sync, help, quit\n";
         }
     }
 }
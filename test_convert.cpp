@@ -0,0 +1,134 @@
+// Converts files stored as FAT chains to extent lists and checks that
+// their contents come through unchanged, also after a remount, and that
+// the converted files can still be written and removed. Prints OK or what
+// went wrong and returns non-zero on failure.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "fs.h"
+
+// scratch disk image, the shell's diskfile.bin is left alone
+#define TEST_DISK "/tmp/test_convert.bin"
+
+#define FILES 6
+
+// Writes data at offset into the file at path, creating it if needed
+static bool
+write_file(FS& filesystem, const std::string& path, const std::string& data, uint32_t offset)
+{
+    int fd = filesystem.open(path, READ | WRITE | OPEN_CREATE);
+    if (fd < 0)
+        return false;
+    bool ok = filesystem.pwrite(fd, data.data(), data.size(), offset) == (int64_t)data.size();
+    filesystem.close(fd);
+    return ok;
+}
+
+// Reads the whole file at path, which has size bytes, empty if it can't be read
+static std::string
+read_file(FS& filesystem, const std::string& path, uint32_t size)
+{
+    std::string data(size + 1, '\0');
+    int fd = filesystem.open(path, READ);
+    if (fd < 0)
+        return "";
+    int64_t done = filesystem.pread(fd, &data[0], size + 1, 0);
+    filesystem.close(fd);
+    return (done == (int64_t)size) ? data.substr(0, size) : "";
+}
+
+static unsigned
+free_blocks(FS& filesystem)
+{
+    frag_stats stats;
+    filesystem.fragmentation(stats);
+    return stats.free_blocks;
+}
+
+// the files and what they hold
+struct test_file {
+    std::string path;
+    std::string data;
+};
+
+// Checks that every file holds its data
+static bool
+check(FS& filesystem, const std::vector<test_file>& files, const char* when)
+{
+    for (const test_file& f : files) {
+        if (read_file(filesystem, f.path, f.data.size()) != f.data) {
+            std::cout << f.path << " changed " << when << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int
+main()
+{
+    std::vector<test_file> files;
+    unsigned before;
+    bool ok = true;
+    {
+        FS filesystem(TEST_DISK);
+        filesystem.format();
+        before = free_blocks(filesystem);
+        filesystem.mkdir("/d");
+        // files grown a block at a time in turns, so their chains interleave
+        for (int i = 0; i < FILES; i++)
+            files.push_back({(i % 2) ? "/d/f" + std::to_string(i) : "/f" + std::to_string(i), ""});
+        for (int round = 0; round < 8; round++) {
+            for (int i = 0; i < FILES; i++) {
+                if (round > i + 1)
+                    continue;
+                std::string data(BLOCK_SIZE - 3 * i, (char)('a' + i * 8 + round));
+                ok = write_file(filesystem, files[i].path, data, files[i].data.size()) && ok;
+                files[i].data += data;
+            }
+        }
+        // a copy sharing the blocks of a file, and a file in its entry
+        ok = filesystem.cp("/f4", "/d/copy") == 0 && ok;
+        files.push_back({"/d/copy", files[4].data});
+        ok = write_file(filesystem, "/small", "small", 0) && ok;
+        files.push_back({"/small", "small"});
+        if (!ok) {
+            std::cout << "can't write the files" << std::endl;
+            return 1;
+        }
+
+        if (filesystem.convert_extents() != 0) {
+            std::cout << "convert failed" << std::endl;
+            return 1;
+        }
+        ok = check(filesystem, files, "by convert");
+        ok = ok && filesystem.convert_extents() == 0 && check(filesystem, files, "by a second convert");
+    }
+
+    FS filesystem(TEST_DISK);
+    ok = ok && check(filesystem, files, "at remount after convert");
+    // the converted files still grow, and the copy stays apart
+    for (size_t i = 0; i < files.size(); i++) {
+        test_file& f = files[i];
+        std::string data(BLOCK_SIZE + 10, (char)('Z' - i));
+        ok = ok && write_file(filesystem, f.path, data, f.data.size() - 1);
+        f.data.replace(f.data.size() - 1, 1, data);
+    }
+    ok = ok && check(filesystem, files, "when written after convert");
+    for (const test_file& f : files) {
+        if (ok && filesystem.rm(f.path) != 0) {
+            std::cout << "can't remove " << f.path << " after convert" << std::endl;
+            ok = false;
+        }
+    }
+    if (ok && (filesystem.rm("/d") != 0 || free_blocks(filesystem) != before)) {
+        std::cout << "removing the converted files didn't free all their blocks" << std::endl;
+        ok = false;
+    }
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+
+    unlink(TEST_DISK);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,143 @@
+// Copies files, which share their blocks until one side is written, and
+// checks that the copies stay apart and that removing them gives every
+// block back. Prints OK or what went wrong and returns non-zero on failure.
+
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include "fs.h"
+
+// scratch disk image, the shell's diskfile.bin is left alone
+#define TEST_DISK "/tmp/test_cow.bin"
+
+#define FILE_BLOCKS 5
+
+// Writes data at offset into the file at path, creating it if needed
+static bool
+write_file(FS& filesystem, const std::string& path, const std::string& data, uint32_t offset)
+{
+    int fd = filesystem.open(path, READ | WRITE | OPEN_CREATE);
+    if (fd < 0)
+        return false;
+    bool ok = filesystem.pwrite(fd, data.data(), data.size(), offset) == (int64_t)data.size();
+    filesystem.close(fd);
+    return ok;
+}
+
+// Reads size bytes of the file at path, empty if it can't be read
+static std::string
+read_file(FS& filesystem, const std::string& path, uint32_t size)
+{
+    std::string data(size, '\0');
+    int fd = filesystem.open(path, READ);
+    if (fd < 0)
+        return "";
+    int64_t done = filesystem.pread(fd, &data[0], size, 0);
+    filesystem.close(fd);
+    return (done == (int64_t)size) ? data : "";
+}
+
+static unsigned
+free_blocks(FS& filesystem)
+{
+    frag_stats stats;
+    filesystem.fragmentation(stats);
+    return stats.free_blocks;
+}
+
+// A copy takes no data blocks, a write to it leaves the original alone,
+// and once both are removed all their blocks are free again
+static bool
+write_to_copy(FS& filesystem)
+{
+    std::string data(FILE_BLOCKS * BLOCK_SIZE, 'a');
+    std::string patch(10, 'b');
+    unsigned before = free_blocks(filesystem);
+    if (!write_file(filesystem, "/a", data, 0)) {
+        std::cout << "can't write /a" << std::endl;
+        return false;
+    }
+    unsigned written = free_blocks(filesystem);
+    if (filesystem.cp("/a", "/b") != 0 || free_blocks(filesystem) != written) {
+        std::cout << "cp /a /b didn't share the blocks of /a" << std::endl;
+        return false;
+    }
+    if (!write_file(filesystem, "/b", patch, BLOCK_SIZE + 100)) {
+        std::cout << "can't write /b" << std::endl;
+        return false;
+    }
+    std::string copy = data;
+    copy.replace(BLOCK_SIZE + 100, patch.size(), patch);
+    if (read_file(filesystem, "/a", data.size()) != data) {
+        std::cout << "a write to /b showed up in /a" << std::endl;
+        return false;
+    }
+    if (read_file(filesystem, "/b", copy.size()) != copy) {
+        std::cout << "a write to /b was lost" << std::endl;
+        return false;
+    }
+    if (filesystem.rm("/a") != 0 || filesystem.rm("/b") != 0 || free_blocks(filesystem) != before) {
+        std::cout << "removing /a and /b didn't free all their blocks" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Removing the original keeps the blocks a copy still uses, removing the
+// last copy frees them
+static bool
+remove_original(FS& filesystem)
+{
+    std::string data(FILE_BLOCKS * BLOCK_SIZE, 'c');
+    unsigned before = free_blocks(filesystem);
+    if (!write_file(filesystem, "/a", data, 0) || filesystem.cp("/a", "/b") != 0 ||
+        filesystem.cp("/b", "/c") != 0 || filesystem.rm("/a") != 0) {
+        std::cout << "can't copy and remove /a" << std::endl;
+        return false;
+    }
+    // takes any block the removal freed by mistake
+    if (!write_file(filesystem, "/d", std::string(FILE_BLOCKS * BLOCK_SIZE, 'd'), 0)) {
+        std::cout << "can't write /d" << std::endl;
+        return false;
+    }
+    if (read_file(filesystem, "/b", data.size()) != data || read_file(filesystem, "/c", data.size()) != data) {
+        std::cout << "removing /a changed its copies" << std::endl;
+        return false;
+    }
+    if (filesystem.rm("/b") != 0 || filesystem.rm("/d") != 0 || read_file(filesystem, "/c", data.size()) != data) {
+        std::cout << "removing /b changed /c" << std::endl;
+        return false;
+    }
+    if (filesystem.rm("/c") != 0 || free_blocks(filesystem) != before) {
+        std::cout << "removing the last copy didn't free its blocks" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main()
+{
+    bool ok;
+    {
+        FS filesystem(TEST_DISK);
+        filesystem.format();
+        ok = write_to_copy(filesystem);
+        ok = remove_original(filesystem) && ok;
+    }
+    // the same again with the blocks stored as extent lists
+    {
+        FS filesystem(TEST_DISK);
+        format_options options;
+        options.block_size = BLOCK_SIZE;
+        options.no_blocks = DEFAULT_NO_BLOCKS;
+        options.extents = true;
+        filesystem.format(options);
+        ok = write_to_copy(filesystem) && ok;
+        ok = remove_original(filesystem) && ok;
+    }
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+
+    unlink(TEST_DISK);
+    return ok ? 0 : 1;
+}
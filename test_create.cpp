@@ -0,0 +1,121 @@
+// Creates files from stdin, both from lines and from a raw byte count, and
+// checks their contents and that input that ends early creates nothing.
+// Prints OK or what went wrong and returns non-zero on failure.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fs.h"
+
+// scratch disk image, the shell's diskfile.bin is left alone
+#define TEST_DISK "/tmp/test_create.bin"
+#define INPUT_FILE "/tmp/test_create.in"
+
+// Makes input the contents of stdin
+static void
+set_input(const std::string& input)
+{
+    {
+        std::ofstream f(INPUT_FILE, std::ios::binary);
+        f << input;
+    }
+    int fr = open(INPUT_FILE, O_RDONLY);
+    dup2(fr, 0);
+    close(fr);
+    std::cin.clear();
+}
+
+// Reads size bytes of the file at path, empty if it can't be read
+static std::string
+read_file(FS& filesystem, const std::string& path, uint32_t size)
+{
+    std::string data(size, '\0');
+    int fd = filesystem.open(path, READ);
+    if (fd < 0)
+        return "";
+    int64_t done = filesystem.pread(fd, &data[0], size, 0);
+    filesystem.close(fd);
+    return (done == (int64_t)size) ? data : "";
+}
+
+static unsigned
+free_blocks(FS& filesystem)
+{
+    frag_stats stats;
+    filesystem.fragmentation(stats);
+    return stats.free_blocks;
+}
+
+// Lines up to the empty one make up the file, each with its newline
+static bool
+from_lines(FS& filesystem)
+{
+    std::string line(100, 'l');
+    std::string data;
+    for (int i = 0; i < 100; i++)
+        data += line + "\n";
+    set_input(data + "\n");
+    if (filesystem.create("/lines") != 0 || read_file(filesystem, "/lines", data.size()) != data) {
+        std::cout << "create from lines went wrong" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Raw input is taken as it is, empty lines and zero bytes included, in
+// files that fit in the entry, fill whole blocks or end within one
+static bool
+raw(FS& filesystem)
+{
+    const uint64_t sizes[] = {20, BLOCK_SIZE, 3 * BLOCK_SIZE + 123};
+    for (uint64_t size : sizes) {
+        std::string data(size, '\0');
+        for (size_t i = 0; i < data.size(); i++)
+            data[i] = (i % 7 == 0) ? '\n' : (char)i;
+        std::string path = "/raw" + std::to_string(size);
+        set_input(data);
+        if (filesystem.create(path, size) != 0 || read_file(filesystem, path, size) != data) {
+            std::cout << "raw create of " << size << " bytes went wrong" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Input that ends before nbytes fails with 8 and leaves no file and no
+// blocks behind
+static bool
+raw_short(FS& filesystem)
+{
+    unsigned before = free_blocks(filesystem);
+    set_input(std::string(2 * BLOCK_SIZE + 10, 's'));
+    if (filesystem.create("/short", 3 * BLOCK_SIZE) != 8) {
+        std::cout << "raw create with short input didn't return 8" << std::endl;
+        return false;
+    }
+    if (filesystem.open("/short", READ) >= 0 || free_blocks(filesystem) != before) {
+        std::cout << "raw create with short input left a file or blocks behind" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main()
+{
+    bool ok;
+    {
+        FS filesystem(TEST_DISK);
+        filesystem.format();
+        ok = from_lines(filesystem);
+        ok = raw(filesystem) && ok;
+        ok = raw_short(filesystem) && ok;
+    }
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+
+    unlink(INPUT_FILE);
+    unlink(TEST_DISK);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,98 @@
+// Formats disks with block sizes and block counts other than the default,
+// mounts them again and checks that the geometry and the files on them
+// are kept. Prints OK or what went wrong and returns non-zero on failure.
+
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include "fs.h"
+
+// scratch disk image, the shell's diskfile.bin is left alone
+#define TEST_DISK "/tmp/test_geometry.bin"
+
+// Writes data to a new file at path
+static bool
+write_file(FS& filesystem, const std::string& path, const std::string& data)
+{
+    int fd = filesystem.open(path, READ | WRITE | OPEN_CREATE);
+    if (fd < 0)
+        return false;
+    bool ok = filesystem.pwrite(fd, data.data(), data.size(), 0) == (int64_t)data.size();
+    filesystem.close(fd);
+    return ok;
+}
+
+// Reads size bytes of the file at path, empty if it can't be read
+static std::string
+read_file(FS& filesystem, const std::string& path, uint32_t size)
+{
+    std::string data(size, '\0');
+    int fd = filesystem.open(path, READ);
+    if (fd < 0)
+        return "";
+    int64_t done = filesystem.pread(fd, &data[0], size, 0);
+    filesystem.close(fd);
+    return (done == (int64_t)size) ? data : "";
+}
+
+// A disk that was never formatted is refused until it is
+static bool
+unformatted()
+{
+    unlink(TEST_DISK);
+    FS filesystem(TEST_DISK);
+    if (filesystem.ls() != FS_UNFORMATTED || filesystem.open("/f", READ | WRITE | OPEN_CREATE) != -FS_UNFORMATTED) {
+        std::cout << "an unformatted disk was used" << std::endl;
+        return false;
+    }
+    if (filesystem.format() != 0 || filesystem.ls() != 0) {
+        std::cout << "an unformatted disk can't be formatted" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Formats with block_size and no_blocks, writes a file of a few blocks in
+// a sub-directory and checks both after a remount
+static bool
+remount(unsigned block_size, unsigned no_blocks)
+{
+    std::string data(3 * block_size + block_size / 2, '\0');
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = 'a' + i % 26;
+    {
+        FS filesystem(TEST_DISK);
+        format_options options;
+        options.block_size = block_size;
+        options.no_blocks = no_blocks;
+        if (filesystem.format(options) != 0 || filesystem.mkdir("/d") != 0 ||
+            !write_file(filesystem, "/d/f", data)) {
+            std::cout << "can't write /d/f with bs=" << block_size << std::endl;
+            return false;
+        }
+    }
+    FS filesystem(TEST_DISK);
+    if (filesystem.get_block_size() != block_size || filesystem.get_no_blocks() != no_blocks) {
+        std::cout << "bs=" << block_size << " blocks=" << no_blocks << " came back as bs="
+                  << filesystem.get_block_size() << " blocks=" << filesystem.get_no_blocks() << std::endl;
+        return false;
+    }
+    if (read_file(filesystem, "/d/f", data.size()) != data) {
+        std::cout << "/d/f changed at remount with bs=" << block_size << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main()
+{
+    bool ok = unformatted();
+    ok = remount(1024, 2000) && ok;
+    ok = remount(8192, 300) && ok;
+    ok = remount(MIN_BLOCK_SIZE, MAX_NO_BLOCKS) && ok;
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+
+    unlink(TEST_DISK);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+// Reads, writes and truncates a file through a handle at and around block
+// boundaries and past the end of the file, checking every step against a
+// copy kept in memory. Prints OK or what went wrong and returns non-zero
+// on failure.
+
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include "fs.h"
+
+// scratch disk image, the shell's diskfile.bin is left alone
+#define TEST_DISK "/tmp/test_handles.bin"
+
+#define B BLOCK_SIZE
+
+// one step: a write of count bytes at offset, or a truncate to size
+struct step {
+    bool truncate;
+    uint32_t offset; // the size for a truncate
+    uint32_t count;
+};
+
+static const step steps[] = {
+    {false, 0, 10},              // small file
+    {false, B - 5, 10},          // across the first boundary
+    {false, B, B},               // exactly the second block
+    {false, 4 * B + 100, 50},    // past the end, leaving a gap
+    {true, 3 * B, 0},            // down to a boundary
+    {true, 5 * B, 0},            // up again, the new part reads as zeroes
+    {false, 2 * B, B},           // fill the third block
+    {true, 2 * B + 7, 0},        // down into it
+    {true, 3 * B - 1, 0},        // up within the same block and one short of a boundary
+    {false, 3 * B - 1, 2},       // across that boundary at the end
+    {false, 6 * B, B},           // a whole block past the end
+    {true, 0, 0},                // empty
+    {false, B / 2, 1},           // past the end of an empty file
+};
+
+// Compares the whole file behind fd and reads past its end
+static bool
+check(FS& filesystem, int fd, const std::string& expected, size_t n)
+{
+    std::string data(expected.size() + B, 'x');
+    int64_t done = filesystem.pread(fd, &data[0], data.size(), 0);
+    if (done != (int64_t)expected.size() || data.compare(0, done, expected) != 0) {
+        std::cout << "step " << n << ": read " << done << " bytes, expected "
+                  << expected.size() << " of other contents" << std::endl;
+        return false;
+    }
+    char c;
+    if (filesystem.pread(fd, &c, 1, expected.size()) != 0 || filesystem.pread(fd, &c, 1, expected.size() + B) != 0) {
+        std::cout << "step " << n << ": read past the end of the file" << std::endl;
+        return false;
+    }
+    if (expected.size() > 1) {
+        // a read crossing the end comes back short
+        done = filesystem.pread(fd, &data[0], 10, expected.size() - 1);
+        if (done != 1 || data[0] != expected.back()) {
+            std::cout << "step " << n << ": a read across the end returned " << done << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+run(FS& filesystem, const std::string& path)
+{
+    std::string expected;
+    int fd = filesystem.open(path, READ | WRITE | OPEN_CREATE);
+    if (fd < 0) {
+        std::cout << "can't open " << path << std::endl;
+        return false;
+    }
+    bool ok = true;
+    for (size_t n = 0; ok && n < sizeof(steps) / sizeof(steps[0]); n++) {
+        const step& s = steps[n];
+        if (s.truncate) {
+            expected.resize(s.offset, '\0');
+            ok = filesystem.truncate(fd, s.offset) == 0;
+        } else {
+            std::string data(s.count, (char)('a' + n));
+            if (expected.size() < s.offset + s.count)
+                expected.resize(s.offset + s.count, '\0');
+            expected.replace(s.offset, s.count, data);
+            ok = filesystem.pwrite(fd, data.data(), s.count, s.offset) == (int64_t)s.count;
+        }
+        if (!ok)
+            std::cout << "step " << n << " failed" << std::endl;
+        ok = ok && check(filesystem, fd, expected, n);
+        // the same through a new handle
+        if (ok) {
+            filesystem.close(fd);
+            fd = filesystem.open(path, READ | WRITE);
+            ok = fd >= 0 && check(filesystem, fd, expected, n);
+        }
+    }
+    filesystem.close(fd);
+    return ok;
+}
+
+int
+main()
+{
+    bool ok;
+    {
+        FS filesystem(TEST_DISK);
+        filesystem.format();
+        ok = run(filesystem, "/f");
+    }
+    // the same again with the blocks stored as extent lists
+    {
+        FS filesystem(TEST_DISK);
+        format_options options;
+        options.block_size = BLOCK_SIZE;
+        options.no_blocks = DEFAULT_NO_BLOCKS;
+        options.extents = true;
+        filesystem.format(options);
+        ok = run(filesystem, "/f") && ok;
+    }
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+
+    unlink(TEST_DISK);
+    return ok ? 0 : 1;
+}
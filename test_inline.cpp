@@ -0,0 +1,125 @@
+// Keeps small files in their directory entries and checks that they take
+// no blocks while they fit, move to blocks once they outgrow the entry,
+// and keep their contents when they shrink again and after a remount.
+// Prints OK or what went wrong and returns non-zero on failure.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fs.h"
+
+// scratch disk image, the shell's diskfile.bin is left alone
+#define TEST_DISK "/tmp/test_inline.bin"
+#define INPUT_FILE "/tmp/test_inline.in"
+
+// bytes a file with a one character name can keep in its entry
+#define INLINE_MAX (sizeof(dir_entry::file_name) - 2)
+
+// Creates the file at path from data given as raw input
+static int
+create_file(FS& filesystem, const std::string& path, const std::string& data)
+{
+    {
+        std::ofstream f(INPUT_FILE, std::ios::binary);
+        f << data;
+    }
+    int fr = open(INPUT_FILE, O_RDONLY);
+    dup2(fr, 0);
+    close(fr);
+    std::cin.clear();
+    return filesystem.create(path, data.size());
+}
+
+// Reads the whole file at path, which has size bytes, empty if it can't be read
+static std::string
+read_file(FS& filesystem, const std::string& path, uint32_t size)
+{
+    std::string data(size + 1, '\0');
+    int fd = filesystem.open(path, READ);
+    if (fd < 0)
+        return "";
+    int64_t done = filesystem.pread(fd, &data[0], size + 1, 0);
+    filesystem.close(fd);
+    return (done == (int64_t)size) ? data.substr(0, size) : "";
+}
+
+static unsigned
+free_blocks(FS& filesystem)
+{
+    frag_stats stats;
+    filesystem.fragmentation(stats);
+    return stats.free_blocks;
+}
+
+// Checks that the file at path holds data and that used blocks are in use
+static bool
+check(FS& filesystem, const std::string& path, const std::string& data, unsigned before, unsigned used)
+{
+    if (read_file(filesystem, path, data.size()) != data) {
+        std::cout << path << " doesn't hold its " << data.size() << " bytes" << std::endl;
+        return false;
+    }
+    if (free_blocks(filesystem) != before - used) {
+        std::cout << "with " << path << " at " << data.size() << " bytes " << before - free_blocks(filesystem)
+                  << " blocks are used, expected " << used << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main()
+{
+    std::string a(INLINE_MAX - 10, 'a');
+    std::string b(10, 'b');
+    std::string c(INLINE_MAX, 'c');
+    std::string big = a + b + c;
+    std::string shrunk = big.substr(0, 20);
+    bool ok = true;
+    unsigned before;
+    {
+        FS filesystem(TEST_DISK);
+        filesystem.format();
+        before = free_blocks(filesystem);
+        // right at the limit and one byte past it
+        ok = create_file(filesystem, "/c", c) == 0 && check(filesystem, "/c", c, before, 0);
+        ok = ok && create_file(filesystem, "/p", c + "p") == 0 && check(filesystem, "/p", c + "p", before, 1);
+        ok = ok && filesystem.rm("/p") == 0;
+
+        // grows in its entry, then past it
+        ok = ok && create_file(filesystem, "/i", a) == 0 && create_file(filesystem, "/b", b) == 0;
+        ok = ok && filesystem.append("/b", "/i") == 0 && check(filesystem, "/i", a + b, before, 0);
+        ok = ok && filesystem.append("/c", "/i") == 0 && check(filesystem, "/i", big, before, 1);
+
+        // shrinks back through a handle
+        int fd = filesystem.open("/i", READ | WRITE);
+        ok = ok && fd >= 0 && filesystem.truncate(fd, shrunk.size()) == 0;
+        filesystem.close(fd);
+        ok = ok && check(filesystem, "/i", shrunk, before, 1);
+
+        // a copy stays in its entry, a move to a longer name can't
+        std::string name(sizeof(dir_entry::file_name) - 3, 'n');
+        ok = ok && filesystem.cp("/c", "/k") == 0 && check(filesystem, "/k", c, before, 1);
+        ok = ok && filesystem.mkdir("/d") == 0 && filesystem.mv("/k", "/d/" + name) == 0;
+        ok = ok && check(filesystem, "/d/" + name, c, before, 3);
+        ok = ok && check(filesystem, "/b", b, before, 3);
+    }
+
+    FS filesystem(TEST_DISK);
+    ok = ok && check(filesystem, "/c", c, before, 3) && check(filesystem, "/i", shrunk, before, 3);
+    std::string name(sizeof(dir_entry::file_name) - 3, 'n');
+    ok = ok && check(filesystem, "/d/" + name, c, before, 3);
+    ok = ok && filesystem.rm("/d/" + name) == 0 && filesystem.rm("/d") == 0 && filesystem.rm("/i") == 0;
+    ok = ok && filesystem.rm("/b") == 0 && filesystem.rm("/c") == 0;
+    if (ok && free_blocks(filesystem) != before) {
+        std::cout << "removing the files didn't free all their blocks" << std::endl;
+        ok = false;
+    }
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+
+    unlink(INPUT_FILE);
+    unlink(TEST_DISK);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+// Unmounts and mounts a journaled file system between commands and checks
+// that replaying the journal never brings back old block contents. Prints
+// OK or what went wrong and returns non-zero on failure.
+
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include "fs.h"
+
+// scratch disk image, the shell's diskfile.bin is left alone
+#define TEST_DISK "/tmp/test_journal.bin"
+
+#define JOURNAL_BLOCKS 64
+
+// Formats the disk with a journal
+static void
+format_journaled(FS& filesystem)
+{
+    format_options options;
+    options.block_size = BLOCK_SIZE;
+    options.no_blocks = DEFAULT_NO_BLOCKS;
+    options.journal_blocks = JOURNAL_BLOCKS;
+    filesystem.format(options);
+}
+
+// Writes data at offset into the file at path, creating it if needed
+static bool
+write_file(FS& filesystem, const std::string& path, const std::string& data, uint32_t offset)
+{
+    int fd = filesystem.open(path, READ | WRITE | OPEN_CREATE);
+    if (fd < 0)
+        return false;
+    bool ok = filesystem.pwrite(fd, data.data(), data.size(), offset) == (int64_t)data.size();
+    filesystem.close(fd);
+    return ok;
+}
+
+// Reads size bytes at offset of the file at path, empty if it can't be read
+static std::string
+read_file(FS& filesystem, const std::string& path, uint32_t size, uint32_t offset)
+{
+    std::string data(size, '\0');
+    int fd = filesystem.open(path, READ);
+    if (fd < 0)
+        return "";
+    int64_t done = filesystem.pread(fd, &data[0], size, offset);
+    filesystem.close(fd);
+    return (done == (int64_t)size) ? data : "";
+}
+
+// Truncating a file zeroes the rest of its last block. A later write in
+// place must survive a remount, the zeroed block must not be replayed
+// over it.
+static bool
+write_after_truncate()
+{
+    {
+        FS filesystem(TEST_DISK);
+        format_journaled(filesystem);
+        int fd = filesystem.open("/f", READ | WRITE | OPEN_CREATE);
+        std::string data(6000, 'a');
+        if (fd < 0 || filesystem.pwrite(fd, data.data(), data.size(), 0) != (int64_t)data.size() ||
+            filesystem.truncate(fd, 5000) != 0) {
+            std::cout << "can't write /f" << std::endl;
+            return false;
+        }
+        filesystem.close(fd);
+        filesystem.sync();
+        if (!write_file(filesystem, "/f", std::string(100, 'b'), 4200)) {
+            std::cout << "can't write /f" << std::endl;
+            return false;
+        }
+    }
+    FS filesystem(TEST_DISK);
+    if (read_file(filesystem, "/f", 100, 4200) != std::string(100, 'b')) {
+        std::cout << "a write after truncate was lost at remount" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// A directory removed before its block was ever committed must not be
+// replayed over the file that gets the block next. The file system is
+// mounted a second time while the first mount is still up, as after a
+// crash, so the log is replayed.
+static bool
+reuse_of_removed_dir()
+{
+    std::string data(3000, 'c');
+    FS filesystem(TEST_DISK);
+    format_journaled(filesystem);
+    filesystem.set_journal_group(JOURNAL_BLOCKS, 60000);
+    if (filesystem.mkdir("/x") != 0 || filesystem.rm("/x") != 0) {
+        std::cout << "can't make and remove /x" << std::endl;
+        return false;
+    }
+    filesystem.set_journal_group(1, 0);
+    if (!write_file(filesystem, "/f", data, 0)) {
+        std::cout << "can't write /f" << std::endl;
+        return false;
+    }
+    FS remounted(TEST_DISK);
+    if (read_file(remounted, "/f", data.size(), 0) != data) {
+        std::cout << "a removed directory was replayed over /f at remount" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Blocks a removed file gave up must not get new data before the removal
+// is committed: after a crash the file is still there, and its contents
+// must be what they were
+static bool
+reuse_of_uncommitted_free()
+{
+    std::string old_data(3 * BLOCK_SIZE, 'a');
+    std::string new_data(3 * BLOCK_SIZE, 'b');
+    FS filesystem(TEST_DISK);
+    format_journaled(filesystem);
+    if (!write_file(filesystem, "/a", old_data, 0) || filesystem.sync() != 0) {
+        std::cout << "can't write /a" << std::endl;
+        return false;
+    }
+    filesystem.set_journal_group(JOURNAL_BLOCKS, 60000);
+    if (filesystem.rm("/a") != 0 || !write_file(filesystem, "/b", new_data, 0)) {
+        std::cout << "can't replace /a with /b" << std::endl;
+        return false;
+    }
+    FS remounted(TEST_DISK);
+    if (read_file(remounted, "/a", old_data.size(), 0) != old_data) {
+        std::cout << "data written after an uncommitted rm showed up in the removed file" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int
+main()
+{
+    bool ok = write_after_truncate();
+    ok = reuse_of_removed_dir() && ok;
+    ok = reuse_of_uncommitted_free() && ok;
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+
+    unlink(TEST_DISK);
+    return ok ? 0 : 1;
+}
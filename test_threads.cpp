@@ -0,0 +1,148 @@
+// Runs commands that race with each other from several threads and checks
+// that the file system stays consistent. Prints OK or what went wrong and
+// returns non-zero on failure.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <unistd.h>
+#include "fs.h"
+
+// scratch disk image, the shell's diskfile.bin is left alone
+#define TEST_DISK "/tmp/test_threads.bin"
+
+#define ROUNDS 5000
+// copies kept at a time
+#define KEEP 16
+#define START_SIZE 3000
+#define WRITE_SIZE 5000
+// bytes of the old data each growing write covers again
+#define OVERLAP 1000
+#define MAX_SIZE (64 * 1024)
+
+// Reads the whole file at path, empty if it can't be read
+static std::string
+read_file(FS& filesystem, const std::string& path, uint32_t size)
+{
+    std::string data(size, '\0');
+    int fd = filesystem.open(path, READ);
+    if (fd < 0)
+        return "";
+    int64_t done = filesystem.pread(fd, &data[0], size, 0);
+    filesystem.close(fd);
+    return (done == (int64_t)size) ? data : "";
+}
+
+// One thread grows a file through a handle, each write covering the end
+// of the old data, while another copies it. A copy shares the blocks of
+// the file until one of them is written, so the writes must never show in
+// a copy made before them. With all files removed the free space must be
+// what it was, the copies go in a directory of their own that is removed
+// as well since directories keep the blocks they have grown into.
+static bool
+copy_during_growing_writes(FS& filesystem)
+{
+    format_options options;
+    options.block_size = BLOCK_SIZE;
+    options.no_blocks = 8192;
+    filesystem.format(options);
+    frag_stats before;
+    filesystem.fragmentation(before);
+
+    filesystem.mkdir("/d");
+    int fd = filesystem.open("/f", READ | WRITE | OPEN_CREATE);
+    std::string data(START_SIZE, 'a');
+    if (fd < 0 || filesystem.pwrite(fd, data.data(), data.size(), 0) != (int64_t)data.size()) {
+        std::cout << "can't create /f" << std::endl;
+        return false;
+    }
+
+    // The writer keeps going until every copy is made, starting over from
+    // a short file once it has grown to MAX_SIZE
+    std::atomic<bool> copying{true};
+    int failures = 0;
+    int write_failures = 0;
+    std::thread writer([&]() {
+        std::string chunk(WRITE_SIZE, '\0');
+        uint32_t size = START_SIZE;
+        for (unsigned i = 0; copying; i++) {
+            if (size + WRITE_SIZE > MAX_SIZE) {
+                if (filesystem.truncate(fd, START_SIZE) != 0)
+                    write_failures++;
+                size = START_SIZE;
+            }
+            chunk.assign(WRITE_SIZE, (char)('b' + i % 20));
+            if (filesystem.pwrite(fd, chunk.data(), WRITE_SIZE, size - OVERLAP) != WRITE_SIZE)
+                write_failures++;
+            size += WRITE_SIZE - OVERLAP;
+        }
+    });
+
+    // Each copy is read as soon as it is made and again before it is
+    // removed to make room, KEEP rounds later
+    std::vector<std::string> copies(KEEP);
+    std::vector<uint32_t> sizes(KEEP);
+    bool changed = false;
+    for (unsigned i = 0; i < ROUNDS + KEEP && !changed; i++) {
+        std::string path = "/d/c" + std::to_string(i % KEEP);
+        if (i >= KEEP) {
+            changed = read_file(filesystem, path, sizes[i % KEEP]) != copies[i % KEEP];
+            if (filesystem.rm(path) != 0)
+                failures++;
+        }
+        if (i >= ROUNDS || changed)
+            continue;
+        if (filesystem.cp("/f", path) != 0) {
+            failures++;
+            continue;
+        }
+        // The size of the copy is fixed, find it by reading until the end
+        std::string& first = copies[i % KEEP];
+        uint32_t size = 0;
+        int copy = filesystem.open(path, READ);
+        char buf[4096];
+        int64_t n;
+        first.clear();
+        while ((n = filesystem.pread(copy, buf, sizeof(buf), size)) > 0) {
+            first.append(buf, n);
+            size += n;
+        }
+        filesystem.close(copy);
+        sizes[i % KEEP] = size;
+    }
+    copying = false;
+    writer.join();
+    filesystem.close(fd);
+    failures += write_failures;
+
+    bool ok = failures == 0 && !changed;
+    if (changed)
+        std::cout << "a copy changed after it was made" << std::endl;
+    for (unsigned i = 0; i < KEEP; i++)
+        filesystem.rm("/d/c" + std::to_string(i));
+    filesystem.rm("/d");
+    filesystem.rm("/f");
+    frag_stats after;
+    filesystem.fragmentation(after);
+    if (after.free_blocks != before.free_blocks) {
+        std::cout << "free blocks " << after.free_blocks << " after removing every file, "
+                  << before.free_blocks << " before" << std::endl;
+        ok = false;
+    }
+    if (failures != 0)
+        std::cout << failures << " commands failed" << std::endl;
+    return ok;
+}
+
+int
+main()
+{
+    FS filesystem(TEST_DISK);
+    bool ok = copy_during_growing_writes(filesystem);
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+
+    unlink(TEST_DISK);
+    return ok ? 0 : 1;
+}